@@ -0,0 +1,168 @@
+// Translates the examples at every -O level, with and without the 6502 optimizer, runs them on the simulator
+// and records the cycles they execute, the bytes they take up and how long the translation took.
+//
+// Usage: cycle_benchmark [--accept] <6502-c++> <baseline.json> <results.json> <example.cpp>...
+//
+// The results are written as JSON, one configuration per line. Every configuration that got slower or bigger than
+// the baseline by more than the threshold is reported and the exit code is 1. So is a missing baseline, or a
+// configuration that isn't in it. `--accept` writes the results over the baseline instead of comparing.
+
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fmt/format.h>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "include/simulator.hpp"
+
+// programs that never go back to BASIC (the games) are stopped here, only their size is compared then
+constexpr std::uint64_t cycle_budget = 20'000'000;
+
+// how much worse than the baseline a configuration may get before it counts as a regression
+constexpr double cycle_threshold = 0.02;
+constexpr double size_threshold  = 0.02;
+
+struct Result
+{
+  std::uint64_t cycles       = 0;
+  std::size_t   bytes        = 0;
+  double        translate_ms = 0;
+  bool          returned     = false;
+};
+
+std::map<std::string, Result> read_results(const std::filesystem::path &path)
+{
+  static const std::regex Entry(R"re(\s*\{\s*"name":\s*"([^"]+)",\s*"cycles":\s*(\d+),\s*"bytes":\s*(\d+),)re"
+                                R"re(\s*"translate_ms":\s*([0-9.]+),\s*"returned":\s*(true|false)\s*\},?)re");
+
+  std::map<std::string, Result> results;
+  std::ifstream                 file(path);
+  for (std::string line; std::getline(file, line);) {
+    std::smatch match;
+    if (std::regex_match(line, match, Entry)) {
+      results[match[1]] =
+        Result{ std::stoull(match[2]), std::stoull(match[3]), std::stod(match[4]), match[5] == "true" };
+    }
+  }
+  return results;
+}
+
+void write_results(const std::filesystem::path &path, const std::map<std::string, Result> &results)
+{
+  std::ofstream file(path, std::ofstream::trunc);
+  file << "[\n";
+  std::size_t written = 0;
+  for (const auto &[name, result] : results) {
+    file << fmt::format(
+      R"(  {{ "name": "{}", "cycles": {}, "bytes": {}, "translate_ms": {:.1f}, "returned": {} }}{})",
+      name,
+      result.cycles,
+      result.bytes,
+      result.translate_ms,
+      result.returned,
+      ++written == results.size() ? "" : ",")
+         << '\n';
+  }
+  file << "]\n";
+}
+
+int main(const int argc, const char *argv[])
+{
+  const bool accept = argc > 1 && std::string_view{ argv[1] } == "--accept";
+  const int  first  = accept ? 2 : 1;
+  if (argc < first + 4) {
+    fmt::print(stderr, "Usage: {} [--accept] <6502-c++> <baseline.json> <results.json> <example.cpp>...\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const std::string             translator{ argv[first] };
+  const std::filesystem::path   baseline_file{ argv[first + 1] };
+  const std::filesystem::path   results_file{ argv[first + 2] };
+  std::map<std::string, Result> results;
+
+  for (int arg = first + 3; arg < argc; ++arg) {
+    const std::filesystem::path example{ argv[arg] };
+
+    for (const auto level : { "0", "1", "2", "3", "s" }) {
+      for (const auto optimize : { false, true }) {
+        const auto name = fmt::format("{}-O{}{}", example.stem().string(), level, optimize ? "-optimize" : "");
+
+        // 6502-c++ leaves `<name>.prg` in the working directory
+        const auto prg_file = std::filesystem::current_path() / example.filename().replace_extension("prg");
+        std::filesystem::remove(prg_file);
+
+        const auto start  = std::chrono::steady_clock::now();
+        const auto status = std::system(
+          fmt::format("{} {} -t C64 -O{} --optimize={}", translator, example.string(), level, optimize ? 1 : 0)
+            .c_str());
+        const auto translate_ms =
+          std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        if (status != EXIT_SUCCESS) {
+          fmt::print(stderr, "{}: translation failed\n", name);
+          return EXIT_FAILURE;
+        }
+
+        std::ifstream                   prg_stream(prg_file, std::ios::binary);
+        const std::vector<std::uint8_t> prg{ std::istreambuf_iterator<char>(prg_stream),
+          std::istreambuf_iterator<char>() };
+
+        Simulator  simulator;
+        const bool returned = run_c64_prg(simulator, prg, cycle_budget);
+
+        results[name] = Result{ simulator.cycles, prg.size() - 2, translate_ms, returned };
+        fmt::print("{:40} {:>10} cycles{} {:>6} bytes {:>8.1f}ms\n",
+          name,
+          simulator.cycles,
+          returned ? " " : "+",
+          prg.size() - 2,
+          translate_ms);
+      }
+    }
+  }
+
+  write_results(results_file, results);
+
+  if (accept) {
+    write_results(baseline_file, results);
+    fmt::print("Accepted the results as the baseline in {}\n", baseline_file.string());
+    return EXIT_SUCCESS;
+  }
+
+  if (!std::filesystem::exists(baseline_file)) {
+    fmt::print("No baseline at {}, run with --accept to record one\n", baseline_file.string());
+    return EXIT_FAILURE;
+  }
+
+  int        regressions = 0;
+  const auto baseline    = read_results(baseline_file);
+  for (const auto &[name, result] : results) {
+    const auto before = baseline.find(name);
+    if (before == baseline.end()) {
+      fmt::print("{}: not in the baseline, run with --accept to record it\n", name);
+      ++regressions;
+      continue;
+    }
+
+    const auto worse = [](const auto now, const auto then, const double threshold) {
+      return static_cast<double>(now) > static_cast<double>(then) * (1.0 + threshold);
+    };
+
+    if (result.returned && before->second.returned && worse(result.cycles, before->second.cycles, cycle_threshold)) {
+      fmt::print("{}: cycles regressed from {} to {}\n", name, before->second.cycles, result.cycles);
+      ++regressions;
+    }
+    if (worse(result.bytes, before->second.bytes, size_threshold)) {
+      fmt::print("{}: size regressed from {} to {} bytes\n", name, before->second.bytes, result.bytes);
+      ++regressions;
+    }
+  }
+
+  return regressions == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
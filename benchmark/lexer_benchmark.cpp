@@ -0,0 +1,113 @@
+// Compares the single pass lexer against the std::regex cascade it replaced.
+//
+// Usage: lexer_benchmark <file.avr.asm>...
+//
+// The `.avr.asm` files are the avr-gcc intermediates that 6502-c++ keeps with `--save-temps`,
+// the `benchmark_corpus` target produces them from examples/.
+
+#include <chrono>
+#include <fmt/format.h>
+#include <fstream>
+#include <optional>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "include/lexer.hpp"
+
+// the classifier `run()` used before the lexer existed, kept here as the reference
+std::optional<LexedLine> regex_lex_line(const std::string &line)
+{
+  static const std::regex Comment(R"(\s*(\#|;)(.*))");
+  static const std::regex Label(R"(^\s*(\S+):.*)");
+  static const std::regex Directive(R"(^\s*(\..+))");
+  static const std::regex UnaryInstruction(R"(^\s+(\S+)\s+(\S+).*)");
+  static const std::regex BinaryInstruction(R"(^\s+(\S+)\s+(\S+),\s*(\S+).*)");
+  static const std::regex Instruction(R"(^\s+(\S+).*)");
+
+  const auto view = [&](const auto &sub) {
+    return std::string_view{ line }.substr(
+      static_cast<std::size_t>(sub.first - line.begin()), static_cast<std::size_t>(sub.length()));
+  };
+
+  std::smatch match;
+  if (std::regex_match(line, match, Label)) { return LexedLine{ LexedLine::Type::Label, view(match[1]), {}, {} }; }
+  if (std::regex_match(line, match, Comment)) { return LexedLine{ LexedLine::Type::Comment, view(match[2]), {}, {} }; }
+  if (std::regex_match(line, match, Directive)) {
+    return LexedLine{ LexedLine::Type::Directive, view(match[1]), {}, {} };
+  }
+  if (std::regex_match(line, match, BinaryInstruction)) {
+    return LexedLine{ LexedLine::Type::Instruction, view(match[1]), view(match[2]), view(match[3]) };
+  }
+  if (std::regex_match(line, match, UnaryInstruction)) {
+    return LexedLine{ LexedLine::Type::Instruction, view(match[1]), view(match[2]), {} };
+  }
+  if (std::regex_match(line, match, Instruction)) {
+    return LexedLine{ LexedLine::Type::Instruction, view(match[1]), {}, {} };
+  }
+  return std::nullopt;
+}
+
+bool same(const std::optional<LexedLine> &lhs, const std::optional<LexedLine> &rhs)
+{
+  if (lhs.has_value() != rhs.has_value()) { return false; }
+  if (!lhs) { return true; }
+  return lhs->type == rhs->type && lhs->text == rhs->text && lhs->operand1 == rhs->operand1
+         && lhs->operand2 == rhs->operand2;
+}
+
+template<typename Lexer> double time_lexer(const std::vector<std::string> &lines, Lexer lexer, std::size_t &recognized)
+{
+  constexpr static auto iterations = 5;
+  recognized = 0;
+
+  const auto start = std::chrono::steady_clock::now();
+  for (int iteration = 0; iteration < iterations; ++iteration) {
+    for (const auto &line : lines) {
+      if (lexer(line)) { ++recognized; }
+    }
+  }
+  const auto end = std::chrono::steady_clock::now();
+
+  recognized /= iterations;
+  return std::chrono::duration<double, std::milli>(end - start).count() / iterations;
+}
+
+int main(const int argc, const char **argv)
+{
+  if (argc < 2) {
+    fmt::print(stderr, "usage: {} <file.avr.asm>...\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::vector<std::string> lines;
+  for (int arg = 1; arg < argc; ++arg) {
+    std::ifstream input(argv[arg]);
+    if (!input) {
+      fmt::print(stderr, "unable to open '{}'\n", argv[arg]);
+      return EXIT_FAILURE;
+    }
+    for (std::string line; std::getline(input, line);) { lines.push_back(line); }
+  }
+
+  std::size_t mismatches = 0;
+  for (const auto &line : lines) {
+    if (!same(lex_line(line), regex_lex_line(line))) {
+      ++mismatches;
+      fmt::print(stderr, "mismatch: '{}'\n", line);
+    }
+  }
+
+  std::size_t lexer_recognized = 0;
+  std::size_t regex_recognized = 0;
+  const auto lexer_ms = time_lexer(lines, [](const std::string &line) { return lex_line(line); }, lexer_recognized);
+  const auto regex_ms = time_lexer(lines, regex_lex_line, regex_recognized);
+
+  fmt::print("lines: {} ({} recognized)\n", lines.size(), lexer_recognized);
+  fmt::print("regex: {:10.3f} ms\n", regex_ms);
+  fmt::print("lexer: {:10.3f} ms ({:.1f}x)\n", lexer_ms, regex_ms / lexer_ms);
+  fmt::print("mismatches: {}\n", mismatches);
+
+  return mismatches == 0 && lexer_recognized == regex_recognized ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,93 @@
+// Compares the perfect hash AVR mnemonic decoder against a linear compare chain,
+// which is how AVR::parse_opcode used to decode mnemonics.
+//
+// The mnemonics are drawn from a fixed mix that resembles avr-gcc -O1 output.
+
+#include <chrono>
+#include <cstdint>
+#include <fmt/format.h>
+#include <random>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "include/avr.hpp"
+
+AVR::OpCode linear_decode(const std::string_view name)
+{
+  for (const auto &mnemonic : avr_mnemonics) {
+    if (mnemonic.name == name) { return mnemonic.opcode; }
+  }
+  return AVR::OpCode::unknown;
+}
+
+template<typename Decoder>
+double time_decoder(const std::vector<std::string_view> &names, Decoder decoder, std::uint64_t &checksum)
+{
+  constexpr static auto iterations = 20;
+  checksum = 0;
+
+  const auto start = std::chrono::steady_clock::now();
+  for (int iteration = 0; iteration < iterations; ++iteration) {
+    for (const auto name : names) { checksum += static_cast<std::uint64_t>(decoder(name)); }
+  }
+  const auto end = std::chrono::steady_clock::now();
+
+  return std::chrono::duration<double, std::nano>(end - start).count()
+         / static_cast<double>(names.size() * iterations);
+}
+
+int main()
+{
+  // relative frequency of each mnemonic
+  constexpr static std::pair<std::string_view, int> mix[] = { { "ldi", 20 },
+    { "ldd", 12 },
+    { "std", 12 },
+    { "mov", 9 },
+    { "lds", 8 },
+    { "sts", 8 },
+    { "rjmp", 5 },
+    { "call", 5 },
+    { "st", 4 },
+    { "ld", 4 },
+    { "push", 3 },
+    { "pop", 3 },
+    { "ret", 3 },
+    { "brne", 3 },
+    { "breq", 2 },
+    { "cpi", 2 },
+    { "cpc", 2 },
+    { "subi", 2 },
+    { "sbci", 2 },
+    { "add", 2 },
+    { "adc", 2 },
+    { "movw", 2 },
+    { "lsl", 1 },
+    { "rol", 1 },
+    { "andi", 1 },
+    { "adiw", 1 },
+    { "sbiw", 1 },
+    { "tst", 1 } };
+
+  std::vector<std::string_view> weighted;
+  for (const auto &[name, weight] : mix) {
+    for (int count = 0; count < weight; ++count) { weighted.push_back(name); }
+  }
+
+  std::mt19937 generator{ 42 };
+  std::uniform_int_distribution<std::size_t> pick{ 0, weighted.size() - 1 };
+  std::vector<std::string_view> names;
+  names.reserve(1000000);
+  for (std::size_t count = 0; count < 1000000; ++count) { names.push_back(weighted[pick(generator)]); }
+
+  std::uint64_t hash_checksum = 0;
+  std::uint64_t linear_checksum = 0;
+  const auto hash_ns = time_decoder(names, decode_avr_mnemonic, hash_checksum);
+  const auto linear_ns = time_decoder(names, linear_decode, linear_checksum);
+
+  fmt::print("lookups: {}\n", names.size());
+  fmt::print("linear:       {:8.2f} ns/lookup\n", linear_ns);
+  fmt::print("perfect hash: {:8.2f} ns/lookup ({:.1f}x)\n", hash_ns, linear_ns / hash_ns);
+
+  return hash_checksum == linear_checksum ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,87 @@
+// Runs every runtime helper on the simulator with random operands and reports the cycles a call takes and the
+// bytes the helper (with the tables or helpers it needs) takes up.
+//
+// The operands are uniformly random, the divisors are mixed with small ones since those are the common case in
+// `x / 10` and `x % 8`.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fmt/format.h>
+#include <random>
+#include <string_view>
+#include <vector>
+
+#include "include/assembler.hpp"
+#include "include/personalities/c64.hpp"
+#include "include/runtime.hpp"
+#include "include/simulator.hpp"
+
+struct Helper
+{
+  std::string_view name;
+  RuntimeNeeds     needs;
+  MultiplyMode     multiply;
+  bool             word;
+};
+
+int main()
+{
+  constexpr static Helper helpers[] = { { "__mulqi3 fast", { .mulqi3 = true }, MultiplyMode::fast, false },
+    { "__mulqi3 compact", { .mulqi3 = true }, MultiplyMode::compact, false },
+    { "__mulhi3 fast", { .mulhi3 = true }, MultiplyMode::fast, true },
+    { "__mulhi3 compact", { .mulhi3 = true }, MultiplyMode::compact, true },
+    { "__udivmodqi4", { .udivmodqi4 = true }, MultiplyMode::fast, false },
+    { "__divmodqi4", { .divmodqi4 = true }, MultiplyMode::fast, false },
+    { "__udivmodhi4", { .udivmodhi4 = true }, MultiplyMode::fast, true },
+    { "__divmodhi4", { .divmodhi4 = true }, MultiplyMode::fast, true } };
+
+  constexpr static int calls = 100000;
+  const auto           reg   = [](const int number) { return register_address(C64{}, number); };
+
+  fmt::print("{:18} {:>6} {:>6} {:>8} {:>6}\n", "helper", "bytes", "min", "average", "max");
+  for (const auto &helper : helpers) {
+    std::vector<mos6502> lines;
+    lines.emplace_back(ASMLine::Type::Directive, "* = $1000");
+    append_runtime(C64{}, helper.needs, helper.multiply, lines);
+    const auto assembled = Assembler::assemble(lines, false);
+
+    Simulator simulator;
+    std::copy(assembled.bytes.begin(), assembled.bytes.end(), std::next(simulator.memory.begin(), 0x1000));
+
+    std::mt19937                            generator{ 42 };
+    std::uniform_int_distribution<unsigned> operand{ 0, helper.word ? 0xFFFFu : 0xFFu };
+    std::uniform_int_distribution<unsigned> small{ 1, 16 };
+
+    std::uint64_t minimum = UINT64_MAX;
+    std::uint64_t maximum = 0;
+    std::uint64_t total   = 0;
+    for (int call = 0; call < calls; ++call) {
+      const auto a = operand(generator);
+      const auto b = call % 2 == 0 ? operand(generator) : small(generator);
+      simulator.memory[reg(24)] = static_cast<std::uint8_t>(a);
+      simulator.memory[reg(25)] = static_cast<std::uint8_t>(a >> 8);
+      simulator.memory[reg(22)] = static_cast<std::uint8_t>(b);
+      simulator.memory[reg(23)] = static_cast<std::uint8_t>(b >> 8);
+
+      const auto start = simulator.cycles;
+      if (!simulator.call(0x1000, start + 10'000)) {
+        fmt::print("{} did not return\n", helper.name);
+        return EXIT_FAILURE;
+      }
+      const auto cycles = simulator.cycles - start;
+      minimum           = std::min(minimum, cycles);
+      maximum           = std::max(maximum, cycles);
+      total += cycles;
+    }
+
+    fmt::print("{:18} {:6} {:6} {:8.1f} {:6}\n",
+      helper.name,
+      assembled.bytes.size(),
+      minimum,
+      static_cast<double>(total) / calls,
+      maximum);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,38 @@
+# Writes the header that defines TRANSLATOR_VERSION, run at build time so that it follows every edit. The version is
+# `git describe` for people to read and a hash of the translator's sources, which tells apart two uncommitted edits
+# and builds without git. The header is only rewritten when the version changed.
+#
+# Usage: cmake -DSOURCE_DIR=<repository> -DOUTPUT=<header> [-DGIT_EXECUTABLE=<git>] -P TranslatorVersion.cmake
+
+file(GLOB_RECURSE TRANSLATOR_SOURCES "${SOURCE_DIR}/src/*.cpp" "${SOURCE_DIR}/include/*.hpp")
+list(SORT TRANSLATOR_SOURCES)
+
+set(SOURCES_HASH "")
+foreach(source ${TRANSLATOR_SOURCES})
+  file(RELATIVE_PATH name ${SOURCE_DIR} ${source})
+  file(SHA256 ${source} source_hash)
+  string(SHA256 SOURCES_HASH "${SOURCES_HASH}${name}${source_hash}")
+endforeach()
+string(SUBSTRING "${SOURCES_HASH}" 0 16 SOURCES_HASH)
+
+set(DESCRIBE "")
+if(GIT_EXECUTABLE)
+  execute_process(
+    COMMAND ${GIT_EXECUTABLE} describe --always --dirty
+    WORKING_DIRECTORY ${SOURCE_DIR}
+    OUTPUT_VARIABLE DESCRIBE
+    OUTPUT_STRIP_TRAILING_WHITESPACE
+    ERROR_QUIET)
+endif()
+if(NOT DESCRIBE)
+  set(DESCRIBE "no-git")
+endif()
+
+set(CONTENT "#define TRANSLATOR_VERSION \"${DESCRIBE}-${SOURCES_HASH}\"\n")
+set(PREVIOUS "")
+if(EXISTS ${OUTPUT})
+  file(READ ${OUTPUT} PREVIOUS)
+endif()
+if(NOT "${PREVIOUS}" STREQUAL "${CONTENT}")
+  file(WRITE ${OUTPUT} "${CONTENT}")
+endif()
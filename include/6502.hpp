@@ -1,6 +1,11 @@
 #ifndef INC_6502_CPP_6502_HPP
 #define INC_6502_CPP_6502_HPP
 
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
 #include "assembly.hpp"
 
 struct mos6502 : ASMLine
@@ -192,6 +197,10 @@ struct mos6502 : ASMLine
   explicit mos6502(const OpCode o)
     : ASMLine(Type::Instruction, std::string{ to_string(o) }), opcode(o), is_branch(get_is_branch(o)), is_comparison(get_is_comparison(o))
   {
+    // the shifts and rotates without an address work on A
+    if (o == OpCode::asl || o == OpCode::lsr || o == OpCode::rol || o == OpCode::ror) {
+      op.mode = Operand::AddressingMode::accumulator;
+    }
   }
 
   mos6502(const Type t, std::string s)
@@ -202,6 +211,7 @@ struct mos6502 : ASMLine
   mos6502(const OpCode o, Operand t_o)
     : ASMLine(Type::Instruction, std::string{ to_string(o) }), opcode(o), op(std::move(t_o)), is_branch(get_is_branch(o)), is_comparison(get_is_comparison(o))
   {
+    if (is_branch) { op.mode = Operand::AddressingMode::relative; }
   }
 
   constexpr static std::string_view to_string(const OpCode o)
@@ -261,6 +271,51 @@ struct mos6502 : ASMLine
     return "";
   }
 
+  // bytes of data a directive assembles to, `.byt` items are one byte, `.word` items two, everything else
+  // (comments, `* =`) takes no space
+  [[nodiscard]] static constexpr std::size_t directive_size(const std::string_view directive)
+  {
+    const auto items = [](const std::string_view list) {
+      return static_cast<std::size_t>(std::count(list.begin(), list.end(), ',')) + 1;
+    };
+
+    if (directive.starts_with(".byt ")) { return items(directive.substr(5)); }
+    if (directive.starts_with(".word ")) { return 2 * items(directive.substr(6)); }
+    return 0;
+  }
+
+  // bytes an instruction assembles to
+  [[nodiscard]] static constexpr std::size_t instruction_size(const OpCode o, const Operand::AddressingMode mode)
+  {
+    // there are no zero page forms of jmp and jsr
+    if (o == OpCode::jmp || o == OpCode::jsr) { return 3; }
+
+    switch (mode) {
+    case Operand::AddressingMode::implied:
+    case Operand::AddressingMode::accumulator: return 1;
+    case Operand::AddressingMode::immediate:
+    case Operand::AddressingMode::zero_page:
+    case Operand::AddressingMode::indirect_y:
+    case Operand::AddressingMode::relative: return 2;
+    case Operand::AddressingMode::absolute:
+    case Operand::AddressingMode::indirect: return 3;
+    }
+
+    return 3;
+  }
+
+  // bytes this line takes up in the assembled program
+  [[nodiscard]] std::size_t size() const
+  {
+    switch (type) {
+    case ASMLine::Type::Label: return 0;
+    case ASMLine::Type::Directive: return directive_size(text);
+    case ASMLine::Type::Instruction: break;
+    }
+
+    return instruction_size(opcode, op.mode);
+  }
+
   [[nodiscard]] std::string to_string() const
   {
     switch (type) {
@@ -268,18 +323,46 @@ struct mos6502 : ASMLine
       return text;// + ':';
     case ASMLine::Type::Directive:
     case ASMLine::Type::Instruction: {
-      return fmt::format("\t{} {:15}\t; {}", text, op.value, comment);
+      return fmt::format("\t{} {:15}\t; {}", text, op.value(), comment);
     }
     }
     throw std::runtime_error("Unable to render: " + text);
   }
 
 
-  OpCode      opcode = OpCode::unknown;
-  Operand     op;
-  std::string comment;
-  bool        is_branch     = false;
-  bool        is_comparison = false;
+  // Lines the optimizer removes stay in place as a tombstone (a Directive that says why it was removed) until the
+  // optimizer is done with the program and drops them
+  [[nodiscard]] bool is_removed() const { return !removal_reason.empty(); }
+
+  void remove(const std::string_view reason)
+  {
+    if (is_removed()) { return; }
+    removed_type   = type;
+    type           = ASMLine::Type::Directive;
+    removal_reason = reason;
+  }
+
+  // "; removed <reason>: <the line as it was>"
+  [[nodiscard]] std::string removal_note() const
+  {
+    auto original = *this;
+    original.type = removed_type;
+    return mos6502(ASMLine::Type::Directive, fmt::format("; removed {}: {}", removal_reason, original.to_string()))
+      .to_string();
+  }
+
+
+  OpCode           opcode = OpCode::unknown;
+  Operand          op;
+  std::string      comment;
+  bool             is_branch     = false;
+  bool             is_comparison = false;
+  std::string_view removal_reason;
+  ASMLine::Type    removed_type = ASMLine::Type::Directive;
+  // 1 + the index of the notes about removed lines that preceded this one, 0 if there are none
+  std::uint32_t    annotation = 0;
+  // the lines of one 16 bit N / Z flag fix-up share the same non 0 id
+  std::uint32_t    flag_fixup = 0;
 };
 
 #endif//INC_6502_CPP_6502_HPP
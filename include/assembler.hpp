@@ -0,0 +1,327 @@
+#ifndef INC_6502_CPP_ASSEMBLER_HPP
+#define INC_6502_CPP_ASSEMBLER_HPP
+
+#include <cstdint>
+#include <fmt/format.h>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "6502.hpp"
+#include "simulator.hpp"
+#include "symbol_table.hpp"
+
+[[nodiscard]] constexpr Simulator::Op simulator_op(const mos6502::OpCode o)
+{
+  using enum mos6502::OpCode;
+  switch (o) {
+  case adc: return Simulator::Op::adc;
+  case AND: return Simulator::Op::AND;
+  case asl: return Simulator::Op::asl;
+  case bcc: return Simulator::Op::bcc;
+  case bcs: return Simulator::Op::bcs;
+  case beq: return Simulator::Op::beq;
+  case bit: return Simulator::Op::bit;
+  case bmi: return Simulator::Op::bmi;
+  case bne: return Simulator::Op::bne;
+  case bpl: return Simulator::Op::bpl;
+  case bvs: return Simulator::Op::bvs;
+  case cpx: return Simulator::Op::cpx;
+  case cpy: return Simulator::Op::cpy;
+  case cmp: return Simulator::Op::cmp;
+  case clc: return Simulator::Op::clc;
+  case dec: return Simulator::Op::dec;
+  case dex: return Simulator::Op::dex;
+  case dey: return Simulator::Op::dey;
+  case eor: return Simulator::Op::eor;
+  case inc: return Simulator::Op::inc;
+  case inx: return Simulator::Op::inx;
+  case iny: return Simulator::Op::iny;
+  case jmp: return Simulator::Op::jmp;
+  case jsr: return Simulator::Op::jsr;
+  case lda: return Simulator::Op::lda;
+  case ldx: return Simulator::Op::ldx;
+  case ldy: return Simulator::Op::ldy;
+  case lsr: return Simulator::Op::lsr;
+  case nop: return Simulator::Op::nop;
+  case ORA: return Simulator::Op::ORA;
+  case pha: return Simulator::Op::pha;
+  case php: return Simulator::Op::php;
+  case pla: return Simulator::Op::pla;
+  case plp: return Simulator::Op::plp;
+  case rol: return Simulator::Op::rol;
+  case ror: return Simulator::Op::ror;
+  case rts: return Simulator::Op::rts;
+  case sbc: return Simulator::Op::sbc;
+  case sec: return Simulator::Op::sec;
+  case sta: return Simulator::Op::sta;
+  case stx: return Simulator::Op::stx;
+  case sty: return Simulator::Op::sty;
+  case tax: return Simulator::Op::tax;
+  case tay: return Simulator::Op::tay;
+  case tsx: return Simulator::Op::tsx;
+  case txa: return Simulator::Op::txa;
+  case txs: return Simulator::Op::txs;
+  case tya: return Simulator::Op::tya;
+  case unknown: break;
+  }
+  return Simulator::Op::illegal;
+}
+
+[[nodiscard]] constexpr Simulator::Mode simulator_mode(const Operand::AddressingMode mode)
+{
+  switch (mode) {
+  case Operand::AddressingMode::implied: return Simulator::Mode::implied;
+  case Operand::AddressingMode::accumulator: return Simulator::Mode::accumulator;
+  case Operand::AddressingMode::immediate: return Simulator::Mode::immediate;
+  case Operand::AddressingMode::zero_page: return Simulator::Mode::zero_page;
+  case Operand::AddressingMode::absolute: return Simulator::Mode::absolute;
+  case Operand::AddressingMode::indirect: return Simulator::Mode::indirect;
+  case Operand::AddressingMode::indirect_y: return Simulator::Mode::indirect_y;
+  case Operand::AddressingMode::relative: return Simulator::Mode::relative;
+  }
+  return Simulator::Mode::implied;
+}
+
+// the machine code byte of an instruction, the simulator's decoding table is the one place the encoding is kept
+[[nodiscard]] constexpr std::optional<std::uint8_t> opcode_byte(const mos6502::OpCode o,
+  const Operand::AddressingMode mode)
+{
+  constexpr auto table = Simulator::instruction_table();
+
+  const auto op = simulator_op(o);
+  // jmp and jsr have no zero page form, the IR doesn't bother to say so
+  const bool jump   = o == mos6502::OpCode::jsr || (o == mos6502::OpCode::jmp && mode != Operand::AddressingMode::indirect);
+  const auto wanted = jump ? Simulator::Mode::absolute : simulator_mode(mode);
+  for (std::size_t code = 0; code < table.size(); ++code) {
+    if (table[code].op == op && table[code].mode == wanted) { return static_cast<std::uint8_t>(code); }
+  }
+  return std::nullopt;
+}
+
+struct AssembledProgram
+{
+  std::vector<std::uint8_t> bytes;
+  // one line per source line: address, bytes, the line as xa would have read it
+  std::vector<std::string> listing;
+};
+
+// Turns the generated program into machine code the way `xa` does: labels are resolved in a first pass, the bytes
+// are written in a second one. `* =` only moves the program counter, so the output starts with the bytes of the
+// leading `.word` that makes it a PRG. A `-label` may be defined more than once, a reference goes to the closest
+// definition before it.
+class Assembler
+{
+public:
+  [[nodiscard]] static AssembledProgram assemble(const std::span<const mos6502> lines, const bool with_listing)
+  {
+    Assembler assembler(lines);
+    return assembler.emit(with_listing);
+  }
+
+private:
+  struct Definition
+  {
+    std::size_t   line;
+    std::uint16_t address;
+  };
+
+  explicit Assembler(const std::span<const mos6502> program)
+    : lines(program)
+  {
+    std::uint16_t pc = 0;
+    for (std::size_t index = 0; index < lines.size(); ++index) {
+      const auto &line = lines[index];
+      if (line.type == ASMLine::Type::Label) {
+        auto name = std::string_view{ line.text };
+        if (name.starts_with('-')) { name.remove_prefix(1); }
+        labels[symbols().intern(name)].push_back({ index, pc });
+      } else if (line.type == ASMLine::Type::Directive && line.text.starts_with("* =")) {
+        pc = static_cast<std::uint16_t>(evaluate(std::string_view{ line.text }.substr(3), index));
+      } else if (line.type == ASMLine::Type::Directive && line.text.starts_with(".align ")) {
+        pc = static_cast<std::uint16_t>(pc + padding(pc, std::string_view{ line.text }.substr(7), index));
+      } else {
+        pc = static_cast<std::uint16_t>(pc + line.size());
+      }
+    }
+  }
+
+  [[nodiscard]] AssembledProgram emit(const bool with_listing) const
+  {
+    AssembledProgram program;
+    std::uint16_t    pc = 0;
+
+    for (std::size_t index = 0; index < lines.size(); ++index) {
+      const auto &line  = lines[index];
+      const auto  first = program.bytes.size();
+
+      const auto byte = [&](const int value) { program.bytes.push_back(static_cast<std::uint8_t>(value)); };
+      const auto word = [&](const int value) {
+        byte(value & 0xFF);
+        byte((value >> 8) & 0xFF);
+      };
+
+      switch (line.type) {
+      case ASMLine::Type::Label: break;
+      case ASMLine::Type::Directive: {
+        const auto text = std::string_view{ line.text };
+        if (text.starts_with("* =")) {
+          pc = static_cast<std::uint16_t>(evaluate(text.substr(3), index));
+        } else if (text.starts_with(".align ")) {
+          for (auto count = padding(pc, text.substr(7), index); count > 0; --count) { byte(0); }
+        } else if (text.starts_with(".byt ")) {
+          for_each_item(text.substr(5), [&](const std::string_view item) { byte(evaluate(item, index)); });
+        } else if (text.starts_with(".word ")) {
+          for_each_item(text.substr(6), [&](const std::string_view item) { word(evaluate(item, index)); });
+        }
+        break;
+      }
+      case ASMLine::Type::Instruction: {
+        const auto code = opcode_byte(line.opcode, line.op.mode);
+        if (!code) { throw std::runtime_error(fmt::format("Cannot encode '{}'", line.to_string())); }
+        byte(*code);
+
+        const auto value = [&] {
+          const auto base = evaluate(line.op.name(), index) + line.op.offset;
+          switch (line.op.modifier) {
+          case Operand::Modifier::lo: return base & 0xFF;
+          case Operand::Modifier::hi: return (base >> 8) & 0xFF;
+          case Operand::Modifier::none: break;
+          }
+          return base;
+        };
+
+        if (line.op.mode == Operand::AddressingMode::relative) {
+          const auto offset = value() - (pc + 2);
+          if (offset < -128 || offset > 127) {
+            throw std::runtime_error(fmt::format("Branch out of range: '{}'", line.to_string()));
+          }
+          byte(offset);
+        } else if (line.opcode == mos6502::OpCode::jmp || line.opcode == mos6502::OpCode::jsr) {
+          word(value());
+        } else {
+          switch (mos6502::instruction_size(line.opcode, line.op.mode)) {
+          case 2: byte(value()); break;
+          case 3: word(value()); break;
+          default: break;
+          }
+        }
+        break;
+      }
+      }
+
+      const auto emitted = program.bytes.size() - first;
+      if (with_listing && (emitted > 0 || line.type != ASMLine::Type::Directive)) {
+        std::string hex;
+        for (auto at = first; at < program.bytes.size(); ++at) {
+          hex += fmt::format("{:02x} ", program.bytes[at]);
+        }
+        program.listing.push_back(fmt::format("{:04x}  {:9} {}", pc, hex, line.to_string()));
+      }
+      if (line.type != ASMLine::Type::Directive || !line.text.starts_with("* =")) {
+        pc = static_cast<std::uint16_t>(pc + emitted);
+      }
+    }
+
+    return program;
+  }
+
+  // zero bytes up to the next multiple of `boundary`
+  [[nodiscard]] int padding(const std::uint16_t pc, const std::string_view boundary, const std::size_t index) const
+  {
+    const auto alignment = evaluate(boundary, index);
+    if (alignment <= 0) { throw std::runtime_error(fmt::format("Bad alignment: '{}'", boundary)); }
+    return (alignment - pc % alignment) % alignment;
+  }
+
+  template<typename Callable> static void for_each_item(std::string_view list, Callable callable)
+  {
+    while (!list.empty()) {
+      const auto comma = list.find(',');
+      callable(list.substr(0, comma));
+      if (comma == std::string_view::npos) { break; }
+      list.remove_prefix(comma + 1);
+    }
+  }
+
+  [[nodiscard]] int label_value(const std::string_view name, const std::size_t reference) const
+  {
+    const auto found = labels.find(symbols().intern(name));
+    if (found == labels.end()) { throw std::runtime_error(fmt::format("Unknown label '{}'", name)); }
+
+    const auto &definitions = found->second;
+    const auto *closest     = &definitions.front();
+    for (const auto &definition : definitions) {
+      if (definition.line < reference) { closest = &definition; }
+    }
+    return closest->address;
+  }
+
+  // numbers (`$ff`, `%101`, `12`), labels, `+`, `-`, `<` / `>` for the low / high byte and parentheses
+  [[nodiscard]] int evaluate(std::string_view text, const std::size_t reference) const
+  {
+    const auto skip_space = [&] {
+      while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) { text.remove_prefix(1); }
+    };
+
+    const auto is_name_char = [](const char c) {
+      return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '.'
+             || c == '$' || c == '%';
+    };
+
+    const auto expression = [&](const auto &self) -> int {
+      const auto term = [&](const auto &term_self) -> int {
+        skip_space();
+        if (text.empty()) { throw std::runtime_error("Expression ends early"); }
+
+        const auto first = text.front();
+        if (first == '-' || first == '<' || first == '>') {
+          text.remove_prefix(1);
+          const auto value = term_self(term_self);
+          return first == '-' ? -value : first == '<' ? (value & 0xFF) : ((value >> 8) & 0xFF);
+        }
+        if (first == '(') {
+          text.remove_prefix(1);
+          const auto value = self(self);
+          skip_space();
+          if (!text.starts_with(')')) { throw std::runtime_error("Missing ')' in expression"); }
+          text.remove_prefix(1);
+          return value;
+        }
+
+        std::size_t length = 0;
+        while (length < text.size() && is_name_char(text[length])) { ++length; }
+        if (length == 0) { throw std::runtime_error(fmt::format("Unexpected '{}' in expression", text)); }
+
+        const auto token = text.substr(0, length);
+        text.remove_prefix(length);
+        if (const auto number = parse_number(token); number) { return *number; }
+        return label_value(token, reference);
+      };
+
+      auto value = term(term);
+      for (skip_space(); !text.empty() && (text.front() == '+' || text.front() == '-'); skip_space()) {
+        const auto op = text.front();
+        text.remove_prefix(1);
+        value = op == '+' ? value + term(term) : value - term(term);
+      }
+      return value;
+    };
+
+    const auto value = expression(expression);
+    skip_space();
+    if (!text.empty() && !text.starts_with(')')) {
+      throw std::runtime_error(fmt::format("Unexpected '{}' in expression", text));
+    }
+    return value;
+  }
+
+  std::span<const mos6502>                              lines;
+  std::unordered_map<SymbolId, std::vector<Definition>> labels;
+};
+
+#endif// INC_6502_CPP_ASSEMBLER_HPP
@@ -1,6 +1,48 @@
 #ifndef INC_6502_CPP_ASSEMBLY_HPP
 #define INC_6502_CPP_ASSEMBLY_HPP
 
+#include <cassert>
+#include <fmt/format.h>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "symbol_table.hpp"
+
+// the value of a number as the assembler writes them: `$4e`, `%0101`, `1024`, `-1`
+[[nodiscard]] constexpr std::optional<int> parse_number(std::string_view text)
+{
+  const bool negative = text.starts_with('-');
+  if (negative) { text.remove_prefix(1); }
+
+  int base = 10;
+  if (text.starts_with('$')) {
+    base = 16;
+    text.remove_prefix(1);
+  } else if (text.starts_with('%')) {
+    base = 2;
+    text.remove_prefix(1);
+  }
+
+  if (text.empty()) { return std::nullopt; }
+
+  int result = 0;
+  for (const auto c : text) {
+    int digit = base;
+    if (c >= '0' && c <= '9') {
+      digit = c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      digit = c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+      digit = c - 'A' + 10;
+    }
+    if (digit >= base) { return std::nullopt; }
+    result = result * base + digit;
+  }
+
+  return negative ? -result : result;
+}
+
 struct Operand
 {
   enum class Type {
@@ -9,19 +51,68 @@ struct Operand
     reg /*ister*/
   };
 
-  Type        type    = Type::empty;
-  int         reg_num = 0;
-  std::string value;
+  // which byte of the value is wanted, `lo8()` / `hi8()` in the AVR source, `#<()` / `#>()` in the 6502 output
+  enum class Modifier {
+    none,
+    lo,
+    hi
+  };
+
+  // how a 6502 instruction uses its operand, the symbol and offset are the value / address it is applied to
+  enum class AddressingMode {
+    implied,    // rts
+    accumulator,// asl
+    immediate,  // lda #value
+    zero_page,  // lda $4e
+    absolute,   // lda label
+    indirect,   // jmp ($6c)
+    indirect_y, // lda ($6c), Y
+    relative    // bne label
+  };
+
+  Type           type     = Type::empty;
+  int            reg_num  = 0;
+  AddressingMode mode     = AddressingMode::implied;
+  Modifier       modifier = Modifier::none;
+  SymbolId       symbol   = SymbolTable::none;
+  int            offset   = 0;
 
   Operand() = default;
 
-  bool operator==(const Operand &other) const
+  bool operator==(const Operand &other) const = default;
+
+  // parses an operand written the way the assembler reads it: `#$FF`, `#<(label)`, `($6c), Y`, `$4e`, `label`
+  Operand(const Type t, std::string_view v)
+    : type(t)
   {
-    return type == other.type && reg_num == other.reg_num && value == other.value;
+    assert(type == Type::literal);
+
+    if (v.starts_with("#<(") && v.ends_with(')')) {
+      mode     = AddressingMode::immediate;
+      modifier = Modifier::lo;
+      v        = v.substr(3, v.size() - 4);
+    } else if (v.starts_with("#>(") && v.ends_with(')')) {
+      mode     = AddressingMode::immediate;
+      modifier = Modifier::hi;
+      v        = v.substr(3, v.size() - 4);
+    } else if (v.starts_with('#')) {
+      mode = AddressingMode::immediate;
+      v.remove_prefix(1);
+    } else if (v.starts_with('(') && v.ends_with("), Y")) {
+      mode = AddressingMode::indirect_y;
+      v    = v.substr(1, v.size() - 5);
+    } else if (v.starts_with('(') && v.ends_with(')')) {
+      mode = AddressingMode::indirect;
+      v    = v.substr(1, v.size() - 2);
+    } else {
+      mode = address_mode(v, 0);
+    }
+
+    symbol = symbols().intern(v);
   }
 
-  Operand(const Type t, std::string v)
-    : type(t), value(std::move(v))
+  Operand(const Type t, const AddressingMode m, const SymbolId s, const int o = 0, const Modifier mod = Modifier::none)
+    : type(t), mode(m), modifier(mod), symbol(s), offset(o)
   {
     assert(type == Type::literal);
   }
@@ -31,6 +122,52 @@ struct Operand
   {
     assert(type == Type::reg);
   }
+
+  // addresses that are known to be in the first page get the shorter zero page encoding from the assembler,
+  // labels are all above the load address
+  [[nodiscard]] static AddressingMode address_mode(const std::string_view name, const int offset)
+  {
+    if (const auto address = parse_number(name); address && *address + offset >= 0 && *address + offset < 256) {
+      return AddressingMode::zero_page;
+    }
+    return AddressingMode::absolute;
+  }
+
+  [[nodiscard]] std::string_view name() const { return symbols().name(symbol); }
+
+  [[nodiscard]] bool is_indirect() const
+  {
+    return mode == AddressingMode::indirect || mode == AddressingMode::indirect_y;
+  }
+
+  [[nodiscard]] std::string value() const
+  {
+    const auto expression = offset == 0 ? std::string{ name() } : fmt::format("{}{:+}", name(), offset);
+
+    switch (mode) {
+    case AddressingMode::implied:
+    case AddressingMode::accumulator: return "";
+    case AddressingMode::immediate:
+      // a plain number needs no parentheses around it
+      if (modifier != Modifier::none && offset == 0 && parse_number(name())) {
+        return fmt::format("#{}{}", modifier == Modifier::lo ? '<' : '>', expression);
+      }
+
+      switch (modifier) {
+      case Modifier::none: return fmt::format("#{}", expression);
+      case Modifier::lo: return fmt::format("#<({})", expression);
+      case Modifier::hi: return fmt::format("#>({})", expression);
+      }
+      break;
+    case AddressingMode::zero_page:
+    case AddressingMode::absolute:
+    case AddressingMode::relative: return expression;
+    case AddressingMode::indirect: return fmt::format("({})", expression);
+    case AddressingMode::indirect_y: return fmt::format("({}), Y", expression);
+    }
+
+    return expression;
+  }
 };
 
 
@@ -0,0 +1,300 @@
+#ifndef INC_6502_CPP_AVR_HPP
+#define INC_6502_CPP_AVR_HPP
+
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <fmt/format.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include "assembly.hpp"
+#include "lexer.hpp"
+
+inline int to_int(const std::string_view sv)
+{
+  int result{};
+  std::from_chars(sv.begin(), sv.end(), result);
+  return result;
+}
+
+// The one list of AVR opcodes the translator understands: enumerator, mnemonic in the avr-gcc output.
+// Both AVR::OpCode and the decoding table are generated from it.
+#define AVR_OPCODES(OPCODE) \
+  OPCODE(adc, "adc")        \
+  OPCODE(adiw, "adiw")      \
+  OPCODE(add, "add")        \
+  OPCODE(andi, "andi")      \
+  OPCODE(asr, "asr")        \
+                            \
+  OPCODE(breq, "breq")      \
+  OPCODE(brge, "brge")      \
+  OPCODE(brlt, "brlt")      \
+  OPCODE(brlo, "brlo")      \
+  OPCODE(brne, "brne")      \
+  OPCODE(brsh, "brsh")      \
+                            \
+  OPCODE(call, "call")      \
+  OPCODE(clr, "clr")        \
+  OPCODE(com, "com")        \
+  OPCODE(cp, "cp")          \
+  OPCODE(cpc, "cpc")        \
+  OPCODE(cpi, "cpi")        \
+  OPCODE(cpse, "cpse")      \
+  OPCODE(dec, "dec")        \
+                            \
+  OPCODE(eor, "eor")        \
+                            \
+  OPCODE(in, "in")          \
+  OPCODE(inc, "inc")        \
+  OPCODE(icall, "icall")    \
+                            \
+  OPCODE(jmp, "jmp")        \
+                            \
+  OPCODE(ld, "ld")          \
+  OPCODE(ldd, "ldd")        \
+  OPCODE(ldi, "ldi")        \
+  OPCODE(lds, "lds")        \
+  OPCODE(lpm, "lpm")        \
+  OPCODE(lsl, "lsl")        \
+  OPCODE(lsr, "lsr")        \
+                            \
+  OPCODE(mov, "mov")        \
+  OPCODE(movw, "movw")      \
+                            \
+  OPCODE(nop, "nop")        \
+                            \
+  OPCODE(OR, "or")          \
+  OPCODE(ori, "ori")        \
+  OPCODE(out, "out")        \
+                            \
+  OPCODE(pop, "pop")        \
+  OPCODE(push, "push")      \
+                            \
+  OPCODE(rcall, "rcall")    \
+  OPCODE(ret, "ret")        \
+  OPCODE(rjmp, "rjmp")      \
+  OPCODE(rol, "rol")        \
+  OPCODE(ror, "ror")        \
+                            \
+  OPCODE(sbc, "sbc")        \
+  OPCODE(sbci, "sbci")      \
+  OPCODE(sbiw, "sbiw")      \
+  OPCODE(sbrc, "sbrc")      \
+  OPCODE(sbrs, "sbrs")      \
+  OPCODE(st, "st")          \
+  OPCODE(std, "std")        \
+  OPCODE(sts, "sts")        \
+  OPCODE(sub, "sub")        \
+  OPCODE(subi, "subi")      \
+  OPCODE(swap, "swap")      \
+                            \
+  OPCODE(tst, "tst")
+
+#define AVR_OPCODE_ENUMERATOR(enumerator, mnemonic) enumerator,
+enum class AVROpCode {
+  unknown,
+  AVR_OPCODES(AVR_OPCODE_ENUMERATOR)
+};
+#undef AVR_OPCODE_ENUMERATOR
+
+struct AVRMnemonic
+{
+  std::string_view name;
+  AVROpCode        opcode;
+};
+
+#define AVR_OPCODE_MNEMONIC(enumerator, mnemonic) AVRMnemonic{ mnemonic, AVROpCode::enumerator },
+// entry 0 is what the empty slots of the hash table point to
+inline constexpr std::array avr_mnemonics{ AVRMnemonic{ "", AVROpCode::unknown }, AVR_OPCODES(AVR_OPCODE_MNEMONIC) };
+#undef AVR_OPCODE_MNEMONIC
+
+inline constexpr std::size_t avr_mnemonic_table_size = 256;
+
+[[nodiscard]] constexpr std::size_t hash_avr_mnemonic(const std::string_view name, const std::uint32_t seed)
+{
+  std::uint32_t hash = 2166136261u ^ seed;
+  for (const auto c : name) { hash = (hash ^ static_cast<std::uint8_t>(c)) * 16777619u; }
+  return (hash ^ (hash >> 16u)) % avr_mnemonic_table_size;
+}
+
+// search for a seed that gives every mnemonic its own slot in the table, so a lookup is one hash and one compare
+[[nodiscard]] constexpr std::uint32_t find_avr_mnemonic_seed()
+{
+  for (std::uint32_t seed = 0; seed < 100000; ++seed) {
+    std::array<bool, avr_mnemonic_table_size> used{};
+    bool collision = false;
+    for (std::size_t index = 1; index < avr_mnemonics.size() && !collision; ++index) {
+      const auto slot = hash_avr_mnemonic(avr_mnemonics[index].name, seed);
+      collision = used[slot];
+      used[slot] = true;
+    }
+    if (!collision) { return seed; }
+  }
+  throw std::logic_error("no perfect hash seed found for the AVR mnemonics");
+}
+
+inline constexpr std::uint32_t avr_mnemonic_seed = find_avr_mnemonic_seed();
+
+inline constexpr auto avr_mnemonic_table = [] {
+  static_assert(avr_mnemonics.size() < 256, "avr_mnemonic_table holds 8 bit indexes");
+  std::array<std::uint8_t, avr_mnemonic_table_size> table{};
+  for (std::size_t index = 1; index < avr_mnemonics.size(); ++index) {
+    table[hash_avr_mnemonic(avr_mnemonics[index].name, avr_mnemonic_seed)] = static_cast<std::uint8_t>(index);
+  }
+  return table;
+}();
+
+[[nodiscard]] constexpr AVROpCode decode_avr_mnemonic(const std::string_view name)
+{
+  const auto &mnemonic = avr_mnemonics[avr_mnemonic_table[hash_avr_mnemonic(name, avr_mnemonic_seed)]];
+  if (mnemonic.name == name) { return mnemonic.opcode; }
+  return AVROpCode::unknown;
+}
+
+[[nodiscard]] constexpr std::string_view to_string(const AVROpCode o)
+{
+  for (const auto &mnemonic : avr_mnemonics) {
+    if (mnemonic.opcode == o) { return mnemonic.name; }
+  }
+  return "";
+}
+
+// An operand expression as avr-gcc writes them: `lo8(-(label+2))`, `hi8(gs(function))`, `.LC0`, `Y+1`, `1024`
+struct AVRExpression
+{
+  Operand::Modifier modifier = Operand::Modifier::none;
+  bool              negated = false;
+  std::string_view  symbol;
+  int               offset = 0;
+};
+
+[[nodiscard]] constexpr std::string_view strip_call(const std::string_view s, const std::string_view function)
+{
+  if (s.size() > function.size() + 1 && s.starts_with(function) && s[function.size()] == '(' && s.ends_with(')')) {
+    return s.substr(function.size() + 1, s.size() - function.size() - 2);
+  }
+  return s;
+}
+
+[[nodiscard]] constexpr AVRExpression parse_avr_expression(std::string_view s)
+{
+  AVRExpression result;
+
+  if (const auto lo = strip_call(s, "lo8"); lo.size() != s.size()) {
+    result.modifier = Operand::Modifier::lo;
+    s = lo;
+  } else if (const auto hi = strip_call(s, "hi8"); hi.size() != s.size()) {
+    result.modifier = Operand::Modifier::hi;
+    s = hi;
+  }
+
+  s = strip_call(s, "gs");
+
+  if (const auto negated = strip_call(s, "-"); negated.size() != s.size()) {
+    result.negated = true;
+    s = negated;
+  }
+
+  // a trailing +N or -N is an offset, as long as there is something left to offset
+  auto digits = s.size();
+  while (digits > 0 && s[digits - 1] >= '0' && s[digits - 1] <= '9') { --digits; }
+  if (digits > 1 && digits < s.size() && (s[digits - 1] == '+' || s[digits - 1] == '-')) {
+    for (const auto c : s.substr(digits)) { result.offset = result.offset * 10 + (c - '0'); }
+    if (s[digits - 1] == '-') { result.offset = -result.offset; }
+    s = s.substr(0, digits - 1);
+  }
+
+  result.symbol = s;
+  return result;
+}
+
+// One line of avr-gcc output. The text and operands are views into the source that was lexed, so the source
+// (usually a mapping of the whole avr-gcc output) must outlive the records.
+struct AVR
+{
+  using Type = LexedLine::Type;
+  using OpCode = AVROpCode;
+
+  struct Operand
+  {
+    using Type = ::Operand::Type;
+    using Modifier = ::Operand::Modifier;
+
+    Type             type = Type::empty;
+    int              reg_num = 0;
+    // the operand as it was written
+    std::string_view value;
+    // and decoded as `modifier(-(symbol+offset))`, label renaming only ever replaces the symbol
+    Modifier modifier = Modifier::none;
+    bool     negated = false;
+    SymbolId symbol = SymbolTable::none;
+    int      offset = 0;
+
+    Operand() = default;
+
+    constexpr Operand(const Type t, const std::string_view v) : type(t), value(v) {}
+
+    constexpr Operand(const Type t, const int num) : type(t), reg_num(num) {}
+  };
+
+  [[nodiscard]] static constexpr OpCode parse_opcode(Type t, std::string_view o)
+  {
+    switch (t) {
+    case Type::Label:
+    case Type::Comment:
+    case Type::Directive: return OpCode::unknown;
+    case Type::Instruction: {
+      if (const auto opcode = decode_avr_mnemonic(o); opcode != OpCode::unknown) { return opcode; }
+    }
+    }
+    throw std::runtime_error(fmt::format("Unknown opcode: {}", o));
+  }
+
+  static int get_register_number(const char reg_name)
+  {
+    if (reg_name == 'X') { return 26; }
+    if (reg_name == 'Y') { return 28; }
+    if (reg_name == 'Z') { return 30; }
+
+    throw std::runtime_error("Unknown register name");
+  }
+
+  static Operand parse_operand(std::string_view o)
+  {
+    if (o.empty()) { return Operand(); }
+
+    if (o[0] == 'r' && o.size() > 1) {
+      return Operand(Operand::Type::reg, to_int(o.substr(1)));
+    } else {
+      const auto expression = parse_avr_expression(o);
+      auto result = Operand(Operand::Type::literal, o);
+      result.modifier = expression.modifier;
+      result.negated = expression.negated;
+      result.symbol = symbols().intern(expression.symbol);
+      result.offset = expression.offset;
+      return result;
+    }
+  }
+
+  AVR(const int t_line_num,
+    std::string_view t_line_text,
+    Type t,
+    std::string_view t_text,
+    std::string_view o1 = "",
+    std::string_view o2 = "")
+    : line_num(t_line_num), line_text(t_line_text), type(t), text(t_text), opcode(parse_opcode(t, t_text)),
+      operand1(parse_operand(o1)), operand2(parse_operand(o2))
+  {}
+
+  int              line_num;
+  std::string_view line_text;
+  Type             type;
+  std::string_view text;
+  OpCode           opcode;
+  Operand          operand1;
+  Operand          operand2;
+};
+
+#endif// INC_6502_CPP_AVR_HPP
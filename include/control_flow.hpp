@@ -0,0 +1,111 @@
+#ifndef INC_6502_CPP_CONTROL_FLOW_HPP
+#define INC_6502_CPP_CONTROL_FLOW_HPP
+
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "6502.hpp"
+#include "symbol_table.hpp"
+
+// A straight run of lines that is only entered at the top and only left at the bottom
+struct BasicBlock
+{
+  // [begin, end) lines of the program
+  std::size_t              begin = 0;
+  std::size_t              end   = 0;
+  std::vector<std::size_t> successors;
+  std::vector<std::size_t> predecessors;
+  // the block ends in a jsr, it continues with the fallthrough once the call returns
+  bool calls = false;
+  // control leaves the code we can see: rts, an indirect jmp, or a jmp / branch to a label outside of the program
+  bool exits = false;
+};
+
+// Basic blocks of the generated 6502 code, split at labels and after every branch, jmp, jsr and rts
+class ControlFlowGraph
+{
+public:
+  explicit ControlFlowGraph(const std::span<const mos6502> lines)
+  {
+    // `-label` defines a label that may be redefined, it is still referred to as `label`
+    const auto label_symbol = [](const mos6502 &line) {
+      auto name = std::string_view{ line.text };
+      if (name.starts_with('-')) { name.remove_prefix(1); }
+      return symbols().intern(name);
+    };
+
+    std::vector<bool> leader(lines.size() + 1, false);
+    leader[0] = true;
+    for (std::size_t index = 0; index < lines.size(); ++index) {
+      if (lines[index].type == ASMLine::Type::Label) { leader[index] = true; }
+      if (is_terminator(lines[index])) { leader[index + 1] = true; }
+    }
+
+    block_of_line.resize(lines.size());
+    for (std::size_t index = 0; index < lines.size(); ++index) {
+      if (leader[index]) {
+        if (!blocks.empty()) { blocks.back().end = index; }
+        blocks.push_back(BasicBlock{ index, lines.size(), {}, {}, false, false });
+      }
+      block_of_line[index] = blocks.size() - 1;
+    }
+
+    // a redefinable label may be defined more than once, a jump to it could end up at any of them
+    std::unordered_map<SymbolId, std::vector<std::size_t>> label_blocks;
+    for (std::size_t index = 0; index < lines.size(); ++index) {
+      if (lines[index].type == ASMLine::Type::Label) {
+        label_blocks[label_symbol(lines[index])].push_back(block_of_line[index]);
+      }
+    }
+
+    const auto add_edge = [&](const std::size_t from, const std::size_t to) {
+      blocks[from].successors.push_back(to);
+      blocks[to].predecessors.push_back(from);
+    };
+
+    for (std::size_t block = 0; block < blocks.size(); ++block) {
+      const bool has_next = block + 1 < blocks.size();
+
+      // a terminator always is the last line of its block
+      const auto &last = lines[blocks[block].end - 1];
+      if (!is_terminator(last)) {
+        if (has_next) { add_edge(block, block + 1); }
+        continue;
+      }
+
+      const auto targets = [&]() -> const std::vector<std::size_t> * {
+        if (last.op.mode == Operand::AddressingMode::indirect) { return nullptr; }
+        if (const auto found = label_blocks.find(last.op.symbol); found != label_blocks.end()) { return &found->second; }
+        return nullptr;
+      }();
+
+      if (last.is_branch || last.opcode == mos6502::OpCode::jmp) {
+        if (targets != nullptr) {
+          for (const auto target : *targets) { add_edge(block, target); }
+        } else {
+          blocks[block].exits = true;
+        }
+        if (last.is_branch && has_next) { add_edge(block, block + 1); }
+      } else if (last.opcode == mos6502::OpCode::jsr) {
+        blocks[block].calls = true;
+        if (has_next) { add_edge(block, block + 1); }
+      } else {
+        blocks[block].exits = true;
+      }
+    }
+  }
+
+  [[nodiscard]] static bool is_terminator(const mos6502 &line)
+  {
+    return line.type == ASMLine::Type::Instruction
+           && (line.is_branch || line.opcode == mos6502::OpCode::jmp || line.opcode == mos6502::OpCode::jsr
+               || line.opcode == mos6502::OpCode::rts);
+  }
+
+  std::vector<BasicBlock>  blocks;
+  std::vector<std::size_t> block_of_line;
+};
+
+#endif// INC_6502_CPP_CONTROL_FLOW_HPP
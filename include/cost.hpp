@@ -0,0 +1,185 @@
+#ifndef INC_6502_CPP_COST_HPP
+#define INC_6502_CPP_COST_HPP
+
+#include <fmt/format.h>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+#include "6502.hpp"
+#include "control_flow.hpp"
+
+struct Cost
+{
+  int cycles = 0;
+  int bytes  = 0;
+  // the most cycles that can come on top: a taken branch, a branch to another page, a (zp),Y read crossing a page
+  int penalty = 0;
+
+  constexpr bool operator==(const Cost &other) const = default;
+
+  constexpr Cost &operator+=(const Cost &other)
+  {
+    cycles += other.cycles;
+    bytes += other.bytes;
+    penalty += other.penalty;
+    return *this;
+  }
+};
+
+[[nodiscard]] constexpr Cost instruction_cost(const mos6502::OpCode o, const Operand::AddressingMode mode)
+{
+  using enum mos6502::OpCode;
+  using Mode = Operand::AddressingMode;
+
+  const auto bytes = static_cast<int>(mos6502::instruction_size(o, mode));
+
+  switch (o) {
+  case adc:
+  case AND:
+  case bit:
+  case cmp:
+  case cpx:
+  case cpy:
+  case eor:
+  case lda:
+  case ldx:
+  case ldy:
+  case ORA:
+  case sbc:
+    switch (mode) {
+    case Mode::immediate: return { 2, bytes, 0 };
+    case Mode::zero_page: return { 3, bytes, 0 };
+    case Mode::indirect_y: return { 5, bytes, 1 };
+    default: return { 4, bytes, 0 };
+    }
+  // stores never take the shortcut a read takes when Y doesn't cross a page
+  case sta:
+  case stx:
+  case sty:
+    switch (mode) {
+    case Mode::zero_page: return { 3, bytes, 0 };
+    case Mode::indirect_y: return { 6, bytes, 0 };
+    default: return { 4, bytes, 0 };
+    }
+  case asl:
+  case lsr:
+  case rol:
+  case ror:
+  case inc:
+  case dec:
+    switch (mode) {
+    case Mode::accumulator: return { 2, bytes, 0 };
+    case Mode::zero_page: return { 5, bytes, 0 };
+    default: return { 6, bytes, 0 };
+    }
+  case bcc:
+  case bcs:
+  case beq:
+  case bmi:
+  case bne:
+  case bpl:
+  case bvs: return { 2, bytes, 2 };
+  case jmp: return { mode == Mode::indirect ? 5 : 3, bytes, 0 };
+  case jsr:
+  case rts: return { 6, bytes, 0 };
+  case pha:
+  case php: return { 3, bytes, 0 };
+  case pla:
+  case plp: return { 4, bytes, 0 };
+  case clc:
+  case sec:
+  case dex:
+  case dey:
+  case inx:
+  case iny:
+  case nop:
+  case tax:
+  case tay:
+  case tsx:
+  case txa:
+  case txs:
+  case tya: return { 2, bytes, 0 };
+  case unknown: break;
+  }
+
+  return {};
+}
+
+[[nodiscard]] inline Cost line_cost(const mos6502 &line)
+{
+  if (line.type != ASMLine::Type::Instruction) { return { 0, static_cast<int>(line.size()), 0 }; }
+  return instruction_cost(line.opcode, line.op.mode);
+}
+
+// Static cycles and bytes per function, per basic block and per AVR source line (the comment every translated
+// instruction carries). A function starts at `main` and at every label that is called or stored as a function
+// pointer, and runs up to where the next one starts.
+[[nodiscard]] inline std::string cost_report(const std::span<const mos6502> lines)
+{
+  std::unordered_set<SymbolId> functions{ symbols().intern("main") };
+  for (const auto &line : lines) {
+    if (line.type == ASMLine::Type::Instruction && line.opcode == mos6502::OpCode::jsr) {
+      functions.insert(line.op.symbol);
+    } else if (line.type == ASMLine::Type::Directive && line.text.starts_with(".word ")) {
+      functions.insert(symbols().intern(std::string_view{ line.text }.substr(6)));
+    }
+  }
+
+  const auto render = [](const Cost &cost) {
+    return fmt::format("{} cycles (+{} worst case), {} bytes", cost.cycles, cost.penalty, cost.bytes);
+  };
+
+  const ControlFlowGraph cfg(lines);
+
+  std::string report;
+  std::string function_name = "(startup)";
+  std::string function_body;
+  Cost        function_cost;
+
+  const auto finish_function = [&] {
+    if (function_body.empty()) { return; }
+    report += fmt::format("{}: {}\n{}", function_name, render(function_cost), function_body);
+    function_body.clear();
+    function_cost = {};
+  };
+
+  for (const auto &block : cfg.blocks) {
+    const auto &first = lines[block.begin];
+    if (first.type == ASMLine::Type::Label && functions.contains(symbols().intern(first.text))) {
+      finish_function();
+      function_name = first.text;
+    }
+
+    std::string block_body;
+    Cost        block_cost;
+    for (auto index = block.begin; index < block.end;) {
+      // the 6502 instructions one AVR instruction was translated to are next to each other
+      Cost source_cost;
+      auto next = index;
+      for (; next < block.end && lines[next].comment == lines[index].comment; ++next) {
+        source_cost += line_cost(lines[next]);
+      }
+
+      if (source_cost != Cost{}) {
+        const auto source = lines[index].comment.empty() ? std::string{ "(generated)" } : lines[index].comment;
+        block_body += fmt::format("    {}: {}\n", source, render(source_cost));
+        block_cost += source_cost;
+      }
+      index = next;
+    }
+
+    if (block_cost == Cost{}) { continue; }
+
+    const auto block_name = first.type == ASMLine::Type::Label ? first.text : fmt::format("line {}", block.begin);
+    function_body += fmt::format("  {}: {}\n{}", block_name, render(block_cost), block_body);
+    function_cost += block_cost;
+  }
+  finish_function();
+
+  return report;
+}
+
+#endif// INC_6502_CPP_COST_HPP
@@ -0,0 +1,104 @@
+#ifndef INC_6502_CPP_LEXER_HPP
+#define INC_6502_CPP_LEXER_HPP
+
+#include <optional>
+#include <string_view>
+
+// Classifies one line of avr-gcc output in a single pass.
+// All of the fields are views into the line that was lexed, nothing is allocated.
+struct LexedLine
+{
+  enum class Type {
+    Label,
+    Comment,
+    Directive,
+    Instruction
+  };
+
+  Type             type;
+  std::string_view text;
+  std::string_view operand1;
+  std::string_view operand2;
+};
+
+[[nodiscard]] constexpr bool is_space(const char c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+[[nodiscard]] constexpr std::size_t skip_space(const std::string_view line, std::size_t pos)
+{
+  while (pos < line.size() && is_space(line[pos])) { ++pos; }
+  return pos;
+}
+
+[[nodiscard]] constexpr std::size_t skip_token(const std::string_view line, std::size_t pos)
+{
+  while (pos < line.size() && !is_space(line[pos])) { ++pos; }
+  return pos;
+}
+
+// The rules (and their order) are the ones the translator used to express as regular expressions:
+//  Label:       ^\s*(\S+):.*
+//  Comment:     \s*(\#|;)(.*)
+//  Directive:   ^\s*(\..+)
+//  Binary:      ^\s+(\S+)\s+(\S+),\s*(\S+).*
+//  Unary:       ^\s+(\S+)\s+(\S+).*
+//  Instruction: ^\s+(\S+).*
+// Lines that match none of them (blank lines, `__SP_L__ = 0x3d`, `/* prologue */`) yield nothing.
+[[nodiscard]] constexpr std::optional<LexedLine> lex_line(const std::string_view line)
+{
+  const auto first = skip_space(line, 0);
+  const auto first_end = skip_token(line, first);
+  const auto token = line.substr(first, first_end - first);
+
+  // the label is everything in the first token up to its last ':'
+  if (const auto colon = token.rfind(':'); colon != std::string_view::npos && colon > 0) {
+    return LexedLine{ LexedLine::Type::Label, token.substr(0, colon), {}, {} };
+  }
+
+  if (token.empty()) { return std::nullopt; }
+
+  if (token[0] == '#' || token[0] == ';') {
+    return LexedLine{ LexedLine::Type::Comment, line.substr(first + 1), {}, {} };
+  }
+
+  if (token[0] == '.' && first + 1 < line.size()) {
+    return LexedLine{ LexedLine::Type::Directive, line.substr(first), {}, {} };
+  }
+
+  // instructions must be indented
+  if (first == 0) { return std::nullopt; }
+
+  const auto second = skip_space(line, first_end);
+  const auto second_end = skip_token(line, second);
+  const auto operands = line.substr(second, second_end - second);
+
+  if (operands.empty()) { return LexedLine{ LexedLine::Type::Instruction, token, {}, {} }; }
+
+  // operands are split at the last ',' of the second token, if the ',' ends the token
+  // the next token is the second operand
+  if (const auto comma = operands.rfind(','); comma != std::string_view::npos && comma > 0) {
+    if (comma + 1 < operands.size()) {
+      return LexedLine{ LexedLine::Type::Instruction, token, operands.substr(0, comma), operands.substr(comma + 1) };
+    }
+
+    const auto third = skip_space(line, second_end);
+    if (const auto third_end = skip_token(line, third); third != third_end) {
+      return LexedLine{
+        LexedLine::Type::Instruction, token, operands.substr(0, comma), line.substr(third, third_end - third)
+      };
+    }
+
+    if (const auto previous_comma = operands.rfind(',', comma - 1);
+        previous_comma != std::string_view::npos && previous_comma > 0) {
+      return LexedLine{
+        LexedLine::Type::Instruction, token, operands.substr(0, previous_comma), operands.substr(previous_comma + 1)
+      };
+    }
+  }
+
+  return LexedLine{ LexedLine::Type::Instruction, token, operands, {} };
+}
+
+#endif// INC_6502_CPP_LEXER_HPP
@@ -0,0 +1,229 @@
+#ifndef INC_6502_CPP_LINKER_HPP
+#define INC_6502_CPP_LINKER_HPP
+
+#include <cstdint>
+#include <fmt/format.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "6502.hpp"
+#include "optimizer.hpp"
+#include "runtime.hpp"
+#include "symbol_table.hpp"
+
+// how a translation unit is put together with the others it is linked with
+struct Linkage
+{
+  // the first unit starts the program: the autostart sequence, __zero_reg__ and the jump to main
+  bool starts_program = true;
+  // the runtime helpers are appended to the unit that uses them, when linking they come in once after all the units
+  bool pulls_in_runtime = true;
+  // a global label that is unused here may still be called from another unit
+  bool keeps_global_labels = false;
+  // which __mulqi3 / __mulhi3 the runtime brings in
+  MultiplyMode multiply = MultiplyMode::fast;
+};
+
+// one translated unit waiting to be linked
+struct TranslatedUnit
+{
+  std::vector<mos6502> instructions;
+  Annotations          annotations;
+};
+
+// Calls `label(name)` for every label in an operand expression (`label`, `label+1`, `-(label)`, `$0b,LC0`) and
+// `other(c)` for every character that isn't part of one
+template<typename Label, typename Other>
+void scan_expression(const std::string_view expression, Label label, Other other)
+{
+  const auto starts_label = [](const char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'; };
+  const auto in_label     = [&](const char c) { return starts_label(c) || (c >= '0' && c <= '9') || c == '.'; };
+
+  for (std::size_t index = 0; index < expression.size();) {
+    // the letters of a hex number like $0b are not a label
+    const bool follows_word = index > 0 && (in_label(expression[index - 1]) || expression[index - 1] == '$');
+    if (follows_word || !starts_label(expression[index])) {
+      other(expression[index++]);
+      continue;
+    }
+
+    auto end = index;
+    while (end < expression.size() && in_label(expression[end])) { ++end; }
+    label(expression.substr(index, end - index));
+    index = end;
+  }
+}
+
+// Replaces every label in an operand expression that is in `renamed`
+[[nodiscard]] inline std::string rename_labels(const std::string_view expression,
+  const std::unordered_map<std::string, std::string> &renamed)
+{
+  std::string result;
+  scan_expression(
+    expression,
+    [&](const std::string_view label) {
+      if (const auto rename = renamed.find(std::string{ label }); rename != renamed.end()) {
+        result += rename->second;
+      } else {
+        result += label;
+      }
+    },
+    [&](const char c) { result += c; });
+  return result;
+}
+
+// Puts the translated units one after the other. Every unit was translated on its own, so labels like `L2`,
+// `skip_next_instruction_12` or `patch_1` can be defined in more than one of them: those get the unit's number
+// as a prefix, in the unit that defines them. A label defined exactly once is left alone, it is either global or
+// unique already. Redefinable `-` labels only ever refer to a definition close by and are never renamed.
+[[nodiscard]] inline std::vector<mos6502> link_units(std::vector<TranslatedUnit> &units, Annotations &annotations)
+{
+  std::unordered_map<std::string, int> definitions;
+  for (const auto &unit : units) {
+    for (const auto &line : unit.instructions) {
+      if (line.type == ASMLine::Type::Label && !line.text.starts_with('-')) { ++definitions[line.text]; }
+    }
+  }
+
+  std::vector<mos6502> program;
+  for (std::size_t unit_number = 0; unit_number < units.size(); ++unit_number) {
+    auto &unit = units[unit_number];
+
+    std::unordered_map<std::string, std::string> renamed;
+    for (const auto &line : unit.instructions) {
+      if (line.type == ASMLine::Type::Label && definitions[line.text] > 1) {
+        renamed.emplace(line.text, fmt::format("u{}_{}", unit_number, line.text));
+      }
+    }
+
+    const auto first_note = static_cast<std::uint32_t>(annotations.notes.size());
+    for (auto &note : unit.annotations.notes) { annotations.notes.push_back(std::move(note)); }
+
+    for (auto &line : unit.instructions) {
+      if (line.annotation != 0) { line.annotation += first_note; }
+
+      if (!renamed.empty()) {
+        if (line.type == ASMLine::Type::Label) {
+          if (const auto rename = renamed.find(line.text); rename != renamed.end()) { line.text = rename->second; }
+        } else if (line.type == ASMLine::Type::Instruction) {
+          line.op.symbol = symbols().intern(rename_labels(line.op.name(), renamed));
+        } else if (line.text.starts_with(".word ") || line.text.starts_with(".byt ")) {
+          line.text = rename_labels(line.text, renamed);
+        }
+      }
+
+      program.push_back(std::move(line));
+    }
+  }
+
+  return program;
+}
+
+struct ReclaimedSpace
+{
+  int         regions = 0;
+  std::size_t bytes   = 0;
+};
+
+// Whole program reachability, the way a linker's garbage collection of sections works. The program is cut into
+// regions at every label, and at every label run() commented out as unused. The search starts at the region before
+// the first label (the startup code), at `main` and at the AVR interrupt handlers (`__vector_N`). A region that is
+// reached makes every label it mentions reachable, in an operand or in a .byt / .word, and the region after it too
+// unless it ends in a jmp, an rts or data. Functions and data nobody can get to are removed. An `.align` in front of a
+// label is part of that label's region, so the padding stays exactly when what it aligns stays.
+inline ReclaimedSpace remove_unreachable_code(std::vector<mos6502> &program)
+{
+  struct Region
+  {
+    std::size_t begin;
+    std::size_t end;
+  };
+
+  std::vector<Region>                                        regions{ { 0, program.size() } };
+  std::unordered_map<std::string, std::vector<std::size_t>> regions_of_label;
+
+  for (std::size_t index = 0; index < program.size(); ++index) {
+    const auto &line = program[index];
+    if (line.type == ASMLine::Type::Label
+        || (line.type == ASMLine::Type::Directive && line.text.starts_with("; Label is unused: "))) {
+      // an `.align` belongs to what it aligns, it goes or stays with the label after it
+      auto begin = index;
+      while (begin > regions.back().begin + 1 && program[begin - 1].type == ASMLine::Type::Directive
+             && program[begin - 1].text.starts_with(".align ")) {
+        --begin;
+      }
+      regions.back().end = begin;
+      regions.push_back({ begin, program.size() });
+    }
+    if (line.type == ASMLine::Type::Label) {
+      const auto name = std::string_view{ line.text }.substr(line.text.starts_with('-') ? 1 : 0);
+      regions_of_label[std::string{ name }].push_back(regions.size() - 1);
+    }
+  }
+
+  std::vector<bool>        reachable(regions.size(), false);
+  std::vector<std::size_t> pending;
+
+  const auto reach = [&](const std::size_t region) {
+    if (!reachable[region]) {
+      reachable[region] = true;
+      pending.push_back(region);
+    }
+  };
+  const auto reach_label = [&](const std::string_view label) {
+    if (const auto found = regions_of_label.find(std::string{ label }); found != regions_of_label.end()) {
+      for (const auto region : found->second) { reach(region); }
+    }
+  };
+
+  reach(0);
+  for (const auto &[label, label_regions] : regions_of_label) {
+    if (label == "main" || label.starts_with("__vector_")) {
+      for (const auto region : label_regions) { reach(region); }
+    }
+  }
+
+  while (!pending.empty()) {
+    const auto region = pending.back();
+    pending.pop_back();
+
+    bool falls_through = true;
+    for (auto index = regions[region].begin; index < regions[region].end; ++index) {
+      const auto &line = program[index];
+      if (line.type == ASMLine::Type::Instruction) {
+        if (line.op.symbol != SymbolTable::none) { scan_expression(line.op.name(), reach_label, [](const char) {}); }
+        falls_through = line.opcode != mos6502::OpCode::jmp && line.opcode != mos6502::OpCode::rts;
+      } else if (line.type == ASMLine::Type::Directive && line.size() != 0) {
+        scan_expression(std::string_view{ line.text }.substr(line.text.find(' ')), reach_label, [](const char) {});
+        falls_through = false;
+      }
+    }
+
+    if (falls_through && region + 1 < regions.size()) { reach(region + 1); }
+  }
+
+  ReclaimedSpace    reclaimed;
+  std::vector<bool> removed(program.size(), false);
+  for (std::size_t region = 0; region < regions.size(); ++region) {
+    if (reachable[region]) { continue; }
+    ++reclaimed.regions;
+    for (auto index = regions[region].begin; index < regions[region].end; ++index) {
+      reclaimed.bytes += program[index].size();
+      removed[index] = true;
+    }
+  }
+
+  std::size_t kept = 0;
+  for (std::size_t index = 0; index < program.size(); ++index) {
+    if (removed[index]) { continue; }
+    if (kept != index) { program[kept] = std::move(program[index]); }
+    ++kept;
+  }
+  program.erase(program.begin() + static_cast<std::ptrdiff_t>(kept), program.end());
+
+  return reclaimed;
+}
+
+#endif// INC_6502_CPP_LINKER_HPP
@@ -0,0 +1,269 @@
+#ifndef INC_6502_CPP_LIVENESS_HPP
+#define INC_6502_CPP_LIVENESS_HPP
+
+#include <cstdint>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+#include "6502.hpp"
+#include "control_flow.hpp"
+#include "personality.hpp"
+
+// A set of the 6502 registers and flags and the 32 zero page virtual registers that stand in for the AVR ones
+using RegisterSet = std::uint64_t;
+
+struct Registers
+{
+  static constexpr RegisterSet A = 1u << 0u;
+  static constexpr RegisterSet X = 1u << 1u;
+  static constexpr RegisterSet Y = 1u << 2u;
+  static constexpr RegisterSet N = 1u << 3u;
+  static constexpr RegisterSet Z = 1u << 4u;
+  static constexpr RegisterSet C = 1u << 5u;
+  static constexpr RegisterSet V = 1u << 6u;
+
+  static constexpr RegisterSet flags = N | Z | C | V;
+
+  static constexpr RegisterSet virtual_register(const int reg_num)
+  {
+    return RegisterSet{ 1 } << (8u + static_cast<unsigned>(reg_num));
+  }
+
+  static constexpr RegisterSet virtual_registers = RegisterSet{ 0xFFFFFFFFu } << 8u;
+};
+
+// What one line reads and writes. Lines with side effects (memory that isn't a virtual register, the stack, control
+// flow) must stay, no matter what is live after them.
+struct Effects
+{
+  RegisterSet uses             = 0;
+  RegisterSet defines          = 0;
+  bool        has_side_effects = false;
+};
+
+class VirtualRegisters
+{
+public:
+  explicit VirtualRegisters(const Personality &personality)
+  {
+    for (int reg = 0; reg < 32; ++reg) { reg_nums.emplace(personality.get_register(reg).symbol, reg); }
+  }
+
+  // the virtual register an operand addresses directly, if it is one
+  [[nodiscard]] RegisterSet of(const Operand &op) const
+  {
+    if (op.offset != 0
+        || (op.mode != Operand::AddressingMode::zero_page && op.mode != Operand::AddressingMode::absolute)) {
+      return 0;
+    }
+    if (const auto reg = reg_nums.find(op.symbol); reg != reg_nums.end()) {
+      return Registers::virtual_register(reg->second);
+    }
+    return 0;
+  }
+
+  // the pair of virtual registers an indirect operand points through, or all of them if it isn't a virtual register
+  [[nodiscard]] RegisterSet pointer(const Operand &op) const
+  {
+    if (const auto reg = reg_nums.find(op.symbol); reg != reg_nums.end() && reg->second < 31) {
+      return Registers::virtual_register(reg->second) | Registers::virtual_register(reg->second + 1);
+    }
+    return Registers::virtual_registers;
+  }
+
+private:
+  std::unordered_map<SymbolId, int> reg_nums;
+};
+
+[[nodiscard]] inline Effects effects_of(const mos6502 &line, const VirtualRegisters &virtual_registers)
+{
+  using enum mos6502::OpCode;
+
+  if (line.type != ASMLine::Type::Instruction) { return {}; }
+
+  const auto &op               = line.op;
+  const auto  register_operand = virtual_registers.of(op);
+  const bool  immediate        = op.mode == Operand::AddressingMode::immediate;
+  const bool  on_a             = op.mode == Operand::AddressingMode::accumulator;
+
+  // the operand as something read: nothing for immediates, a virtual register, or memory with side effects
+  Effects effects;
+  const auto read_operand = [&] {
+    if (op.mode == Operand::AddressingMode::indirect_y) {
+      effects.uses |= virtual_registers.pointer(op) | Registers::Y;
+      effects.has_side_effects = true;
+    } else if (register_operand != 0) {
+      effects.uses |= register_operand;
+    } else if (!immediate && !on_a) {
+      effects.has_side_effects = true;
+    }
+  };
+  const auto write_operand = [&] {
+    if (op.mode == Operand::AddressingMode::indirect_y) {
+      effects.uses |= virtual_registers.pointer(op) | Registers::Y;
+      effects.has_side_effects = true;
+    } else if (register_operand != 0) {
+      effects.defines |= register_operand;
+    } else {
+      effects.has_side_effects = true;
+    }
+  };
+  // asl, lsr, rol, ror, inc and dec on A or on memory
+  const auto modify = [&](const RegisterSet uses, const RegisterSet defines) {
+    effects.uses |= uses;
+    effects.defines |= defines;
+    if (on_a) {
+      effects.uses |= Registers::A;
+      effects.defines |= Registers::A;
+    } else {
+      read_operand();
+      write_operand();
+    }
+  };
+
+  switch (line.opcode) {
+  case adc:
+  case sbc:
+    read_operand();
+    effects.uses |= Registers::A | Registers::C;
+    effects.defines |= Registers::A | Registers::flags;
+    break;
+  case AND:
+  case ORA:
+  case eor:
+    read_operand();
+    effects.uses |= Registers::A;
+    effects.defines |= Registers::A | Registers::N | Registers::Z;
+    break;
+  case asl:
+  case lsr: modify(0, Registers::N | Registers::Z | Registers::C); break;
+  case rol:
+  case ror: modify(Registers::C, Registers::N | Registers::Z | Registers::C); break;
+  case inc:
+  case dec: modify(0, Registers::N | Registers::Z); break;
+  case bit:
+    read_operand();
+    effects.uses |= Registers::A;
+    effects.defines |= Registers::N | Registers::V | Registers::Z;
+    break;
+  case cmp:
+  case cpx:
+  case cpy:
+    read_operand();
+    effects.uses |= line.opcode == cmp ? Registers::A : line.opcode == cpx ? Registers::X : Registers::Y;
+    effects.defines |= Registers::N | Registers::Z | Registers::C;
+    break;
+  case lda:
+  case ldx:
+  case ldy:
+    read_operand();
+    effects.defines |= (line.opcode == lda ? Registers::A : line.opcode == ldx ? Registers::X : Registers::Y)
+                       | Registers::N | Registers::Z;
+    break;
+  case sta:
+  case stx:
+  case sty:
+    write_operand();
+    effects.uses |= line.opcode == sta ? Registers::A : line.opcode == stx ? Registers::X : Registers::Y;
+    break;
+  case tax: effects = { Registers::A, Registers::X | Registers::N | Registers::Z, false }; break;
+  case tay: effects = { Registers::A, Registers::Y | Registers::N | Registers::Z, false }; break;
+  case txa: effects = { Registers::X, Registers::A | Registers::N | Registers::Z, false }; break;
+  case tya: effects = { Registers::Y, Registers::A | Registers::N | Registers::Z, false }; break;
+  case tsx: effects = { 0, Registers::X | Registers::N | Registers::Z, false }; break;
+  case inx:
+  case dex: effects = { Registers::X, Registers::X | Registers::N | Registers::Z, false }; break;
+  case iny:
+  case dey: effects = { Registers::Y, Registers::Y | Registers::N | Registers::Z, false }; break;
+  case clc:
+  case sec: effects = { 0, Registers::C, false }; break;
+  case nop: break;
+
+  case txs: effects = { Registers::X, 0, true }; break;
+  case pha: effects = { Registers::A, 0, true }; break;
+  case php: effects = { Registers::flags, 0, true }; break;
+  case pla: effects = { 0, Registers::A | Registers::N | Registers::Z, true }; break;
+  case plp: effects = { 0, Registers::flags, true }; break;
+
+  case beq:
+  case bne: effects = { Registers::Z, 0, true }; break;
+  case bmi:
+  case bpl: effects = { Registers::N, 0, true }; break;
+  case bcc:
+  case bcs: effects = { Registers::C, 0, true }; break;
+  case bvs: effects = { Registers::V, 0, true }; break;
+
+  case jmp:
+    effects.has_side_effects = true;
+    if (op.mode == Operand::AddressingMode::indirect) { effects.uses |= virtual_registers.pointer(op); }
+    break;
+  // whatever is called may read any of the virtual registers, and nothing that was in A, X, Y or the flags
+  // survives the call
+  case jsr:
+    effects = { Registers::virtual_registers, Registers::A | Registers::X | Registers::Y | Registers::flags, true };
+    break;
+  case rts: effects = { 0, 0, true }; break;
+
+  case unknown: effects = { ~RegisterSet{ 0 }, 0, true }; break;
+  }
+
+  return effects;
+}
+
+// Backward liveness of the registers, flags and virtual registers over the control flow graph. Whenever control
+// leaves the code we can see (rts, a jump outside of the program) all of the virtual registers are live, the values
+// in A, X, Y and the flags never are.
+class Liveness
+{
+public:
+  Liveness(const std::span<const mos6502> lines, const ControlFlowGraph &cfg, const VirtualRegisters &virtual_registers)
+    : after(lines.size(), 0)
+  {
+    std::vector<Effects> effects;
+    effects.reserve(lines.size());
+    for (const auto &line : lines) { effects.push_back(effects_of(line, virtual_registers)); }
+
+    const auto transfer = [&](const std::size_t begin, const std::size_t end, RegisterSet live) {
+      for (auto index = end; index > begin; --index) {
+        live = (live & ~effects[index - 1].defines) | effects[index - 1].uses;
+      }
+      return live;
+    };
+
+    std::vector<RegisterSet> live_in(cfg.blocks.size(), 0);
+    std::vector<RegisterSet> live_out(cfg.blocks.size(), 0);
+
+    for (bool changed = true; changed;) {
+      changed = false;
+      for (auto block = cfg.blocks.size(); block > 0; --block) {
+        const auto &current = cfg.blocks[block - 1];
+        RegisterSet out = current.exits ? Registers::virtual_registers : 0;
+        for (const auto successor : current.successors) { out |= live_in[successor]; }
+
+        const auto in = transfer(current.begin, current.end, out);
+        if (in != live_in[block - 1] || out != live_out[block - 1]) {
+          live_in[block - 1] = in;
+          live_out[block - 1] = out;
+          changed = true;
+        }
+      }
+    }
+
+    for (std::size_t block = 0; block < cfg.blocks.size(); ++block) {
+      auto live = live_out[block];
+      for (auto index = cfg.blocks[block].end; index > cfg.blocks[block].begin; --index) {
+        after[index - 1] = live;
+        live = (live & ~effects[index - 1].defines) | effects[index - 1].uses;
+      }
+    }
+  }
+
+  // what is live right after line `index`
+  [[nodiscard]] RegisterSet live_after(const std::size_t index) const { return after[index]; }
+
+private:
+  std::vector<RegisterSet> after;
+};
+
+#endif// INC_6502_CPP_LIVENESS_HPP
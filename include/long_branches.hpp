@@ -0,0 +1,117 @@
+#ifndef INC_6502_CPP_LONG_BRANCHES_HPP
+#define INC_6502_CPP_LONG_BRANCHES_HPP
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "6502.hpp"
+#include "symbol_table.hpp"
+
+// Branches that cannot reach their target are widened into the inverted branch over a `jmp`. Widening only ever
+// moves code further apart, so the branches are re-checked against the new offsets until nothing else has to grow,
+// then the program is rebuilt once. Returns the number of branches that were widened.
+inline int fix_long_branches(std::vector<mos6502> &instructions)
+{
+  // an inverted branch (2 bytes) and a jmp (3 bytes)
+  constexpr std::ptrdiff_t widened_size = 5;
+
+  const auto inverted = [](const mos6502::OpCode opcode) {
+    switch (opcode) {
+    case mos6502::OpCode::bne: return mos6502::OpCode::beq;
+    case mos6502::OpCode::beq: return mos6502::OpCode::bne;
+    case mos6502::OpCode::bcc: return mos6502::OpCode::bcs;
+    case mos6502::OpCode::bcs: return mos6502::OpCode::bcc;
+    case mos6502::OpCode::bmi: return mos6502::OpCode::bpl;
+    case mos6502::OpCode::bpl: return mos6502::OpCode::bmi;
+    default: return mos6502::OpCode::unknown;
+    }
+  };
+
+  std::unordered_map<SymbolId, std::vector<std::size_t>> labels;
+  for (std::size_t op = 0; op < instructions.size(); ++op) {
+    if (instructions[op].type == ASMLine::Type::Label) {
+      // `-label` defines a label that may be redefined, it is still referred to as `label`
+      auto name = std::string_view{ instructions[op].text };
+      if (name.starts_with('-')) { name.remove_prefix(1); }
+      labels[symbols().intern(name)].push_back(op);
+    }
+  }
+
+  // branch and the line of its target, branches to unknown targets are left alone. Like the assembler, a branch to a
+  // redefined label goes to the closest definition before it.
+  std::vector<std::pair<std::size_t, std::size_t>> branches;
+  for (std::size_t op = 0; op < instructions.size(); ++op) {
+    if (!instructions[op].is_branch) { continue; }
+    if (const auto target = labels.find(instructions[op].op.symbol); target != labels.end()) {
+      auto closest = target->second.front();
+      for (const auto definition : target->second) {
+        if (definition < op) { closest = definition; }
+      }
+      branches.emplace_back(op, closest);
+    }
+  }
+
+  std::vector<bool>           widened(instructions.size(), false);
+  std::vector<std::ptrdiff_t> addresses(instructions.size());
+  int                         widened_count = 0;
+
+  for (bool changed = true; changed;) {
+    changed = false;
+
+    std::ptrdiff_t address = 0;
+    for (std::size_t op = 0; op < instructions.size(); ++op) {
+      addresses[op] = address;
+      address += widened[op] ? widened_size : static_cast<std::ptrdiff_t>(instructions[op].size());
+    }
+
+    for (const auto &[branch, target] : branches) {
+      if (widened[branch]) { continue; }
+
+      // a branch reaches -128..127 bytes from the end of its own 2 bytes
+      const auto distance = addresses[target] - (addresses[branch] + 2);
+      if (distance < -128 || distance > 127) {
+        if (inverted(instructions[branch].opcode) == mos6502::OpCode::unknown) {
+          throw std::runtime_error("Don't know how to reorg this branch: " + instructions[branch].to_string());
+        }
+        widened[branch] = true;
+        ++widened_count;
+        changed = true;
+      }
+    }
+  }
+
+  if (widened_count == 0) { return 0; }
+
+  std::vector<mos6502> result;
+  result.reserve(instructions.size() + 2 * static_cast<std::size_t>(widened_count));
+
+  int patch_count = 0;
+  for (std::size_t op = 0; op < instructions.size(); ++op) {
+    if (!widened[op]) {
+      result.push_back(std::move(instructions[op]));
+      continue;
+    }
+
+    // uh-oh too long of a branch, have to convert this to a jump...
+    const auto new_pos = "patch_" + std::to_string(++patch_count);
+    const auto &comment = instructions[op].comment;
+    auto &inverted_branch =
+      result.emplace_back(inverted(instructions[op].opcode), Operand(Operand::Type::literal, new_pos));
+    inverted_branch.comment = comment;
+    inverted_branch.annotation = instructions[op].annotation;
+    auto going_to = instructions[op].op;
+    going_to.mode = Operand::AddressingMode::absolute;
+    result.emplace_back(mos6502::OpCode::jmp, going_to).comment = comment;
+    result.emplace_back(ASMLine::Type::Label, new_pos).comment = comment;
+  }
+
+  instructions = std::move(result);
+  return widened_count;
+}
+
+#endif// INC_6502_CPP_LONG_BRANCHES_HPP
@@ -0,0 +1,73 @@
+#ifndef INC_6502_CPP_MAPPED_FILE_HPP
+#define INC_6502_CPP_MAPPED_FILE_HPP
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read only contents of a whole file. Where mmap is available the file is mapped instead of read,
+// so everything parsed out of it can stay a view into the mapping without any copying.
+class MappedFile
+{
+public:
+  explicit MappedFile(const std::filesystem::path &path)
+  {
+#if __has_include(<sys/mman.h>)
+    if (const int fd = ::open(path.c_str(), O_RDONLY); fd >= 0) {
+      struct stat status = {};
+      if (::fstat(fd, &status) == 0 && status.st_size > 0) {
+        const auto file_size = static_cast<std::size_t>(status.st_size);
+        if (void *data = ::mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0); data != MAP_FAILED) {
+          ::madvise(data, file_size, MADV_SEQUENTIAL);
+          mapping = data;
+          size = file_size;
+        }
+      }
+      ::close(fd);
+    }
+
+    if (mapping != nullptr) { return; }
+#endif
+
+    // no mmap (or an empty file), fall back to a single read of the whole thing
+    std::ifstream input(path, std::ios::binary | std::ios::ate);
+    if (const auto file_size = static_cast<std::streamoff>(input.tellg()); file_size > 0) {
+      buffer.resize(static_cast<std::size_t>(file_size));
+      input.seekg(0);
+      input.read(buffer.data(), file_size);
+    }
+  }
+
+  ~MappedFile()
+  {
+#if __has_include(<sys/mman.h>)
+    if (mapping != nullptr) { ::munmap(mapping, size); }
+#endif
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile(MappedFile &&) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  MappedFile &operator=(MappedFile &&) = delete;
+
+  [[nodiscard]] std::string_view contents() const noexcept
+  {
+    if (mapping != nullptr) { return { static_cast<const char *>(mapping), size }; }
+    return buffer;
+  }
+
+private:
+  void       *mapping = nullptr;
+  std::size_t size = 0;
+  std::string buffer;
+};
+
+#endif// INC_6502_CPP_MAPPED_FILE_HPP
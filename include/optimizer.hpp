@@ -2,151 +2,86 @@
 #define INC_6502_CPP_OPTIMIZER_HPP
 
 #include "6502.hpp"
+#include "control_flow.hpp"
+#include "liveness.hpp"
 #include "personality.hpp"
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <numeric>
+#include <optional>
 #include <span>
+#include <string>
 #include <vector>
 
 
-constexpr bool consume_directives(auto &begin, const auto &end)
+constexpr bool is_opcode(const mos6502 &op, const auto... opcodes)
 {
-  if (begin != end && begin->type == ASMLine::Type::Directive) {
-    ++begin;
-    return true;
-  }
-  return false;
+  return op.type == ASMLine::Type::Instruction && ((op.opcode == opcodes) || ...);
 }
 
-
-constexpr bool consume_labels(auto &begin, const auto &end)
+// the `inc` / `bne` / `inc` that increments a 16 bit register only touches that register, the peephole passes may
+// treat it as straight line code
+inline bool is_optimizable_edge(const mos6502 &line)
 {
-  if (begin != end && begin->type == ASMLine::Type::Label) {
-    ++begin;
-    return true;
-  }
-  return false;
+  return line.text.ends_with("__optimizable") || line.op.name().ends_with("__optimizable");
 }
 
-constexpr bool is_opcode(const mos6502 &op, const auto... opcodes) { return ((op.opcode == opcodes) || ...); }
-
-constexpr bool is_end_of_block(const auto &begin)
+// The parts of the basic blocks the peephole passes work on: the leading labels and comments and the terminating
+// jump or branch are left out, and blocks that are only split by an __optimizable edge are joined up.
+static std::vector<std::span<mos6502>> get_optimizable_blocks(std::vector<mos6502> &statements,
+  const ControlFlowGraph &cfg)
 {
-  if (begin->text.ends_with("__optimizable") || begin->op.value.ends_with("__optimizable")) {
-        return false;
-  }
-
-  if (begin->type == ASMLine::Type::Label) { return true; }
-
-  return is_opcode(*begin,
-    mos6502::OpCode::jsr,
-    mos6502::OpCode::jmp,
-    mos6502::OpCode::bcc,
-    mos6502::OpCode::bcs,
-    mos6502::OpCode::beq,
-    mos6502::OpCode::bne,
-    mos6502::OpCode::bpl);
-}
+  std::vector<std::span<mos6502>> blocks;
 
-constexpr bool consume_end_of_block(auto &begin, const auto &end)
-{
-  if (begin != end && is_end_of_block(begin)) {
-    ++begin;
-    return true;
-  }
-  return false;
-}
+  const auto at = [&](const std::size_t index) {
+    return std::next(statements.begin(), static_cast<std::ptrdiff_t>(index));
+  };
 
-static std::vector<std::span<mos6502>> get_optimizable_blocks(std::vector<mos6502> &statements)
-{
-  std::vector<std::span<mos6502>> blocks;
+  bool        open         = false;
+  std::size_t region_begin = 0;
 
-  auto begin = std::begin(statements);
-  auto end = std::end(statements);
+  for (std::size_t block = 0; block < cfg.blocks.size(); ++block) {
+    const auto begin = cfg.blocks[block].begin;
+    const auto end   = cfg.blocks[block].end;
 
-  const auto find_end_of_block = [](auto &find_begin, const auto &find_end) {
-    while (find_begin != find_end) {
-      if (is_end_of_block(find_begin)) { return; }
-      ++find_begin;
+    if (!open) {
+      region_begin = begin;
+      while (region_begin < end && statements[region_begin].type != ASMLine::Type::Instruction) { ++region_begin; }
     }
-  };
-
-  while (begin != end) {
-    while (consume_end_of_block(begin, end) || consume_directives(begin, end) || consume_labels(begin, end)) {}
 
-    const auto block_start = begin;
-    find_end_of_block(begin, end);
+    const auto &last = statements[end - 1];
+    if (ControlFlowGraph::is_terminator(last)) {
+      open = is_optimizable_edge(last);
+      if (!open) { blocks.emplace_back(at(region_begin), at(std::max(region_begin, end - 1))); }
+      continue;
+    }
 
-    blocks.emplace_back(block_start, begin);
+    const bool next_is_joined = block + 1 < cfg.blocks.size()
+                                && is_optimizable_edge(statements[cfg.blocks[block + 1].begin]);
+    open = next_is_joined;
+    if (!open) { blocks.emplace_back(at(region_begin), at(std::max(region_begin, end))); }
   }
 
   return blocks;
 }
 
+static bool is_immediate(const Operand &op) { return op.mode == Operand::AddressingMode::immediate; }
+
 static bool is_virtual_register_op(const mos6502 &op, const Personality &personality)
 {
   for (int i = 0; i < 32; ++i) {
-    if (personality.get_register(i).value == op.op.value) { return true; }
-  }
-
-  return false;
-}
-
-static bool optimize_dead_tax(std::span<mos6502> &block)
-{
-  for (auto itr = block.begin(); itr != block.end(); ++itr) {
-    if (is_opcode(*itr, mos6502::OpCode::tax, mos6502::OpCode::tsx, mos6502::OpCode::ldx)) {
-      for (auto inner = std::next(itr); inner != block.end(); ++inner) {
-        if (is_opcode(*inner,
-              mos6502::OpCode::txa,
-              mos6502::OpCode::txs,
-              mos6502::OpCode::stx,
-              mos6502::OpCode::inx,
-              mos6502::OpCode::dex,
-              mos6502::OpCode::cpx)) {
-          break;
-        }
-        if (is_opcode(*inner, mos6502::OpCode::tax, mos6502::OpCode::tsx, mos6502::OpCode::ldx)) {
-          // redundant store found
-          *itr = mos6502(ASMLine::Type::Directive, "; removed dead load of X: " + itr->to_string());
-          return true;
-        }
-      }
-    }
+    if (personality.get_register(i) == op.op) { return true; }
   }
 
   return false;
 }
 
-bool optimize_dead_sta(std::span<mos6502> &block, const Personality &personality)
+int optimize_redundant_ldy(std::span<mos6502> &block)
 {
+  int rewrites = 0;
   for (auto itr = block.begin(); itr != block.end(); ++itr) {
-    if (itr->opcode == mos6502::OpCode::sta && is_virtual_register_op(*itr, personality)) {
-      for (auto inner = std::next(itr); inner != block.end(); ++inner) {
-        if (not inner->op.value.starts_with("#<(") && inner->op.value.find('(') != std::string::npos) {
-          // this is an indexed operation, which is risky to optimize a sta around on the virtual registers,
-          // so we'll skip this block
-          break;
-        }
-        if (inner->op.value == itr->op.value) {
-          if (is_opcode(*inner, mos6502::OpCode::sta)) {
-            // redundant store found
-            *itr = mos6502(ASMLine::Type::Directive, "; removed dead store of a: " + itr->to_string());
-            return true;
-          } else {
-            // someone else is operating on us, time to abort
-            break;
-          }
-        }
-      }
-    }
-  }
-
-  return false;
-}
-
-bool optimize_redundant_ldy(std::span<mos6502> &block)
-{
-  for (auto itr = block.begin(); itr != block.end(); ++itr) {
-    if (itr->opcode == mos6502::OpCode::ldy && itr->op.value.starts_with('#')) {
+    if (is_opcode(*itr, mos6502::OpCode::ldy) && is_immediate(itr->op)) {
       for (auto inner = std::next(itr); inner != block.end(); ++inner) {
         if (is_opcode(*inner,
               mos6502::OpCode::cpy,
@@ -162,9 +97,9 @@ bool optimize_redundant_ldy(std::span<mos6502> &block)
           // with the same value
           // note: this operation is only safe because we know that our system only uses Y
           // for index operations and we don't rely (or even necessarily *want* the changes to N,Z)
-          if (inner->op.value == itr->op.value) {
-            *inner = mos6502(ASMLine::Type::Directive, "; removed redundant ldy: " + inner->to_string());
-            return true;
+          if (inner->op == itr->op) {
+            inner->remove("redundant ldy");
+            ++rewrites;
           } else {
             break;
           }
@@ -173,16 +108,17 @@ bool optimize_redundant_ldy(std::span<mos6502> &block)
     }
   }
 
-  return false;
+  return rewrites;
 }
 
-bool optimize_redundant_lda(std::span<mos6502> &block, const Personality &personality)
+int optimize_redundant_lda(std::span<mos6502> &block, const Personality &personality)
 {
+  int rewrites = 0;
   // look for a literal or virtual register load into A
   // that is redundant later
   for (auto itr = block.begin(); itr != block.end(); ++itr) {
-    if (itr->opcode == mos6502::OpCode::lda
-        && (itr->op.value.starts_with('#') || is_virtual_register_op(*itr, personality))) {
+    if (is_opcode(*itr, mos6502::OpCode::lda)
+        && (is_immediate(itr->op) || is_virtual_register_op(*itr, personality))) {
       for (auto inner = std::next(itr); inner != block.end(); ++inner) {
         if (is_opcode(*inner,
               mos6502::OpCode::tay,
@@ -198,8 +134,9 @@ bool optimize_redundant_lda(std::span<mos6502> &block, const Personality &person
         if (is_opcode(*inner, mos6502::OpCode::lda)) {
           if (inner->op == itr->op) {
             // we found a matching lda, after an sta, we can remove it
-            *inner = mos6502(ASMLine::Type::Directive, "; removed redundant lda: " + inner->to_string());
-            return true;
+            inner->remove("redundant lda");
+            ++rewrites;
+            continue;
           } else {
             break;
           }
@@ -210,13 +147,14 @@ bool optimize_redundant_lda(std::span<mos6502> &block, const Personality &person
     }
   }
 
-  return false;
+  return rewrites;
 }
 
-bool optimize_redundant_lda_after_sta(std::span<mos6502> &block)
+int optimize_redundant_lda_after_sta(std::span<mos6502> &block)
 {
+  int rewrites = 0;
   for (auto itr = block.begin(); itr != block.end(); ++itr) {
-    if (itr->opcode == mos6502::OpCode::sta) {
+    if (is_opcode(*itr, mos6502::OpCode::sta)) {
       for (auto inner = std::next(itr); inner != block.end(); ++inner) {
         if (is_opcode(*inner,
               mos6502::OpCode::tax,
@@ -237,8 +175,9 @@ bool optimize_redundant_lda_after_sta(std::span<mos6502> &block)
         if (is_opcode(*inner, mos6502::OpCode::lda)) {
           if (inner->op == itr->op) {
             // we found a matching lda, after a sta, we can remove it
-            *inner = mos6502(ASMLine::Type::Directive, "; removed redundant lda: " + inner->to_string());
-            return true;
+            inner->remove("redundant lda");
+            ++rewrites;
+            continue;
           } else {
             break;
           }
@@ -249,53 +188,264 @@ bool optimize_redundant_lda_after_sta(std::span<mos6502> &block)
     }
   }
 
-  return false;
+  return rewrites;
+}
+
+// Removes the lines that have no side effects and whose results (registers, flags, virtual registers) are all
+// overwritten before anyone reads them. Returns the indexes of the lines that were removed.
+static std::vector<std::size_t> optimize_dead_code(std::vector<mos6502> &instructions,
+  const Liveness &liveness,
+  const VirtualRegisters &virtual_registers)
+{
+  std::vector<std::size_t> removed;
+  for (std::size_t index = 0; index < instructions.size(); ++index) {
+    auto &line = instructions[index];
+    if (line.type != ASMLine::Type::Instruction) { continue; }
+
+    const auto effects = effects_of(line, virtual_registers);
+    if (effects.has_side_effects || effects.defines == 0 || (effects.defines & liveness.live_after(index)) != 0) {
+      continue;
+    }
+
+    line.remove(is_opcode(line, mos6502::OpCode::sta, mos6502::OpCode::stx, mos6502::OpCode::sty) ? "dead store"
+                                                                                                  : "dead load");
+    removed.push_back(index);
+  }
+
+  return removed;
 }
 
-bool optimize(std::vector<mos6502> &instructions, [[maybe_unused]] const Personality &personality)
+// Walks each basic block keeping track of what A, X and Y hold (an immediate value or a copy of a virtual register),
+// so that the AVR register a value was just stored to or loaded from stays in A / X / Y for as long as nothing
+// overwrites it. A load or transfer that would put the same value back is removed, as long as nobody reads the N and
+// Z flags it would have set. Returns the indexes of the lines that were removed.
+static std::vector<std::size_t> optimize_known_register_contents(std::vector<mos6502> &instructions,
+  const ControlFlowGraph &cfg,
+  const Liveness &liveness,
+  const VirtualRegisters &virtual_registers)
 {
+  using enum mos6502::OpCode;
+
+  std::vector<std::size_t> removed;
 
+  for (const auto &block : cfg.blocks) {
+    // A, X, Y
+    std::array<std::optional<Operand>, 3> contents;
 
-  // remove unused flag-fix-up blocks
-  // it might make sense in the future to only insert these if determined they are needed?
-  for (size_t op = 10; op < instructions.size(); ++op) {
-    if (instructions[op].opcode == mos6502::OpCode::lda || instructions[op].opcode == mos6502::OpCode::bcc
-        || instructions[op].opcode == mos6502::OpCode::bcs || instructions[op].opcode == mos6502::OpCode::ldy
-        || instructions[op].opcode == mos6502::OpCode::inc || instructions[op].opcode == mos6502::OpCode::clc
-        || instructions[op].opcode == mos6502::OpCode::sec || instructions[op].text.starts_with("; Handle N / S")) {
-      if (instructions[op - 1].text == "; END remove if next is lda, bcc, bcs, ldy, inc, clc, sec"
-          || (instructions[op - 2].text == "; END remove if next is lda, bcc, bcs, ldy, inc, clc, sec"
-              && instructions[op - 1].type == ASMLine::Type::Directive)) {
-        for (size_t inner_op = op - 1; inner_op > 1; --inner_op) {
-          instructions[inner_op] =
-            mos6502(ASMLine::Type::Directive, "; removed unused flag fix-up: " + instructions[inner_op].to_string());
-
-          if (instructions[inner_op].text.find("; BEGIN") != std::string::npos) { return true; }
+    const auto forget = [&](const RegisterSet overwritten) {
+      for (auto &content : contents) {
+        if (content && (virtual_registers.of(*content) & overwritten) != 0) { content.reset(); }
+      }
+    };
+
+    for (auto index = block.begin; index < block.end; ++index) {
+      auto &line = instructions[index];
+      if (line.type != ASMLine::Type::Instruction) { continue; }
+
+      const auto effects       = effects_of(line, virtual_registers);
+      const bool flags_are_dead = (liveness.live_after(index) & (Registers::N | Registers::Z)) == 0;
+      const bool trackable      = is_immediate(line.op) || virtual_registers.of(line.op) != 0;
+
+      // sets `target` to `value`, unless it already holds it
+      const auto copy = [&](std::optional<Operand> &target, const std::optional<Operand> &value) {
+        if (value && target == value && flags_are_dead) {
+          line.remove("register already holds the value");
+          removed.push_back(index);
+          return;
         }
+        target = value;
+      };
+
+      const auto store = [&](const std::optional<Operand> &source) -> std::optional<Operand> {
+        if (virtual_registers.of(line.op) == 0) { return source; }
+        forget(virtual_registers.of(line.op));
+        return line.op;
+      };
+
+      switch (line.opcode) {
+      case lda: copy(contents[0], trackable ? std::optional{ line.op } : std::nullopt); break;
+      case ldx: copy(contents[1], trackable ? std::optional{ line.op } : std::nullopt); break;
+      case ldy: copy(contents[2], trackable ? std::optional{ line.op } : std::nullopt); break;
+      case tax: copy(contents[1], contents[0]); break;
+      case tay: copy(contents[2], contents[0]); break;
+      case txa: copy(contents[0], contents[1]); break;
+      case tya: copy(contents[0], contents[2]); break;
+      case sta: contents[0] = store(contents[0]); break;
+      case stx: contents[1] = store(contents[1]); break;
+      case sty: contents[2] = store(contents[2]); break;
+      default:
+        if ((effects.defines & Registers::A) != 0) { contents[0].reset(); }
+        if ((effects.defines & Registers::X) != 0) { contents[1].reset(); }
+        if ((effects.defines & Registers::Y) != 0) { contents[2].reset(); }
+        forget(effects.defines);
+        break;
+      }
+
+      // a call, or a store through a pointer, may change any of the virtual registers
+      if (line.opcode == jsr || line.opcode == unknown || line.op.mode == Operand::AddressingMode::indirect_y) {
+        forget(Registers::virtual_registers);
+      }
+    }
+  }
+
+  return removed;
+}
+
+// A 16 bit flag fix-up only leaves a different Z and A behind: its N is the N of the high byte it started with, C and V
+// are untouched, and A is the high byte without it. The known register contents pass can leave an AVR register in A
+// for a later instruction, so liveness has to show both Z and A unread before they are set again. Removing one fix-up
+// can make the Z of the one before it dead, so this runs until it is stable.
+static int optimize_unused_flag_fixups(std::vector<mos6502> &instructions, const VirtualRegisters &virtual_registers)
+{
+  int rewrites = 0;
+  for (bool removed_any = true; removed_any;) {
+    removed_any = false;
+
+    const ControlFlowGraph cfg(instructions);
+    const Liveness         liveness(instructions, cfg, virtual_registers);
+
+    for (std::size_t begin = 0; begin < instructions.size();) {
+      const auto fixup = instructions[begin].flag_fixup;
+      auto       end   = begin + 1;
+      if (fixup == 0 || instructions[begin].is_removed()) {
+        begin = end;
+        continue;
+      }
+
+      while (end < instructions.size() && instructions[end].flag_fixup == fixup) { ++end; }
+
+      if ((liveness.live_after(end - 1) & (Registers::Z | Registers::A)) == 0) {
+        for (auto line = begin; line < end; ++line) { instructions[line].remove("unused flag fix-up"); }
+        ++rewrites;
+        removed_any = true;
+      }
+      begin = end;
+    }
+  }
+
+  return rewrites;
+}
+
+// The notes about what the optimizer removed, only collected for `--annotate`
+struct Annotations
+{
+  bool                     enabled = false;
+  std::vector<std::string> notes;
+};
+
+// Drops the tombstones the passes left behind. The notes about them are attached to the line that followed them.
+static void drop_removed_lines(std::vector<mos6502> &instructions, Annotations &annotations)
+{
+  std::string pending;
+  auto        kept = instructions.begin();
+
+  for (auto &line : instructions) {
+    if (line.is_removed()) {
+      if (annotations.enabled) {
+        if (!pending.empty()) { pending += '\n'; }
+        pending += line.removal_note();
       }
+      continue;
     }
+
+    if (!pending.empty()) {
+      annotations.notes.push_back(std::move(pending));
+      line.annotation = static_cast<std::uint32_t>(annotations.notes.size());
+      pending.clear();
+    }
+    if (&*kept != &line) { *kept = std::move(line); }
+    ++kept;
+  }
+
+  instructions.erase(kept, instructions.end());
+
+  if (!pending.empty()) {
+    annotations.notes.push_back(std::move(pending));
+    instructions.emplace_back(ASMLine::Type::Directive, "; end of program").annotation =
+      static_cast<std::uint32_t>(annotations.notes.size());
   }
+}
+
+struct OptimizerStatistics
+{
+  int rewrites = 0;
+  // how many times a block was swept by the peephole passes
+  int block_sweeps = 0;
+  // how many times the whole program was searched for dead code
+  int liveness_passes = 0;
+};
+
+// Every pass applies all of the rewrites it finds in one sweep of a block. A block that was rewritten goes back on
+// the worklist, because one rewrite can expose another, the blocks nobody touched are done after their first sweep.
+OptimizerStatistics optimize(std::vector<mos6502> &instructions, const Personality &personality, Annotations &annotations)
+{
+  OptimizerStatistics    statistics;
+  const VirtualRegisters virtual_registers(personality);
 
   // replace use of __zero_reg__ with literal 0
   for (auto &op : instructions) {
     if (op.type == ASMLine::Type::Instruction && op.op.type == Operand::Type::literal
-        && op.op.value == personality.get_register(1).value && op.opcode != mos6502::OpCode::sta) {
+        && op.op == personality.get_register(1) && op.opcode != mos6502::OpCode::sta) {
       // replace use of zero reg with literal 0
       const auto old_string = op.to_string();
-      op.op.value = "#0";
+      op.op = Operand(Operand::Type::literal, "#0");
       op.comment = "replaced use of register 1 with a literal 0, because of AVR GCC __zero_reg__  ; " + old_string;
     }
   }
 
-  bool optimizer_run = false;
-  for (auto &block : get_optimizable_blocks(instructions)) {
-    const bool block_optimized = optimize_redundant_lda_after_sta(block)
-                      || optimize_dead_sta(block, personality) || optimize_dead_tax(block)
-                      || optimize_redundant_ldy(block) || optimize_redundant_lda(block, personality);
+  statistics.rewrites += optimize_unused_flag_fixups(instructions, virtual_registers);
+
+  const ControlFlowGraph cfg(instructions);
+  auto                   blocks = get_optimizable_blocks(instructions, cfg);
 
-    optimizer_run = optimizer_run || block_optimized;
+  std::vector<std::size_t> block_of_line(instructions.size(), blocks.size());
+  for (std::size_t index = 0; index < blocks.size(); ++index) {
+    const auto begin = static_cast<std::size_t>(blocks[index].data() - instructions.data());
+    std::fill_n(std::next(block_of_line.begin(), static_cast<std::ptrdiff_t>(begin)), blocks[index].size(), index);
   }
-  return optimizer_run;
+
+  std::deque<std::size_t> worklist(blocks.size());
+  std::iota(worklist.begin(), worklist.end(), std::size_t{ 0 });
+
+  // the peephole passes run to a fixed point, then the loads of values A / X / Y already hold and the dead code the
+  // liveness analysis finds across the whole program are removed, and the blocks that lost lines get another
+  // peephole sweep. The liveness is recomputed in between, a removed load can make an earlier line live again.
+  while (!worklist.empty()) {
+    while (!worklist.empty()) {
+      const auto index = worklist.front();
+      worklist.pop_front();
+
+      auto &block = blocks[index];
+      ++statistics.block_sweeps;
+
+      const int rewrites = optimize_redundant_lda_after_sta(block) + optimize_redundant_ldy(block)
+                           + optimize_redundant_lda(block, personality);
+
+      if (rewrites > 0) {
+        statistics.rewrites += rewrites;
+        worklist.push_back(index);
+      }
+    }
+
+    statistics.liveness_passes += 2;
+    auto removed = optimize_known_register_contents(
+      instructions, cfg, Liveness(instructions, cfg, virtual_registers), virtual_registers);
+    const auto dead = optimize_dead_code(instructions, Liveness(instructions, cfg, virtual_registers), virtual_registers);
+    removed.insert(removed.end(), dead.begin(), dead.end());
+    statistics.rewrites += static_cast<int>(removed.size());
+
+    std::vector<bool> queued(blocks.size(), false);
+    for (const auto index : removed) {
+      if (const auto block = block_of_line[index]; block < blocks.size() && !queued[block]) {
+        queued[block] = true;
+        worklist.push_back(block);
+      }
+    }
+  }
+
+  drop_removed_lines(instructions, annotations);
+
+  return statistics;
 }
 
 #endif// INC_6502_CPP_OPTIMIZER_HPP
@@ -1,6 +1,9 @@
 #ifndef INC_6502_CPP_PERSONALITY_HPP
 #define INC_6502_CPP_PERSONALITY_HPP
 
+#include <cstdint>
+#include <stdexcept>
+#include <string>
 #include <vector>
 #include "6502.hpp"
 
@@ -20,4 +23,12 @@ protected:
   Personality() = default;
 };
 
+// the address of the location an AVR register lives in, for code that looks at it from outside the program
+[[nodiscard]] inline std::uint16_t register_address(const Personality &personality, const int reg_num)
+{
+  const auto address = parse_number(personality.get_register(reg_num).name());
+  if (!address) { throw std::runtime_error("Register " + std::to_string(reg_num) + " is not at a fixed address"); }
+  return static_cast<std::uint16_t>(*address);
+}
+
 #endif//INC_6502_CPP_PERSONALITY_HPP
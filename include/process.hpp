@@ -0,0 +1,41 @@
+#ifndef INC_6502_CPP_PROCESS_HPP
+#define INC_6502_CPP_PROCESS_HPP
+
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#if defined(_WIN32)
+#define INC_6502_CPP_POPEN _popen
+#define INC_6502_CPP_PCLOSE _pclose
+#else
+#define INC_6502_CPP_POPEN popen
+#define INC_6502_CPP_PCLOSE pclose
+#endif
+
+// What a command writes to stdout, read from a pipe while the command is still running
+struct CommandOutput
+{
+  std::string text;
+  int         status = EXIT_FAILURE;
+};
+
+[[nodiscard]] inline CommandOutput read_command_output(const std::string &command)
+{
+  CommandOutput output;
+
+  FILE *pipe = INC_6502_CPP_POPEN(command.c_str(), "r");
+  if (pipe == nullptr) { return output; }
+
+  std::array<char, 65536> chunk{};
+  while (const auto read = std::fread(chunk.data(), 1, chunk.size(), pipe)) { output.text.append(chunk.data(), read); }
+
+  output.status = INC_6502_CPP_PCLOSE(pipe);
+  return output;
+}
+
+#undef INC_6502_CPP_POPEN
+#undef INC_6502_CPP_PCLOSE
+
+#endif// INC_6502_CPP_PROCESS_HPP
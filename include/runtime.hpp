@@ -0,0 +1,496 @@
+#ifndef INC_6502_CPP_RUNTIME_HPP
+#define INC_6502_CPP_RUNTIME_HPP
+
+#include <cctype>
+#include <fmt/format.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "6502.hpp"
+#include "personality.hpp"
+
+// The libgcc helpers avr-gcc calls for what the AVR can't do in one instruction, written for the 6502. They follow
+// the AVR calling convention: the same registers in and out, and nothing clobbered that libgcc doesn't clobber.
+//
+// In the sources below a label starts at the beginning of a line and an instruction after a tab. `rN` is the
+// virtual register AVR register N lives in.
+
+enum class MultiplyMode {
+  // quarter square tables: a * b = f(a + b) - f(|a - b|) with f(x) = x * x / 4, 1K of tables on a page boundary
+  fast,
+  // shift and add, no tables
+  compact
+};
+
+// which of the helpers the AVR code calls
+struct RuntimeNeeds
+{
+  bool mulqi3     = false;
+  bool mulhi3     = false;
+  bool udivmodqi4 = false;
+  bool divmodqi4  = false;
+  bool udivmodhi4 = false;
+  bool divmodhi4  = false;
+
+  RuntimeNeeds &operator|=(const RuntimeNeeds &other)
+  {
+    mulqi3     = mulqi3 || other.mulqi3;
+    mulhi3     = mulhi3 || other.mulhi3;
+    udivmodqi4 = udivmodqi4 || other.udivmodqi4;
+    divmodqi4  = divmodqi4 || other.divmodqi4;
+    udivmodhi4 = udivmodhi4 || other.udivmodhi4;
+    divmodhi4  = divmodhi4 || other.divmodhi4;
+    return *this;
+  }
+};
+
+[[nodiscard]] inline RuntimeNeeds runtime_needs(const std::string_view avr_source)
+{
+  // whole symbols only, `__divmodqi4` is a part of `__udivmodqi4`
+  const auto in_symbol = [](const char c) { return std::isalnum(static_cast<unsigned char>(c)) != 0 || c == '_'; };
+  const auto calls     = [&](const std::string_view helper) {
+    for (auto at = avr_source.find(helper); at != std::string_view::npos; at = avr_source.find(helper, at + 1)) {
+      const auto end = at + helper.size();
+      if ((at == 0 || !in_symbol(avr_source[at - 1])) && (end == avr_source.size() || !in_symbol(avr_source[end]))) {
+        return true;
+      }
+    }
+    return false;
+  };
+  return { calls("__mulqi3"),
+    calls("__mulhi3"),
+    calls("__udivmodqi4"),
+    calls("__divmodqi4"),
+    calls("__udivmodhi4"),
+    calls("__divmodhi4") };
+}
+
+// R24 = R24 * R22, the low byte of f(a + b) - f(|a - b|) is all an 8 bit product needs
+constexpr std::string_view fast_mulqi3 = R"(
+__mulqi3
+	lda r24
+	sec
+	sbc r22
+	bcs __mulqi3_positive
+	eor #$FF
+	adc #1
+__mulqi3_positive
+	tax
+	lda #>__square_lo
+	sta r1
+	lda r24
+	sta r0
+	ldy r22
+	lda (r0), Y
+	sta r24
+	lda #0
+	sta r0
+	txa
+	tay
+	lda r24
+	sec
+	sbc (r0), Y
+	sta r24
+	lda #0
+	sta r1
+	rts
+)";
+
+// R25:R24 = R25:R24 * R23:R22, clobbers R0, R21, R23. The high byte is the high byte of aL * bL plus the low bytes
+// of aH * bL and aL * bH. R1:R0 is the pointer into the tables, R1 is __zero_reg__ again when this returns.
+constexpr std::string_view fast_mulhi3 = R"(
+__mulhi3
+	lda #>__square_lo
+	sta r1
+	lda r25
+	sec
+	sbc r22
+	bcs __mulhi3_high_low
+	eor #$FF
+	adc #1
+__mulhi3_high_low
+	tax
+	lda r25
+	sta r0
+	ldy r22
+	lda (r0), Y
+	sta r21
+	lda #0
+	sta r0
+	txa
+	tay
+	lda r21
+	sec
+	sbc (r0), Y
+	sta r21
+	lda r24
+	sec
+	sbc r23
+	bcs __mulhi3_low_high
+	eor #$FF
+	adc #1
+__mulhi3_low_high
+	tax
+	lda r24
+	sta r0
+	ldy r23
+	lda (r0), Y
+	sta r23
+	lda #0
+	sta r0
+	txa
+	tay
+	lda r23
+	sec
+	sbc (r0), Y
+	clc
+	adc r21
+	sta r21
+	lda r24
+	sec
+	sbc r22
+	bcs __mulhi3_low_low
+	eor #$FF
+	adc #1
+__mulhi3_low_low
+	tax
+	lda r24
+	sta r0
+	ldy r22
+	lda (r0), Y
+	sta r23
+	lda #>__square_hi
+	sta r1
+	lda (r0), Y
+	sta r25
+	lda #0
+	sta r0
+	txa
+	tay
+	lda (r0), Y
+	tax
+	lda #>__square_lo
+	sta r1
+	lda r23
+	sec
+	sbc (r0), Y
+	sta r24
+	stx r23
+	lda r25
+	sbc r23
+	clc
+	adc r21
+	sta r25
+	lda #0
+	sta r1
+	rts
+)";
+
+constexpr std::string_view compact_mulqi3 = R"(
+__mulqi3
+	lda #0
+	beq __mulqi3_next
+__mulqi3_add
+	clc
+	adc r22
+__mulqi3_shift
+	asl r22
+__mulqi3_next
+	lsr r24
+	bcs __mulqi3_add
+	bne __mulqi3_shift
+	sta r24
+	rts
+)";
+
+// clobbers R0, R21, R22, R23
+constexpr std::string_view compact_mulhi3 = R"(
+__mulhi3
+	lda #0
+	sta r0
+	sta r21
+__mulhi3_next
+	lda r24
+	ora r25
+	beq __mulhi3_done
+	lsr r25
+	ror r24
+	bcc __mulhi3_shift
+	clc
+	lda r0
+	adc r22
+	sta r0
+	lda r21
+	adc r23
+	sta r21
+__mulhi3_shift
+	asl r22
+	rol r23
+	jmp __mulhi3_next
+__mulhi3_done
+	lda r0
+	sta r24
+	lda r21
+	sta r25
+	rts
+)";
+
+// R24 = R24 / R22, R25 = R24 % R22. Shift and subtract with the remainder in A, the quotient bits go into R24 as the
+// dividend bits come out of it. A remainder that carries out of A is bigger than any divisor. Dividing by 0 gives
+// $FF and the dividend, like libgcc.
+constexpr std::string_view udivmodqi4 = R"(
+__udivmodqi4
+	lda #0
+	ldx #8
+	asl r24
+__udivmodqi4_loop
+	rol
+	bcs __udivmodqi4_overflow
+	cmp r22
+	bcc __udivmodqi4_next
+	sbc r22
+__udivmodqi4_next
+	rol r24
+	dex
+	bne __udivmodqi4_loop
+	sta r25
+	rts
+__udivmodqi4_overflow
+	sbc r22
+	sec
+	bcs __udivmodqi4_next
+)";
+
+// The signed one divides the magnitudes. The quotient is negative when the signs differ (kept in R0), the remainder
+// has the sign of the dividend (kept in R23). Clobbers R0, R22, R23.
+constexpr std::string_view divmodqi4 = R"(
+__divmodqi4
+	lda r24
+	sta r23
+	eor r22
+	sta r0
+	lda r24
+	bpl __divmodqi4_dividend
+	eor #$FF
+	clc
+	adc #1
+	sta r24
+__divmodqi4_dividend
+	lda r22
+	bpl __divmodqi4_divisor
+	eor #$FF
+	clc
+	adc #1
+	sta r22
+__divmodqi4_divisor
+	jsr __udivmodqi4
+	lda r23
+	bpl __divmodqi4_remainder
+	lda #0
+	sec
+	sbc r25
+	sta r25
+__divmodqi4_remainder
+	lda r0
+	bpl __divmodqi4_done
+	lda #0
+	sec
+	sbc r24
+	sta r24
+__divmodqi4_done
+	rts
+)";
+
+// R23:R22 = R25:R24 / R23:R22, R25:R24 = R25:R24 % R23:R22, clobbers R26, R27. The same loop as the 8 bit one with
+// the remainder in R27:R26, a trial subtraction is kept when it doesn't borrow.
+constexpr std::string_view udivmodhi4 = R"(
+__udivmodhi4
+	lda #0
+	sta r26
+	sta r27
+	ldx #16
+	asl r24
+	rol r25
+__udivmodhi4_loop
+	rol r26
+	rol r27
+	bcs __udivmodhi4_overflow
+	lda r26
+	sec
+	sbc r22
+	tay
+	lda r27
+	sbc r23
+	bcc __udivmodhi4_next
+__udivmodhi4_subtract
+	sty r26
+	sta r27
+__udivmodhi4_next
+	rol r24
+	rol r25
+	dex
+	bne __udivmodhi4_loop
+	lda r24
+	sta r22
+	lda r25
+	sta r23
+	lda r26
+	sta r24
+	lda r27
+	sta r25
+	rts
+__udivmodhi4_overflow
+	lda r26
+	sbc r22
+	tay
+	lda r27
+	sbc r23
+	sec
+	bcs __udivmodhi4_subtract
+)";
+
+// Signs like __divmodqi4, the quotient's in R0 and the remainder's in R21. Clobbers R0, R21, R26, R27.
+constexpr std::string_view divmodhi4 = R"(
+__divmodhi4
+	lda r25
+	sta r21
+	eor r23
+	sta r0
+	lda r25
+	bpl __divmodhi4_dividend
+	lda #0
+	sec
+	sbc r24
+	sta r24
+	lda #0
+	sbc r25
+	sta r25
+__divmodhi4_dividend
+	lda r23
+	bpl __divmodhi4_divisor
+	lda #0
+	sec
+	sbc r22
+	sta r22
+	lda #0
+	sbc r23
+	sta r23
+__divmodhi4_divisor
+	jsr __udivmodhi4
+	lda r21
+	bpl __divmodhi4_remainder
+	lda #0
+	sec
+	sbc r24
+	sta r24
+	lda #0
+	sbc r25
+	sta r25
+__divmodhi4_remainder
+	lda r0
+	bpl __divmodhi4_done
+	lda #0
+	sec
+	sbc r22
+	sta r22
+	lda #0
+	sbc r23
+	sta r23
+__divmodhi4_done
+	rts
+)";
+
+// puts the virtual register in for every `rN` in an operand
+[[nodiscard]] inline std::string with_registers(const Personality &personality, const std::string_view operand)
+{
+  const auto is_word = [](const char c) { return std::isalnum(static_cast<unsigned char>(c)) != 0 || c == '_'; };
+
+  std::string result;
+  for (std::size_t index = 0; index < operand.size();) {
+    auto end = index + 1;
+    while (end < operand.size() && std::isdigit(static_cast<unsigned char>(operand[end])) != 0) { ++end; }
+
+    const bool is_register = operand[index] == 'r' && end > index + 1 && (index == 0 || !is_word(operand[index - 1]))
+                             && (end == operand.size() || !is_word(operand[end]));
+    if (is_register) {
+      int reg_num = 0;
+      for (const auto digit : operand.substr(index + 1, end - index - 1)) { reg_num = reg_num * 10 + (digit - '0'); }
+      result += personality.get_register(reg_num).name();
+      index = end;
+    } else {
+      result += operand[index++];
+    }
+  }
+  return result;
+}
+
+inline void append_routine(const Personality &personality,
+  const std::string_view source,
+  const std::string_view comment,
+  std::vector<mos6502> &instructions)
+{
+  const auto opcode_of = [](const std::string_view mnemonic) {
+    for (auto o = static_cast<int>(mos6502::OpCode::adc); o <= static_cast<int>(mos6502::OpCode::tya); ++o) {
+      if (mos6502::to_string(static_cast<mos6502::OpCode>(o)) == mnemonic) { return static_cast<mos6502::OpCode>(o); }
+    }
+    throw std::runtime_error(fmt::format("Unknown 6502 instruction in the runtime: '{}'", mnemonic));
+  };
+
+  auto remaining = source;
+  while (!remaining.empty()) {
+    const auto end_of_line = remaining.find('\n');
+    const auto line        = remaining.substr(0, end_of_line);
+    remaining.remove_prefix(end_of_line == std::string_view::npos ? remaining.size() : end_of_line + 1);
+
+    if (line.empty()) { continue; }
+    if (line.front() != '\t') {
+      instructions.emplace_back(ASMLine::Type::Label, std::string{ line }).comment = comment;
+      continue;
+    }
+
+    const auto text     = line.substr(1);
+    const auto space    = text.find(' ');
+    const auto mnemonic = text.substr(0, space);
+    const auto opcode   = opcode_of(mnemonic);
+    if (space == std::string_view::npos) {
+      instructions.emplace_back(opcode).comment = comment;
+    } else {
+      const Operand operand(Operand::Type::literal, with_registers(personality, text.substr(space + 1)));
+      instructions.emplace_back(opcode, operand).comment = comment;
+    }
+  }
+}
+
+// f(x) = x * x / 4 for x up to 510, the low bytes for all of them first and then the high bytes
+inline void append_square_tables(std::vector<mos6502> &instructions)
+{
+  instructions.emplace_back(ASMLine::Type::Directive, ".align 256").comment = "quarter square tables";
+  for (const auto shift : { 0, 8 }) {
+    instructions.emplace_back(ASMLine::Type::Label, shift == 0 ? "__square_lo" : "__square_hi");
+    for (int row = 0; row < 512; row += 32) {
+      std::vector<int> bytes;
+      for (int x = row; x < row + 32; ++x) { bytes.push_back(((x * x / 4) >> shift) & 0xFF); }
+      instructions.emplace_back(ASMLine::Type::Directive, fmt::format(".byt {}", fmt::join(bytes, ",")));
+    }
+  }
+}
+
+inline void append_runtime(const Personality &personality,
+  const RuntimeNeeds &needs,
+  const MultiplyMode multiply,
+  std::vector<mos6502> &instructions)
+{
+  const bool fast = multiply == MultiplyMode::fast;
+  if (needs.mulqi3) { append_routine(personality, fast ? fast_mulqi3 : compact_mulqi3, "__mulqi3", instructions); }
+  if (needs.mulhi3) { append_routine(personality, fast ? fast_mulhi3 : compact_mulhi3, "__mulhi3", instructions); }
+  // the signed helpers call the unsigned ones
+  if (needs.divmodqi4) { append_routine(personality, divmodqi4, "__divmodqi4", instructions); }
+  if (needs.udivmodqi4 || needs.divmodqi4) { append_routine(personality, udivmodqi4, "__udivmodqi4", instructions); }
+  if (needs.divmodhi4) { append_routine(personality, divmodhi4, "__divmodhi4", instructions); }
+  if (needs.udivmodhi4 || needs.divmodhi4) { append_routine(personality, udivmodhi4, "__udivmodhi4", instructions); }
+  if (fast && (needs.mulqi3 || needs.mulhi3)) { append_square_tables(instructions); }
+}
+
+#endif// INC_6502_CPP_RUNTIME_HPP
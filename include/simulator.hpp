@@ -0,0 +1,535 @@
+#ifndef INC_6502_CPP_SIMULATOR_HPP
+#define INC_6502_CPP_SIMULATOR_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <fmt/format.h>
+#include <iterator>
+#include <span>
+#include <stdexcept>
+
+// A cycle counting NMOS 6502 with 64k of RAM, enough to run the translated programs without an emulator.
+// All of the documented instructions are implemented, including decimal mode, the undocumented ones and BRK
+// stop the simulation with an exception.
+class Simulator
+{
+public:
+  enum class Op : std::uint8_t {
+    illegal,
+    adc, AND, asl, bcc, bcs, beq, bit, bmi, bne, bpl, brk, bvc, bvs, clc, cld, cli, clv, cmp, cpx, cpy, dec, dex, dey,
+    eor, inc, inx, iny, jmp, jsr, lda, ldx, ldy, lsr, nop, ORA, pha, php, pla, plp, rol, ror, rti, rts, sbc, sec, sed,
+    sei, sta, stx, sty, tax, tay, tsx, txa, txs, tya
+  };
+
+  enum class Mode : std::uint8_t {
+    implied,
+    accumulator,
+    immediate,
+    zero_page,
+    zero_page_x,
+    zero_page_y,
+    absolute,
+    absolute_x,
+    absolute_y,
+    indirect_x,
+    indirect_y,
+    indirect,
+    relative
+  };
+
+  struct Instruction
+  {
+    Op           op     = Op::illegal;
+    Mode         mode   = Mode::implied;
+    std::uint8_t cycles = 0;
+    // one more cycle when the indexed address is in another page than the base address
+    bool page_penalty = false;
+  };
+
+  static constexpr std::uint8_t carry     = 0x01;
+  static constexpr std::uint8_t zero      = 0x02;
+  static constexpr std::uint8_t interrupt = 0x04;
+  static constexpr std::uint8_t decimal   = 0x08;
+  static constexpr std::uint8_t brk_flag  = 0x10;
+  static constexpr std::uint8_t unused    = 0x20;
+  static constexpr std::uint8_t overflow  = 0x40;
+  static constexpr std::uint8_t negative  = 0x80;
+
+  // what every opcode does, how it addresses its operand and how many cycles it takes
+  [[nodiscard]] static constexpr std::array<Instruction, 256> instruction_table()
+  {
+    std::array<Instruction, 256> table{};
+
+    // the `aaabbb01` group, where the low bits of the opcode pick the addressing mode
+    const auto group_one = [&](const std::uint8_t base, const Op op) {
+      const bool store   = op == Op::sta;
+      table[base + 0x01] = { op, Mode::indirect_x, 6, false };
+      table[base + 0x05] = { op, Mode::zero_page, 3, false };
+      if (!store) { table[base + 0x09] = { op, Mode::immediate, 2, false }; }
+      table[base + 0x0D] = { op, Mode::absolute, 4, false };
+      table[base + 0x11] = { op, Mode::indirect_y, static_cast<std::uint8_t>(store ? 6 : 5), !store };
+      table[base + 0x15] = { op, Mode::zero_page_x, 4, false };
+      table[base + 0x19] = { op, Mode::absolute_y, static_cast<std::uint8_t>(store ? 5 : 4), !store };
+      table[base + 0x1D] = { op, Mode::absolute_x, static_cast<std::uint8_t>(store ? 5 : 4), !store };
+    };
+    group_one(0x00, Op::ORA);
+    group_one(0x20, Op::AND);
+    group_one(0x40, Op::eor);
+    group_one(0x60, Op::adc);
+    group_one(0x80, Op::sta);
+    group_one(0xA0, Op::lda);
+    group_one(0xC0, Op::cmp);
+    group_one(0xE0, Op::sbc);
+
+    // read-modify-write instructions
+    const auto modify = [&](const std::uint8_t base, const Op op, const bool has_accumulator) {
+      if (has_accumulator) { table[base + 0x0A] = { op, Mode::accumulator, 2, false }; }
+      table[base + 0x06] = { op, Mode::zero_page, 5, false };
+      table[base + 0x16] = { op, Mode::zero_page_x, 6, false };
+      table[base + 0x0E] = { op, Mode::absolute, 6, false };
+      table[base + 0x1E] = { op, Mode::absolute_x, 7, false };
+    };
+    modify(0x00, Op::asl, true);
+    modify(0x20, Op::rol, true);
+    modify(0x40, Op::lsr, true);
+    modify(0x60, Op::ror, true);
+    modify(0xC0, Op::dec, false);
+    modify(0xE0, Op::inc, false);
+
+    const auto branch = [&](const std::uint8_t code, const Op op) { table[code] = { op, Mode::relative, 2, false }; };
+    branch(0x10, Op::bpl);
+    branch(0x30, Op::bmi);
+    branch(0x50, Op::bvc);
+    branch(0x70, Op::bvs);
+    branch(0x90, Op::bcc);
+    branch(0xB0, Op::bcs);
+    branch(0xD0, Op::bne);
+    branch(0xF0, Op::beq);
+
+    const auto implied = [&](const std::uint8_t code, const Op op, const std::uint8_t cycles = 2) {
+      table[code] = { op, Mode::implied, cycles, false };
+    };
+    implied(0x00, Op::brk, 7);
+    implied(0x08, Op::php, 3);
+    implied(0x18, Op::clc);
+    implied(0x28, Op::plp, 4);
+    implied(0x38, Op::sec);
+    implied(0x40, Op::rti, 6);
+    implied(0x48, Op::pha, 3);
+    implied(0x58, Op::cli);
+    implied(0x60, Op::rts, 6);
+    implied(0x68, Op::pla, 4);
+    implied(0x78, Op::sei);
+    implied(0x88, Op::dey);
+    implied(0x8A, Op::txa);
+    implied(0x98, Op::tya);
+    implied(0x9A, Op::txs);
+    implied(0xA8, Op::tay);
+    implied(0xAA, Op::tax);
+    implied(0xB8, Op::clv);
+    implied(0xBA, Op::tsx);
+    implied(0xC8, Op::iny);
+    implied(0xCA, Op::dex);
+    implied(0xD8, Op::cld);
+    implied(0xE8, Op::inx);
+    implied(0xEA, Op::nop);
+    implied(0xF8, Op::sed);
+
+    table[0x20] = { Op::jsr, Mode::absolute, 6, false };
+    table[0x4C] = { Op::jmp, Mode::absolute, 3, false };
+    table[0x6C] = { Op::jmp, Mode::indirect, 5, false };
+    table[0x24] = { Op::bit, Mode::zero_page, 3, false };
+    table[0x2C] = { Op::bit, Mode::absolute, 4, false };
+
+    table[0x84] = { Op::sty, Mode::zero_page, 3, false };
+    table[0x94] = { Op::sty, Mode::zero_page_x, 4, false };
+    table[0x8C] = { Op::sty, Mode::absolute, 4, false };
+    table[0x86] = { Op::stx, Mode::zero_page, 3, false };
+    table[0x96] = { Op::stx, Mode::zero_page_y, 4, false };
+    table[0x8E] = { Op::stx, Mode::absolute, 4, false };
+
+    table[0xA0] = { Op::ldy, Mode::immediate, 2, false };
+    table[0xA4] = { Op::ldy, Mode::zero_page, 3, false };
+    table[0xB4] = { Op::ldy, Mode::zero_page_x, 4, false };
+    table[0xAC] = { Op::ldy, Mode::absolute, 4, false };
+    table[0xBC] = { Op::ldy, Mode::absolute_x, 4, true };
+    table[0xA2] = { Op::ldx, Mode::immediate, 2, false };
+    table[0xA6] = { Op::ldx, Mode::zero_page, 3, false };
+    table[0xB6] = { Op::ldx, Mode::zero_page_y, 4, false };
+    table[0xAE] = { Op::ldx, Mode::absolute, 4, false };
+    table[0xBE] = { Op::ldx, Mode::absolute_y, 4, true };
+
+    table[0xC0] = { Op::cpy, Mode::immediate, 2, false };
+    table[0xC4] = { Op::cpy, Mode::zero_page, 3, false };
+    table[0xCC] = { Op::cpy, Mode::absolute, 4, false };
+    table[0xE0] = { Op::cpx, Mode::immediate, 2, false };
+    table[0xE4] = { Op::cpx, Mode::zero_page, 3, false };
+    table[0xEC] = { Op::cpx, Mode::absolute, 4, false };
+
+    return table;
+  }
+
+  std::array<std::uint8_t, 0x10000> memory{};
+
+  std::uint16_t pc = 0;
+  std::uint8_t  a  = 0;
+  std::uint8_t  x  = 0;
+  std::uint8_t  y  = 0;
+  std::uint8_t  s  = 0xFF;
+  std::uint8_t  p  = unused | interrupt;
+
+  std::uint64_t cycles = 0;
+
+  // copies a PRG into memory, the first two bytes are its load address, which is returned
+  std::uint16_t load_prg(const std::span<const std::uint8_t> prg)
+  {
+    if (prg.size() < 2) { throw std::runtime_error("PRG file is too short to hold its load address"); }
+
+    const auto load_address = static_cast<std::uint16_t>(prg[0] | (prg[1] << 8u));
+    if (load_address + prg.size() - 2 > memory.size()) { throw std::runtime_error("PRG file does not fit in memory"); }
+
+    std::copy(std::next(prg.begin(), 2), prg.end(), std::next(memory.begin(), load_address));
+    return load_address;
+  }
+
+  // runs the subroutine at `address` the way a jsr to it would, until it returns. Returns false if it is still
+  // running when `cycle_limit` cycles have been used up.
+  bool call(const std::uint16_t address, const std::uint64_t cycle_limit)
+  {
+    // rts returns to the address after the one on the stack, so returning lands on `returned`
+    constexpr std::uint16_t returned = 0x0000;
+    constexpr std::uint16_t pushed   = 0xFFFF;
+    push(static_cast<std::uint8_t>(pushed >> 8u));
+    push(static_cast<std::uint8_t>(pushed & 0xFFu));
+    pc = address;
+
+    while (pc != returned) {
+      if (cycles >= cycle_limit) { return false; }
+      step();
+    }
+    return true;
+  }
+
+  [[nodiscard]] std::span<const std::uint8_t> ram(const std::uint16_t begin, const std::uint16_t end) const
+  {
+    return std::span{ memory }.subspan(begin, static_cast<std::size_t>(end - begin) + 1);
+  }
+
+  void step()
+  {
+    static constexpr auto instructions = instruction_table();
+
+    const auto  address     = pc;
+    const auto  opcode      = read(pc++);
+    const auto &instruction = instructions[opcode];
+
+    if (instruction.op == Op::illegal) {
+      throw std::runtime_error(fmt::format("Illegal opcode ${:02x} at ${:04x}", opcode, address));
+    }
+    if (instruction.op == Op::brk) { throw std::runtime_error(fmt::format("BRK at ${:04x}", address)); }
+
+    cycles += instruction.cycles;
+    execute(instruction);
+  }
+
+private:
+  [[nodiscard]] std::uint8_t read(const std::uint16_t address) const { return memory[address]; }
+  void write(const std::uint16_t address, const std::uint8_t value) { memory[address] = value; }
+
+  [[nodiscard]] std::uint16_t read_word(const std::uint16_t address) const
+  {
+    return static_cast<std::uint16_t>(read(address) | (read(static_cast<std::uint16_t>(address + 1)) << 8u));
+  }
+
+  // the pointer of (zp,X) and (zp),Y wraps around inside of the zero page
+  [[nodiscard]] std::uint16_t read_zero_page_word(const std::uint8_t address) const
+  {
+    return static_cast<std::uint16_t>(read(address) | (read(static_cast<std::uint8_t>(address + 1)) << 8u));
+  }
+
+  void push(const std::uint8_t value) { write(static_cast<std::uint16_t>(0x0100 | s--), value); }
+  [[nodiscard]] std::uint8_t pull() { return read(static_cast<std::uint16_t>(0x0100 | ++s)); }
+
+  void set_flag(const std::uint8_t flag, const bool value)
+  {
+    p = static_cast<std::uint8_t>(value ? (p | flag) : (p & ~flag));
+  }
+
+  void set_n_z(const std::uint8_t value)
+  {
+    set_flag(zero, value == 0);
+    set_flag(negative, (value & 0x80u) != 0);
+  }
+
+  [[nodiscard]] std::uint16_t effective_address(const Instruction &instruction)
+  {
+    const auto indexed = [&](const std::uint16_t base, const std::uint8_t index) {
+      const auto result = static_cast<std::uint16_t>(base + index);
+      if (instruction.page_penalty && (result & 0xFF00u) != (base & 0xFF00u)) { ++cycles; }
+      return result;
+    };
+
+    switch (instruction.mode) {
+    case Mode::immediate: return pc++;
+    case Mode::zero_page: return read(pc++);
+    case Mode::zero_page_x: return static_cast<std::uint8_t>(read(pc++) + x);
+    case Mode::zero_page_y: return static_cast<std::uint8_t>(read(pc++) + y);
+    case Mode::absolute: {
+      const auto result = read_word(pc);
+      pc += 2;
+      return result;
+    }
+    case Mode::absolute_x: {
+      const auto base = read_word(pc);
+      pc += 2;
+      return indexed(base, x);
+    }
+    case Mode::absolute_y: {
+      const auto base = read_word(pc);
+      pc += 2;
+      return indexed(base, y);
+    }
+    case Mode::indirect_x: return read_zero_page_word(static_cast<std::uint8_t>(read(pc++) + x));
+    case Mode::indirect_y: return indexed(read_zero_page_word(read(pc++)), y);
+    case Mode::indirect: {
+      // the NMOS 6502 never carries into the high byte of the pointer
+      const auto pointer = read_word(pc);
+      pc += 2;
+      const auto high = static_cast<std::uint16_t>((pointer & 0xFF00u) | ((pointer + 1) & 0x00FFu));
+      return static_cast<std::uint16_t>(read(pointer) | (read(high) << 8u));
+    }
+    case Mode::implied:
+    case Mode::accumulator:
+    case Mode::relative: break;
+    }
+
+    throw std::logic_error("instruction has no effective address");
+  }
+
+  void add(const std::uint8_t value)
+  {
+    const unsigned carry_in = p & carry;
+    const unsigned binary   = a + value + carry_in;
+
+    if ((p & decimal) == 0) {
+      set_flag(carry, binary > 0xFF);
+      set_flag(overflow, ((a ^ binary) & (value ^ binary) & 0x80u) != 0);
+      a = static_cast<std::uint8_t>(binary);
+      set_n_z(a);
+      return;
+    }
+
+    // N and V come from the result before the high digit is adjusted, Z from the binary sum
+    unsigned low = (a & 0x0Fu) + (value & 0x0Fu) + carry_in;
+    if (low >= 0x0A) { low = ((low + 0x06) & 0x0Fu) + 0x10; }
+    unsigned   sum        = (a & 0xF0u) + (value & 0xF0u) + low;
+    const auto signed_sum = static_cast<std::int8_t>(a & 0xF0u) + static_cast<std::int8_t>(value & 0xF0u)
+                            + static_cast<int>(low);
+    set_flag(negative, (sum & 0x80u) != 0);
+    set_flag(overflow, signed_sum < -128 || signed_sum > 127);
+    set_flag(zero, (binary & 0xFFu) == 0);
+    if (sum >= 0xA0) { sum += 0x60; }
+    set_flag(carry, sum > 0xFF);
+    a = static_cast<std::uint8_t>(sum);
+  }
+
+  void subtract(const std::uint8_t value)
+  {
+    if ((p & decimal) == 0) {
+      add(static_cast<std::uint8_t>(~value));
+      return;
+    }
+
+    // the flags are the ones of the binary subtraction
+    const int borrow = (p & carry) != 0 ? 0 : 1;
+    int       low    = (a & 0x0F) - (value & 0x0F) - borrow;
+    if (low < 0) { low = ((low - 0x06) & 0x0F) - 0x10; }
+    int result = (a & 0xF0) - (value & 0xF0) + low;
+    if (result < 0) { result -= 0x60; }
+
+    const auto decimal_result = static_cast<std::uint8_t>(result);
+    p                         = static_cast<std::uint8_t>(p & ~decimal);
+    add(static_cast<std::uint8_t>(~value));
+    p = static_cast<std::uint8_t>(p | decimal);
+    a = decimal_result;
+  }
+
+  void compare(const std::uint8_t reg, const std::uint8_t value)
+  {
+    set_flag(carry, reg >= value);
+    set_n_z(static_cast<std::uint8_t>(reg - value));
+  }
+
+  void branch(const bool taken)
+  {
+    const auto offset = static_cast<std::int8_t>(read(pc++));
+    if (!taken) { return; }
+
+    const auto target = static_cast<std::uint16_t>(pc + offset);
+    cycles += (target & 0xFF00u) != (pc & 0xFF00u) ? 2 : 1;
+    pc = target;
+  }
+
+  // asl, lsr, rol and ror on A or on memory
+  void shift(const Instruction &instruction)
+  {
+    const auto operation = [&](const std::uint8_t value) {
+      const unsigned carry_in = p & carry;
+      unsigned       result   = 0;
+      switch (instruction.op) {
+      case Op::asl:
+        set_flag(carry, (value & 0x80u) != 0);
+        result = value << 1u;
+        break;
+      case Op::rol:
+        set_flag(carry, (value & 0x80u) != 0);
+        result = (value << 1u) | carry_in;
+        break;
+      case Op::lsr:
+        set_flag(carry, (value & 0x01u) != 0);
+        result = value >> 1u;
+        break;
+      default:
+        set_flag(carry, (value & 0x01u) != 0);
+        result = (value >> 1u) | (carry_in << 7u);
+        break;
+      }
+      const auto byte = static_cast<std::uint8_t>(result);
+      set_n_z(byte);
+      return byte;
+    };
+
+    if (instruction.mode == Mode::accumulator) {
+      a = operation(a);
+    } else {
+      const auto address = effective_address(instruction);
+      write(address, operation(read(address)));
+    }
+  }
+
+  void execute(const Instruction &instruction)
+  {
+    const auto operand = [&] { return read(effective_address(instruction)); };
+    const auto load    = [&](std::uint8_t &reg) {
+      reg = operand();
+      set_n_z(reg);
+    };
+    const auto transfer = [&](const std::uint8_t from, std::uint8_t &to) {
+      to = from;
+      set_n_z(to);
+    };
+    const auto step_memory = [&](const int delta) {
+      const auto address = effective_address(instruction);
+      const auto value   = static_cast<std::uint8_t>(read(address) + delta);
+      write(address, value);
+      set_n_z(value);
+    };
+
+    switch (instruction.op) {
+    case Op::adc: add(operand()); break;
+    case Op::sbc: subtract(operand()); break;
+    case Op::AND: transfer(static_cast<std::uint8_t>(a & operand()), a); break;
+    case Op::ORA: transfer(static_cast<std::uint8_t>(a | operand()), a); break;
+    case Op::eor: transfer(static_cast<std::uint8_t>(a ^ operand()), a); break;
+    case Op::asl:
+    case Op::lsr:
+    case Op::rol:
+    case Op::ror: shift(instruction); break;
+    case Op::bit: {
+      const auto value = operand();
+      set_flag(zero, (a & value) == 0);
+      set_flag(negative, (value & 0x80u) != 0);
+      set_flag(overflow, (value & 0x40u) != 0);
+      break;
+    }
+    case Op::bcc: branch((p & carry) == 0); break;
+    case Op::bcs: branch((p & carry) != 0); break;
+    case Op::bne: branch((p & zero) == 0); break;
+    case Op::beq: branch((p & zero) != 0); break;
+    case Op::bpl: branch((p & negative) == 0); break;
+    case Op::bmi: branch((p & negative) != 0); break;
+    case Op::bvc: branch((p & overflow) == 0); break;
+    case Op::bvs: branch((p & overflow) != 0); break;
+    case Op::clc: set_flag(carry, false); break;
+    case Op::cld: set_flag(decimal, false); break;
+    case Op::cli: set_flag(interrupt, false); break;
+    case Op::clv: set_flag(overflow, false); break;
+    case Op::sec: set_flag(carry, true); break;
+    case Op::sed: set_flag(decimal, true); break;
+    case Op::sei: set_flag(interrupt, true); break;
+    case Op::cmp: compare(a, operand()); break;
+    case Op::cpx: compare(x, operand()); break;
+    case Op::cpy: compare(y, operand()); break;
+    case Op::dec: step_memory(-1); break;
+    case Op::inc: step_memory(1); break;
+    case Op::dex: transfer(static_cast<std::uint8_t>(x - 1), x); break;
+    case Op::dey: transfer(static_cast<std::uint8_t>(y - 1), y); break;
+    case Op::inx: transfer(static_cast<std::uint8_t>(x + 1), x); break;
+    case Op::iny: transfer(static_cast<std::uint8_t>(y + 1), y); break;
+    case Op::jmp: pc = effective_address(instruction); break;
+    case Op::jsr: {
+      const auto target = effective_address(instruction);
+      const auto back   = static_cast<std::uint16_t>(pc - 1);
+      push(static_cast<std::uint8_t>(back >> 8u));
+      push(static_cast<std::uint8_t>(back & 0xFFu));
+      pc = target;
+      break;
+    }
+    case Op::rts: {
+      const auto low  = pull();
+      const auto high = pull();
+      pc              = static_cast<std::uint16_t>((low | (high << 8u)) + 1);
+      break;
+    }
+    case Op::rti: {
+      p               = static_cast<std::uint8_t>((pull() & ~brk_flag) | unused);
+      const auto low  = pull();
+      const auto high = pull();
+      pc              = static_cast<std::uint16_t>(low | (high << 8u));
+      break;
+    }
+    case Op::lda: load(a); break;
+    case Op::ldx: load(x); break;
+    case Op::ldy: load(y); break;
+    case Op::sta: write(effective_address(instruction), a); break;
+    case Op::stx: write(effective_address(instruction), x); break;
+    case Op::sty: write(effective_address(instruction), y); break;
+    case Op::pha: push(a); break;
+    case Op::php: push(static_cast<std::uint8_t>(p | brk_flag | unused)); break;
+    case Op::pla: transfer(pull(), a); break;
+    case Op::plp: p = static_cast<std::uint8_t>((pull() & ~brk_flag) | unused); break;
+    case Op::tax: transfer(a, x); break;
+    case Op::tay: transfer(a, y); break;
+    case Op::tsx: transfer(s, x); break;
+    case Op::txa: transfer(x, a); break;
+    case Op::tya: transfer(y, a); break;
+    case Op::txs: s = x; break;
+    case Op::nop: break;
+    case Op::brk:
+    case Op::illegal: break;
+    }
+  }
+};
+
+// Loads a PRG built for the C64 and runs it the way `RUN` would: the SYS address is read from the BASIC stub at
+// $0801. The KERNAL is only there as far as every call into it returns right away.
+inline bool run_c64_prg(Simulator &simulator, const std::span<const std::uint8_t> prg, const std::uint64_t cycle_limit)
+{
+  std::fill(std::next(simulator.memory.begin(), 0xE000), simulator.memory.end(), std::uint8_t{ 0x60 });// rts
+
+  if (simulator.load_prg(prg) != 0x0801) { throw std::runtime_error("C64 PRG does not start at the BASIC area"); }
+
+  // link to the next line (2 bytes), line number (2 bytes), SYS token, then the address in decimal digits
+  std::uint16_t address = 0x0805;
+  if (simulator.memory[address++] != 0x9E) { throw std::runtime_error("BASIC stub does not start with SYS"); }
+
+  unsigned sys_address = 0;
+  for (; simulator.memory[address] >= '0' && simulator.memory[address] <= '9'; ++address) {
+    sys_address = sys_address * 10 + (simulator.memory[address] - '0');
+  }
+
+  return simulator.call(static_cast<std::uint16_t>(sys_address), cycle_limit);
+}
+
+#endif// INC_6502_CPP_SIMULATOR_HPP
@@ -0,0 +1,56 @@
+#ifndef INC_6502_CPP_SYMBOL_TABLE_HPP
+#define INC_6502_CPP_SYMBOL_TABLE_HPP
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+using SymbolId = std::uint32_t;
+
+// Interns label and operand text, so that it can be compared and looked up as a 32 bit id.
+// Interned text is never moved or released, views of it stay valid for the life of the table.
+class SymbolTable
+{
+public:
+  // the id of the empty string
+  static constexpr SymbolId none = 0;
+
+  [[nodiscard]] SymbolId intern(const std::string_view text)
+  {
+    {
+      std::shared_lock lock(mutex);
+      if (const auto existing = ids.find(text); existing != ids.end()) { return existing->second; }
+    }
+
+    std::unique_lock lock(mutex);
+    if (const auto existing = ids.find(text); existing != ids.end()) { return existing->second; }
+
+    const auto id = static_cast<SymbolId>(names.size());
+    ids.emplace(names.emplace_back(text), id);
+    return id;
+  }
+
+  [[nodiscard]] std::string_view name(const SymbolId id) const
+  {
+    std::shared_lock lock(mutex);
+    return names[id];
+  }
+
+private:
+  mutable std::shared_mutex                      mutex;
+  std::deque<std::string>                        names{ std::string{} };
+  std::unordered_map<std::string_view, SymbolId> ids{ { names.front(), none } };
+};
+
+// the table shared by everything that is translated in this process
+inline SymbolTable &symbols()
+{
+  static SymbolTable table;
+  return table;
+}
+
+#endif// INC_6502_CPP_SYMBOL_TABLE_HPP
@@ -0,0 +1,41 @@
+#ifndef INC_6502_CPP_THREAD_POOL_HPP
+#define INC_6502_CPP_THREAD_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs `job(index)` for every index below `count` on up to `threads` threads. A thread that is done with one job
+// takes the next one that nobody started yet, so one slow translation unit doesn't hold the others up. The first
+// exception a job throws is rethrown once all of the threads are done.
+template<typename Job> void parallel_for(const std::size_t count, const std::size_t threads, Job &&job)
+{
+  std::atomic<std::size_t> next{ 0 };
+  std::exception_ptr       failure;
+  std::mutex               failure_mutex;
+
+  const auto work = [&] {
+    for (auto index = next++; index < count; index = next++) {
+      try {
+        job(index);
+      } catch (...) {
+        const std::lock_guard lock(failure_mutex);
+        if (!failure) { failure = std::current_exception(); }
+      }
+    }
+  };
+
+  {
+    std::vector<std::jthread> workers;
+    for (std::size_t thread = 1; thread < std::min(threads, count); ++thread) { workers.emplace_back(work); }
+    work();
+  }
+
+  if (failure) { std::rethrow_exception(failure); }
+}
+
+#endif// INC_6502_CPP_THREAD_POOL_HPP
@@ -0,0 +1,126 @@
+#ifndef INC_6502_CPP_TRANSLATION_CACHE_HPP
+#define INC_6502_CPP_TRANSLATION_CACHE_HPP
+
+#include <cstdint>
+#include <filesystem>
+#include <fmt/format.h>
+#include <fstream>
+#include <functional>
+#include <optional>
+#include <random>
+#include <spdlog/spdlog.h>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "mapped_file.hpp"
+
+// Translations that were done before, stored under the hash of everything that goes into one: the avr-gcc output,
+// the target, the translator options and the build of the translator itself.
+class TranslationCache
+{
+public:
+  struct Entry
+  {
+    std::string               assembly;
+    std::vector<std::uint8_t> program;
+    // how long the translation took when it was stored, which is what a hit saves
+    double translate_ms = 0;
+  };
+
+  explicit TranslationCache(std::filesystem::path cache_directory)
+    : directory(std::move(cache_directory)), process(std::random_device{}())
+  {
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    if (error) { spdlog::warn("Translation cache disabled, cannot create {}: {}", directory.string(), error.message()); }
+  }
+
+  // 64 bit FNV-1a, the inputs are hashed with a separator so that moving bytes between them changes the key
+  [[nodiscard]] static std::uint64_t key(const std::vector<std::string_view> &inputs)
+  {
+    std::uint64_t hash = 0xcbf29ce484222325;
+    const auto    add  = [&](const char c) {
+      hash ^= static_cast<std::uint8_t>(c);
+      hash *= 0x100000001b3;
+    };
+    for (const auto input : inputs) {
+      for (const auto c : input) { add(c); }
+      add('\0');
+    }
+    return hash;
+  }
+
+  [[nodiscard]] std::optional<Entry> load(const std::uint64_t key)
+  {
+    ++lookups;
+
+    std::ifstream time_file(path(key, "ms"));
+    if (!time_file) { return std::nullopt; }
+
+    const MappedFile program_file(path(key, "prg"));
+    const MappedFile assembly_file(path(key, "6502.asm"));
+    const auto       program = program_file.contents();
+    if (program.empty()) { return std::nullopt; }
+
+    Entry entry{ std::string{ assembly_file.contents() }, { program.begin(), program.end() }, 0 };
+    time_file >> entry.translate_ms;
+
+    ++hits;
+    saved_ms += entry.translate_ms;
+    return entry;
+  }
+
+  void store(const std::uint64_t key, const Entry &entry) const
+  {
+    // every file is written next to its final name and renamed, so a concurrent build never reads half an entry. The
+    // temporary is this process's and thread's own, two builds storing the same key never write into the same file.
+    const auto write = [&](const std::string_view extension, const auto &contents) {
+      const auto final_path = path(key, extension);
+      auto       temporary  = final_path;
+      temporary += fmt::format(".{:08x}.{:x}.tmp", process, std::hash<std::thread::id>{}(std::this_thread::get_id()));
+      {
+        std::ofstream file(temporary, std::ofstream::trunc | std::ofstream::binary);
+        file.write(reinterpret_cast<const char *>(contents.data()), static_cast<std::streamsize>(contents.size()));
+        if (!file) { return false; }
+      }
+      std::error_code error;
+      std::filesystem::rename(temporary, final_path, error);
+      return !error;
+    };
+
+    // the time goes last, an entry without it is never read
+    if (!write("prg", entry.program) || !write("6502.asm", entry.assembly)
+        || !write("ms", fmt::format("{:.3f}", entry.translate_ms))) {
+      spdlog::warn("Unable to store translation {:016x} in {}", key, directory.string());
+    }
+  }
+
+  void log_statistics() const
+  {
+    if (lookups == 0) { return; }
+    spdlog::info("Translation cache: {} of {} lookups hit ({:.0f}%), {:.3f}ms of translation saved",
+      hits,
+      lookups,
+      100.0 * static_cast<double>(hits) / static_cast<double>(lookups),
+      saved_ms);
+  }
+
+private:
+  [[nodiscard]] std::filesystem::path path(const std::uint64_t key, const std::string_view extension) const
+  {
+    return directory / fmt::format("{:016x}.{}", key, extension);
+  }
+
+  std::filesystem::path directory;
+  // tells the temporaries of the processes sharing the directory apart
+  std::uint32_t process;
+  std::size_t           lookups  = 0;
+  std::size_t           hits     = 0;
+  double                saved_ms = 0;
+};
+
+#endif// INC_6502_CPP_TRANSLATION_CACHE_HPP
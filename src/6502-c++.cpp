@@ -1,284 +1,100 @@
+#include <algorithm>
 #include <cassert>
 #include <cctype>
 #include <charconv>
+#include <chrono>
 #include <ctre.hpp>
+#include <deque>
 #include <fmt/format.h>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <map>
-#include <regex>
-#include <set>
+#include <optional>
 #include <spdlog/spdlog.h>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include <CLI/CLI.hpp>
 
 #include "include/6502.hpp"
+#include "include/assembler.hpp"
 #include "include/assembly.hpp"
-#include "include/lib1funcs.hpp"
+#include "include/avr.hpp"
+#include "include/cost.hpp"
+#include "include/lexer.hpp"
+#include "include/linker.hpp"
+#include "include/long_branches.hpp"
 #include "include/optimizer.hpp"
 #include "include/personalities/c64.hpp"
 #include "include/personalities/x16.hpp"
-
-int to_int(const std::string_view sv)
-{
-  int result{};
-  std::from_chars(sv.begin(), sv.end(), result);
-  return result;
-}
+#include "include/process.hpp"
+#include "include/symbol_table.hpp"
+#include "include/thread_pool.hpp"
+#include "include/translation_cache.hpp"
 
 int parse_8bit_literal(const std::string_view s) { return to_int(s.substr(1)); }
 
-std::string_view strip_lo_hi(std::string_view s)
+// `-(label+2)` has no symbol + offset form on the 6502 side, so it becomes a symbol of its own
+std::pair<SymbolId, int> to_expression(const AVR::Operand &o)
 {
-  const auto matcher = ctre::match<R"(^(lo|hi)8\((.*)\)$)">;
+  if (!o.negated) { return { o.symbol, o.offset }; }
 
-  if (const auto results = matcher(s); results) { return results.get<2>(); }
-
-  return s;
+  const auto negated = Operand(Operand::Type::literal, Operand::AddressingMode::absolute, o.symbol, o.offset);
+  return { symbols().intern(fmt::format("-({})", negated.value())), 0 };
 }
 
-std::string_view strip_negate(std::string_view s)
+Operand literal_operand(const AVR::Operand &o)
 {
-  const auto matcher = ctre::match<R"(^-\((.*)\)$)">;
-
-  if (const auto results = matcher(s); results) { return results.get<1>(); }
-
-  return s;
+  const auto [symbol, offset] = to_expression(o);
+  return Operand(Operand::Type::literal, Operand::address_mode(symbols().name(symbol), offset), symbol, offset);
 }
 
-std::string_view strip_gs(std::string_view s)
-{
-  const auto matcher = ctre::match<R"(gs\((.*)\))">;
-
-  if (const auto results = matcher(s); results) { return results.get<1>(); }
-
-  return s;
-}
-
-std::string_view strip_offset(std::string_view s)
-{
-  const auto matcher = ctre::match<R"(^(.*)(\+|-)[0-9]+$)">;
-
-  if (const auto results = matcher(s); results) { return results.get<1>(); }
-
-  return s;
-}
-
-
-std::string fixup_8bit_literal(const std::string &s)
+Operand fixup_8bit_literal(const AVR::Operand &o)
 {
-  if (s[0] == '$') { return "#" + std::to_string(static_cast<uint8_t>(parse_8bit_literal(s))); }
+  const auto s = o.value;
 
-  if (s.starts_with("0x")) { return "#$" + s.substr(2); }
+  if (s[0] == '$') {
+    return Operand(Operand::Type::literal, fmt::format("#{}", static_cast<uint8_t>(parse_8bit_literal(s))));
+  }
 
-  if (s.starts_with("lo8(")) { return fmt::format("#<({})", strip_gs(strip_lo_hi(s))); }
-  if (s.starts_with("hi8(")) { return fmt::format("#>({})", strip_gs(strip_lo_hi(s))); }
+  if (s.starts_with("0x")) { return Operand(Operand::Type::literal, fmt::format("#${}", s.substr(2))); }
 
   const auto is_num = std::all_of(begin(s), end(s), [](const auto c) { return (c >= '0' && c <= '9') || c == '-'; });
 
-  if (is_num) { return "#<" + s; }
-
-  return s;
-}
-
-
-struct AVR : ASMLine
-{
-  enum class OpCode {
-    unknown,
-
-    adc,
-    adiw,
-    add,
-    andi,
-    asr,
-
-    breq,
-    brge,
-    brlt,
-    brlo,
-    brne,
-    brsh,
-
-    call,
-    clr,
-    com,
-    cp,
-    cpc,
-    cpi,
-    cpse,
-    dec,
-
-    eor,
-
-    in,
-    inc,
-    icall,
-
-    jmp,
-
-    ld,
-    ldd,
-    ldi,
-    lds,
-    lsl,
-    lsr,
-
-    mov,
-
-    nop,
-
-    OR,
-    ori,
-    out,
-
-    pop,
-    push,
-
-    rcall,
-    ret,
-    rjmp,
-    rol,
-    ror,
-
-    sbc,
-    sbci,
-    sbiw,
-    sbrc,
-    sbrs,
-    st,
-    std,
-    sts,
-    sub,
-    subi,
-    swap,
-
-    tst,
-  };
-
-  [[nodiscard]] static constexpr OpCode parse_opcode(Type t, std::string_view o)
-  {
-    switch (t) {
-    case Type::Label:
-    case Type::Directive: return OpCode::unknown;
-    case Type::Instruction: {
-      if (o == "ldi") { return OpCode::ldi; }
-      if (o == "sts") { return OpCode::sts; }
-      if (o == "ret") { return OpCode::ret; }
-      if (o == "mov") { return OpCode::mov; }
-      if (o == "lsl") { return OpCode::lsl; }
-      if (o == "rol") { return OpCode::rol; }
-      if (o == "ror") { return OpCode::ror; }
-      if (o == "rcall") { return OpCode::rcall; }
-      if (o == "icall") { return OpCode::icall; }
-      if (o == "call") { return OpCode::call; }
-      if (o == "ld") { return OpCode::ld; }
-      if (o == "sub") { return OpCode::sub; }
-      if (o == "subi") { return OpCode::subi; }
-      if (o == "sbc") { return OpCode::sbc; }
-      if (o == "sbci") { return OpCode::sbci; }
-      if (o == "st") { return OpCode::st; }
-      if (o == "std") { return OpCode::std; }
-      if (o == "ldd") { return OpCode::ldd; }
-      if (o == "lds") { return OpCode::lds; }
-      if (o == "lsr") { return OpCode::lsr; }
-      if (o == "andi") { return OpCode::andi; }
-      if (o == "asr") { return OpCode::asr; }
-      if (o == "eor") { return OpCode::eor; }
-      if (o == "sbrc") { return OpCode::sbrc; }
-      if (o == "rjmp") { return OpCode::rjmp; }
-      if (o == "sbrs") { return OpCode::sbrs; }
-      if (o == "brne") { return OpCode::brne; }
-      if (o == "dec") { return OpCode::dec; }
-      if (o == "adiw") { return OpCode::adiw; }
-      if (o == "sbiw") { return OpCode::sbiw; }
-      if (o == "push") { return OpCode::push; }
-      if (o == "pop") { return OpCode::pop; }
-      if (o == "com") { return OpCode::com; }
-      if (o == "swap") { return OpCode::swap; }
-      if (o == "clr") { return OpCode::clr; }
-      if (o == "cpse") { return OpCode::cpse; }
-      if (o == "cpi") { return OpCode::cpi; }
-      if (o == "brlo") { return OpCode::brlo; }
-      if (o == "add") { return OpCode::add; }
-      if (o == "adc") { return OpCode::adc; }
-      if (o == "cpc") { return OpCode::cpc; }
-      if (o == "cp") { return OpCode::cp; }
-      if (o == "brsh") { return OpCode::brsh; }
-      if (o == "breq") { return OpCode::breq; }
-      if (o == "in") { return OpCode::in; }
-      if (o == "out") { return OpCode::out; }
-      if (o == "inc") { return OpCode::inc; }
-      if (o == "nop") { return OpCode::nop; }
-      if (o == "jmp") { return OpCode::jmp; }
-      if (o == "tst") { return OpCode::tst; }
-      if (o == "brge") { return OpCode::brge; }
-      if (o == "brlt") { return OpCode::brlt; }
-      if (o == "or") { return OpCode::OR; }
-      if (o == "ori") { return OpCode::ori; }
-    }
-    }
-    throw std::runtime_error(fmt::format("Unknown opcode: {}", o));
-  }
-
-  static int get_register_number(const char reg_name)
-  {
-    if (reg_name == 'X') { return 26; }
-    if (reg_name == 'Y') { return 28; }
-    if (reg_name == 'Z') { return 30; }
-
-    throw std::runtime_error("Unknown register name");
-  }
-
-  static Operand parse_operand(std::string_view o)
-  {
-    if (o.empty()) { return Operand(); }
-
-    if (o[0] == 'r' && o.size() > 1) {
-      return Operand(Operand::Type::reg, to_int(o.substr(1)));
-    } else {
-      return Operand(Operand::Type::literal, std::string{ o });
-    }
+  if (is_num) {
+    return Operand(
+      Operand::Type::literal, Operand::AddressingMode::immediate, symbols().intern(s), 0, Operand::Modifier::lo);
   }
 
-  AVR(const int t_line_num,
-    std::string_view t_line_text,
-    Type t,
-    std::string_view t_opcode,
-    std::string_view o1 = "",
-    std::string_view o2 = "")
-    : ASMLine(t, std::string(t_opcode)), line_num(t_line_num), line_text(std::string(t_line_text)),
-      opcode(parse_opcode(t, t_opcode)), operand1(parse_operand(o1)), operand2(parse_operand(o2))
-  {}
+  const auto [symbol, offset] = to_expression(o);
+  return Operand(Operand::Type::literal, Operand::AddressingMode::immediate, symbol, offset, o.modifier);
+}
 
-  int line_num;
-  std::string line_text;
-  OpCode opcode;
-  Operand operand1;
-  Operand operand2;
-};
 
 void indirect_load(std::vector<mos6502> &instructions,
-  const std::string &from_address_low_byte,
-  const std::string &to_address,
+  const Operand &from_address_low_byte,
+  const Operand &to_address,
   const int offset = 0)
 {
   instructions.emplace_back(mos6502::OpCode::ldy, Operand(Operand::Type::literal, fmt::format("#{}", offset)));
-  instructions.emplace_back(
-    mos6502::OpCode::lda, Operand(Operand::Type::literal, "(" + from_address_low_byte + "), Y"));
-  instructions.emplace_back(mos6502::OpCode::sta, Operand(Operand::Type::literal, to_address));
+  instructions.emplace_back(mos6502::OpCode::lda,
+    Operand(Operand::Type::literal, Operand::AddressingMode::indirect_y, from_address_low_byte.symbol));
+  instructions.emplace_back(mos6502::OpCode::sta, to_address);
 }
 
 void indirect_store(std::vector<mos6502> &instructions,
-  const std::string &from_address,
-  const std::string &to_address_low_byte,
+  const Operand &from_address,
+  const Operand &to_address_low_byte,
   const int offset = 0)
 {
-  instructions.emplace_back(mos6502::OpCode::lda, Operand(Operand::Type::literal, from_address));
+  instructions.emplace_back(mos6502::OpCode::lda, from_address);
   instructions.emplace_back(mos6502::OpCode::ldy, Operand(Operand::Type::literal, fmt::format("#{}", offset)));
-  instructions.emplace_back(mos6502::OpCode::sta, Operand(Operand::Type::literal, "(" + to_address_low_byte + "), Y"));
+  instructions.emplace_back(mos6502::OpCode::sta,
+    Operand(Operand::Type::literal, Operand::AddressingMode::indirect_y, to_address_low_byte.symbol));
 }
 
 
@@ -302,10 +118,11 @@ void indirect_store(std::vector<mos6502> &instructions,
 
 void fixup_16_bit_N_Z_flags(std::vector<mos6502> &instructions)
 {
+  const auto first = instructions.size();
 
   // need to get both Z and N set appropriately
   // assuming A contains higher order byte and X contains lower order byte
-  instructions.emplace_back(ASMLine::Type::Directive, "; BEGIN remove if next is lda");
+  instructions.emplace_back(ASMLine::Type::Directive, "; BEGIN 16 bit N / Z flag fix-up");
   instructions.emplace_back(ASMLine::Type::Directive, "; set CPU flags assuming A holds the higher order byte already");
   std::string set_flag_label = "fixup_16_bit_op_flags" + std::to_string(instructions.size());
   // if high order is negative, we know it's not 0 and it is negative
@@ -319,7 +136,12 @@ void fixup_16_bit_N_Z_flags(std::vector<mos6502> &instructions)
   // if low order byte is negative, just load 1, this will properly set the Z flag and leave C correct
   instructions.emplace_back(mos6502::OpCode::lda, Operand(Operand::Type::literal, "#1"));
   instructions.emplace_back(ASMLine::Type::Label, set_flag_label);
-  instructions.emplace_back(ASMLine::Type::Directive, "; END remove if next is lda, bcc, bcs, ldy, inc, clc, sec");
+  instructions.emplace_back(ASMLine::Type::Directive, "; END 16 bit N / Z flag fix-up");
+
+  // the optimizer drops the whole sequence if nothing reads the Z flag it sets up or the A it leaves behind
+  for (auto line = first; line < instructions.size(); ++line) {
+    instructions[line].flag_fixup = static_cast<std::uint32_t>(first + 1);
+  }
 }
 
 void add_16_bit(const Personality &personality,
@@ -409,10 +231,10 @@ void decrement_16_bit(const Personality &personality, std::vector<mos6502> &inst
 void translate_instruction(const Personality &personality,
   std::vector<mos6502> &instructions,
   const AVR::OpCode op,
-  const Operand &o1,
-  const Operand &o2)
+  const AVR::Operand &o1,
+  const AVR::Operand &o2)
 {
-  const auto translate_register_number = [](const Operand &reg) {
+  const auto translate_register_number = [](const AVR::Operand &reg) {
     if (reg.value == "__zero_reg__") {
       return 1;
     } else if (reg.value == "__temp_reg__") {
@@ -434,11 +256,11 @@ void translate_instruction(const Personality &personality,
   }
   case AVR::OpCode::ori: {
     instructions.emplace_back(mos6502::OpCode::lda, personality.get_register(o1_reg_num));
-    instructions.emplace_back(mos6502::OpCode::ORA, Operand(o2.type, fixup_8bit_literal(o2.value)));
+    instructions.emplace_back(mos6502::OpCode::ORA, fixup_8bit_literal(o2));
     instructions.emplace_back(mos6502::OpCode::sta, personality.get_register(o1_reg_num));
     return;
   }
-  case AVR::OpCode::jmp: instructions.emplace_back(mos6502::OpCode::jmp, o1); return;
+  case AVR::OpCode::jmp: instructions.emplace_back(mos6502::OpCode::jmp, literal_operand(o1)); return;
   case AVR::OpCode::tst: {
     // just an lda will set the relevant flags that the tst operation sets, so I think this is
     // sufficient
@@ -447,43 +269,52 @@ void translate_instruction(const Personality &personality,
   }
   case AVR::OpCode::dec: instructions.emplace_back(mos6502::OpCode::dec, personality.get_register(o1_reg_num)); return;
   case AVR::OpCode::ldi:
-    instructions.emplace_back(mos6502::OpCode::lda, Operand(o2.type, fixup_8bit_literal(o2.value)));
+    instructions.emplace_back(mos6502::OpCode::lda, fixup_8bit_literal(o2));
     instructions.emplace_back(mos6502::OpCode::sta, personality.get_register(o1_reg_num));
     return;
   case AVR::OpCode::sts:
     instructions.emplace_back(mos6502::OpCode::lda, personality.get_register(o2_reg_num));
-    instructions.emplace_back(mos6502::OpCode::sta, Operand(o1.type, o1.value));
+    instructions.emplace_back(mos6502::OpCode::sta, literal_operand(o1));
     return;
   case AVR::OpCode::ret: instructions.emplace_back(mos6502::OpCode::rts); return;
   case AVR::OpCode::mov:
     instructions.emplace_back(mos6502::OpCode::lda, personality.get_register(o2_reg_num));
     instructions.emplace_back(mos6502::OpCode::sta, personality.get_register(o1_reg_num));
     return;
+  case AVR::OpCode::movw:
+    instructions.emplace_back(mos6502::OpCode::lda, personality.get_register(o2_reg_num));
+    instructions.emplace_back(mos6502::OpCode::sta, personality.get_register(o1_reg_num));
+    instructions.emplace_back(mos6502::OpCode::lda, personality.get_register(o2_reg_num + 1));
+    instructions.emplace_back(mos6502::OpCode::sta, personality.get_register(o1_reg_num + 1));
+    return;
   case AVR::OpCode::lsl: instructions.emplace_back(mos6502::OpCode::asl, personality.get_register(o1_reg_num)); return;
   case AVR::OpCode::rol: instructions.emplace_back(mos6502::OpCode::rol, personality.get_register(o1_reg_num)); return;
   case AVR::OpCode::ror: instructions.emplace_back(mos6502::OpCode::ror, personality.get_register(o1_reg_num)); return;
   case AVR::OpCode::call:
     if (o1.value != ".") {
-      instructions.emplace_back(mos6502::OpCode::jsr, o1);
+      instructions.emplace_back(mos6502::OpCode::jsr, literal_operand(o1));
       return;
     }
     throw std::runtime_error("Unhandled call");
   case AVR::OpCode::icall: {
     std::string new_label_name = "return_from_icall_" + std::to_string(instructions.size());
-    instructions.emplace_back(
-      mos6502::OpCode::lda, Operand(Operand::Type::literal, fmt::format("#>({}-1)", new_label_name)));
+    const auto return_address = symbols().intern(new_label_name);
+    instructions.emplace_back(mos6502::OpCode::lda,
+      Operand(Operand::Type::literal, Operand::AddressingMode::immediate, return_address, -1, Operand::Modifier::hi));
     instructions.emplace_back(mos6502::OpCode::pha);
-    instructions.emplace_back(
-      mos6502::OpCode::lda, Operand(Operand::Type::literal, fmt::format("#<({}-1)", new_label_name)));
+    instructions.emplace_back(mos6502::OpCode::lda,
+      Operand(Operand::Type::literal, Operand::AddressingMode::immediate, return_address, -1, Operand::Modifier::lo));
     instructions.emplace_back(mos6502::OpCode::pha);
     instructions.emplace_back(mos6502::OpCode::jmp,
-      Operand(Operand::Type::literal, "(" + personality.get_register(AVR::get_register_number('Z')).value + ")"));
+      Operand(Operand::Type::literal,
+        Operand::AddressingMode::indirect,
+        personality.get_register(AVR::get_register_number('Z')).symbol));
     instructions.emplace_back(ASMLine::Type::Label, new_label_name);
     return;
   }
   case AVR::OpCode::rcall:
     if (o1.value != ".") {
-      instructions.emplace_back(mos6502::OpCode::jsr, o1);
+      instructions.emplace_back(mos6502::OpCode::jsr, literal_operand(o1));
     } else {
       // just push in 2 bytes
       instructions.emplace_back(mos6502::OpCode::pha);
@@ -494,24 +325,37 @@ void translate_instruction(const Personality &personality,
   case AVR::OpCode::ld: {
     if (o2.value == "Z" || o2.value == "X" || o2.value == "Y") {
       indirect_load(instructions,
-        personality.get_register(AVR::get_register_number(o2.value[0])).value,
-        personality.get_register(o1_reg_num).value);
+        personality.get_register(AVR::get_register_number(o2.value[0])),
+        personality.get_register(o1_reg_num));
       return;
     }
     if (o2.value == "Z+" || o2.value == "X+" || o2.value == "Y+") {
       indirect_load(instructions,
-        personality.get_register(AVR::get_register_number(o2.value[0])).value,
-        personality.get_register(o1_reg_num).value);
+        personality.get_register(AVR::get_register_number(o2.value[0])),
+        personality.get_register(o1_reg_num));
       increment_16_bit(personality, instructions, AVR::get_register_number(o2.value[0]));
       return;
     }
     throw std::runtime_error("Unknown ld indexing");
   }
+  case AVR::OpCode::lpm: {
+    // there is only one address space on the 6502, so reading program memory is a plain `ld`
+    if (o1.type == Operand::Type::empty) {
+      translate_instruction(personality,
+        instructions,
+        AVR::OpCode::ld,
+        AVR::Operand(Operand::Type::reg, 0),
+        AVR::Operand(Operand::Type::literal, "Z"));
+    } else {
+      translate_instruction(personality, instructions, AVR::OpCode::ld, o1, o2);
+    }
+    return;
+  }
   case AVR::OpCode::ldd: {
     if (o2.value[1] == '+') {
       indirect_load(instructions,
-        personality.get_register(AVR::get_register_number(o2.value[0])).value,
-        personality.get_register(o1_reg_num).value,
+        personality.get_register(AVR::get_register_number(o2.value[0])),
+        personality.get_register(o1_reg_num),
         to_int(o2.value.substr(2)));
       return;
     }
@@ -521,8 +365,8 @@ void translate_instruction(const Personality &personality,
   case AVR::OpCode::std: {
     if (o1.value[1] == '+') {
       indirect_store(instructions,
-        personality.get_register(o2_reg_num).value,
-        personality.get_register(AVR::get_register_number(o1.value[0])).value,
+        personality.get_register(o2_reg_num),
+        personality.get_register(AVR::get_register_number(o1.value[0])),
         to_int(o1.value.substr(2)));
       return;
     }
@@ -543,7 +387,7 @@ void translate_instruction(const Personality &personality,
       return;
     } else {
       instructions.emplace_back(ASMLine::Type::Label, s_set);
-      instructions.emplace_back(mos6502::OpCode::jmp, o1);
+      instructions.emplace_back(mos6502::OpCode::jmp, literal_operand(o1));
       instructions.emplace_back(ASMLine::Type::Label, s_clear);
       return;
     }
@@ -560,7 +404,7 @@ void translate_instruction(const Personality &personality,
       return;
     } else {
       instructions.emplace_back(ASMLine::Type::Label, s_clear);
-      instructions.emplace_back(mos6502::OpCode::jmp, o1);
+      instructions.emplace_back(mos6502::OpCode::jmp, literal_operand(o1));
       instructions.emplace_back(ASMLine::Type::Label, s_set);
       return;
     }
@@ -590,7 +434,7 @@ void translate_instruction(const Personality &personality,
     // we want to utilize the carry flag, however it was set previously
     // (it's really a borrow flag on the 6502)
     instructions.emplace_back(mos6502::OpCode::lda, personality.get_register(o1_reg_num));
-    instructions.emplace_back(mos6502::OpCode::sbc, Operand(o2.type, fixup_8bit_literal(o2.value)));
+    instructions.emplace_back(mos6502::OpCode::sbc, fixup_8bit_literal(o2));
     instructions.emplace_back(mos6502::OpCode::sta, personality.get_register(o1_reg_num));
     fixup_16_bit_N_Z_flags(instructions);
     return;
@@ -613,7 +457,7 @@ void translate_instruction(const Personality &personality,
     instructions.emplace_back(mos6502::OpCode::lda, personality.get_register(o1_reg_num));
     // have to set carry flag, since it gets inverted by sbc
     instructions.emplace_back(mos6502::OpCode::sec);
-    instructions.emplace_back(mos6502::OpCode::sbc, Operand(o2.type, fixup_8bit_literal(o2.value)));
+    instructions.emplace_back(mos6502::OpCode::sbc, fixup_8bit_literal(o2));
     instructions.emplace_back(mos6502::OpCode::sta, personality.get_register(o1_reg_num));
     // temporarily store lower order (not carried substraction) byte into Y for checking
     // later if this is a two byte subtraction operation
@@ -623,28 +467,28 @@ void translate_instruction(const Personality &personality,
   case AVR::OpCode::st: {
     if (o1.value == "Z" || o1.value == "Y" || o1.value == "X") {
       indirect_store(instructions,
-        personality.get_register(o2_reg_num).value,
-        personality.get_register(AVR::get_register_number(o1.value[0])).value);
+        personality.get_register(o2_reg_num),
+        personality.get_register(AVR::get_register_number(o1.value[0])));
       return;
     }
     if (o1.value == "Z+" || o1.value == "Y+" || o1.value == "X+") {
       indirect_store(instructions,
-        personality.get_register(o2_reg_num).value,
-        personality.get_register(AVR::get_register_number(o1.value[0])).value);
+        personality.get_register(o2_reg_num),
+        personality.get_register(AVR::get_register_number(o1.value[0])));
       increment_16_bit(personality, instructions, AVR::get_register_number(o1.value[0]));
       return;
     }
     if (o1.value == "-Z" || o1.value == "-Y" || o1.value == "-X") {
       decrement_16_bit(personality, instructions, AVR::get_register_number(o1.value[1]));
       indirect_store(instructions,
-        personality.get_register(o2_reg_num).value,
-        personality.get_register(AVR::get_register_number(o1.value[1])).value);
+        personality.get_register(o2_reg_num),
+        personality.get_register(AVR::get_register_number(o1.value[1])));
       return;
     }
     throw std::runtime_error("Unhandled st");
   }
   case AVR::OpCode::lds: {
-    instructions.emplace_back(mos6502::OpCode::lda, o2);
+    instructions.emplace_back(mos6502::OpCode::lda, literal_operand(o2));
     instructions.emplace_back(mos6502::OpCode::sta, personality.get_register(o1_reg_num));
     return;
   }
@@ -660,7 +504,7 @@ void translate_instruction(const Personality &personality,
   }
   case AVR::OpCode::andi: {
     instructions.emplace_back(mos6502::OpCode::lda, personality.get_register(o1_reg_num));
-    instructions.emplace_back(mos6502::OpCode::AND, Operand(o2.type, fixup_8bit_literal(o2.value)));
+    instructions.emplace_back(mos6502::OpCode::AND, fixup_8bit_literal(o2));
     instructions.emplace_back(mos6502::OpCode::sta, personality.get_register(o1_reg_num));
     return;
   }
@@ -680,7 +524,7 @@ void translate_instruction(const Personality &personality,
   }
   case AVR::OpCode::sbrc: {
     instructions.emplace_back(
-      mos6502::OpCode::lda, Operand(o2.type, fixup_8bit_literal("$" + std::to_string(1 << (to_int(o2.value))))));
+      mos6502::OpCode::lda, Operand(o2.type, fmt::format("#{}", static_cast<uint8_t>(1 << (to_int(o2.value))))));
     instructions.emplace_back(mos6502::OpCode::bit, personality.get_register(o1_reg_num));
     std::string new_label_name = "skip_next_instruction_" + std::to_string(instructions.size());
     instructions.emplace_back(mos6502::OpCode::beq, Operand(Operand::Type::literal, new_label_name));
@@ -688,8 +532,8 @@ void translate_instruction(const Personality &personality,
     return;
   }
   case AVR::OpCode::sbrs: {
-    instructions.emplace_back(mos6502::OpCode::lda,
-      Operand(o2.type, fixup_8bit_literal("$" + std::to_string(1 << (to_int(o2.value.c_str()))))));
+    instructions.emplace_back(
+      mos6502::OpCode::lda, Operand(o2.type, fmt::format("#{}", static_cast<uint8_t>(1 << (to_int(o2.value))))));
     instructions.emplace_back(mos6502::OpCode::bit, personality.get_register(o1_reg_num));
     std::string new_label_name = "skip_next_instruction_" + std::to_string(instructions.size());
     instructions.emplace_back(mos6502::OpCode::bne, Operand(Operand::Type::literal, new_label_name));
@@ -710,7 +554,7 @@ void translate_instruction(const Personality &personality,
       instructions.emplace_back(ASMLine::Type::Directive, new_label_name);
       return;
     } else {
-      instructions.emplace_back(mos6502::OpCode::bne, o1);
+      instructions.emplace_back(mos6502::OpCode::bne, literal_operand(o1));
       return;
     }
 
@@ -718,7 +562,7 @@ void translate_instruction(const Personality &personality,
   }
 
   case AVR::OpCode::rjmp: {
-    instructions.emplace_back(mos6502::OpCode::jmp, o1);
+    instructions.emplace_back(mos6502::OpCode::jmp, literal_operand(o1));
     return;
   }
 
@@ -758,7 +602,7 @@ void translate_instruction(const Personality &personality,
     // note that this will leave the C flag in the 6502 borrow state, not normal carry state
     instructions.emplace_back(mos6502::OpCode::lda, personality.get_register(o1_reg_num));
     instructions.emplace_back(mos6502::OpCode::sec);
-    instructions.emplace_back(mos6502::OpCode::sbc, Operand(o2.type, fixup_8bit_literal(o2.value)));
+    instructions.emplace_back(mos6502::OpCode::sbc, fixup_8bit_literal(o2));
     instructions.emplace_back(mos6502::OpCode::tax);
     return;
   }
@@ -771,7 +615,7 @@ void translate_instruction(const Personality &personality,
       instructions.emplace_back(ASMLine::Type::Directive, new_label_name);
       return;
     } else {
-      instructions.emplace_back(mos6502::OpCode::bcc, o1);
+      instructions.emplace_back(mos6502::OpCode::bcc, literal_operand(o1));
       return;
     }
   }
@@ -836,7 +680,7 @@ void translate_instruction(const Personality &personality,
       instructions.emplace_back(ASMLine::Type::Directive, new_label_name);
       return;
     } else {
-      instructions.emplace_back(mos6502::OpCode::bcs, o1);
+      instructions.emplace_back(mos6502::OpCode::bcs, literal_operand(o1));
       return;
     }
   }
@@ -879,7 +723,7 @@ void translate_instruction(const Personality &personality,
       instructions.emplace_back(ASMLine::Type::Directive, new_label_name);
       return;
     } else {
-      instructions.emplace_back(mos6502::OpCode::beq, o1);
+      instructions.emplace_back(mos6502::OpCode::beq, literal_operand(o1));
       return;
     }
   }
@@ -899,16 +743,20 @@ void to_mos6502(const Personality &personality, const AVR &from_instruction, std
 {
   try {
     switch (from_instruction.type) {
-    case ASMLine::Type::Label:
+    case AVR::Type::Label:
       if (from_instruction.text == "0") {
-        instructions.emplace_back(from_instruction.type, "-memcpy_0");
+        instructions.emplace_back(ASMLine::Type::Label, "-memcpy_0");
       } else if (from_instruction.text == "1") {
-        instructions.emplace_back(from_instruction.type, "-mul2_1");
+        instructions.emplace_back(ASMLine::Type::Label, "-mul2_1");
       } else {
-        instructions.emplace_back(from_instruction.type, from_instruction.text);
+        instructions.emplace_back(ASMLine::Type::Label, std::string{ from_instruction.text });
       }
       return;
-    case ASMLine::Type::Directive:
+    case AVR::Type::Comment:
+      // save comments!
+      instructions.emplace_back(ASMLine::Type::Directive, fmt::format("; {}", from_instruction.text));
+      return;
+    case AVR::Type::Directive:
       if (from_instruction.text.starts_with(".string") || from_instruction.text.starts_with(".ascii")) {
         const auto &text = from_instruction.text;
         const auto start = [=]() -> std::size_t {
@@ -921,7 +769,7 @@ void to_mos6502(const Personality &personality, const AVR &from_instruction, std
 
         const auto isdigit = [](char c) { return c <= '9' && c >= '0'; };
 
-        for (std::size_t pos = start; text[pos] != '"'; ++pos) {
+        for (std::size_t pos = start; pos < text.size() && text[pos] != '"'; ++pos) {
           if (text[pos] != '\\') {
             instructions.emplace_back(
               ASMLine::Type::Directive, fmt::format(".byt ${:02x}", static_cast<std::uint8_t>(text[pos])));
@@ -966,17 +814,19 @@ void to_mos6502(const Personality &personality, const AVR &from_instruction, std
         const auto matcher = ctre::match<R"(\s*.word\s*(.*))">;
 
         if (const auto results = matcher(from_instruction.text); results) {
-          const auto matched_gs = results.get<1>().to_string();
-          instructions.emplace_back(ASMLine::Type::Directive, ".word " + std::string{ strip_gs(matched_gs) });
+          const std::string_view matched_gs = results.get<1>();
+          instructions.emplace_back(ASMLine::Type::Directive, fmt::format(".word {}", strip_call(matched_gs, "gs")));
         } else {
-          instructions.emplace_back(ASMLine::Type::Directive, ".word " + from_instruction.text.substr(6));
+          instructions.emplace_back(ASMLine::Type::Directive, fmt::format(".word {}", from_instruction.text.substr(6)));
           // spdlog::warn("Unknown .word directive '{}'", from_instruction.text);
         }
 
       } else if (from_instruction.text.starts_with(".byte")) {
-        instructions.emplace_back(ASMLine::Type::Directive, ".byt <" + from_instruction.text.substr(6));
+        instructions.emplace_back(ASMLine::Type::Directive, fmt::format(".byt <{}", from_instruction.text.substr(6)));
       } else if (from_instruction.text.starts_with(".zero")) {
-        const auto count = std::stoull(&*std::next(from_instruction.text.begin(), 6), nullptr, 10);
+        const auto count_text = from_instruction.text.substr(skip_space(from_instruction.text, 5));
+        std::size_t count = 0;
+        std::from_chars(count_text.begin(), count_text.end(), count);
 
         std::string zeros;
         for (std::size_t i = 0; i < count; ++i) {
@@ -992,14 +842,12 @@ void to_mos6502(const Personality &personality, const AVR &from_instruction, std
         }
 
         if (!zeros.empty()) { instructions.emplace_back(ASMLine::Type::Directive, zeros); }
-      } else if (from_instruction.text[0] == ';') {
-        // it's a comment
-        instructions.emplace_back(ASMLine::Type::Directive, from_instruction.text);
       } else {
-        instructions.emplace_back(ASMLine::Type::Directive, "; Unknown directive: " + from_instruction.text);
+        instructions.emplace_back(
+          ASMLine::Type::Directive, fmt::format("; Unknown directive: {}", from_instruction.text));
       }
       return;
-    case ASMLine::Type::Instruction:
+    case AVR::Type::Instruction:
       const auto head = instructions.size();
 
       try {
@@ -1007,13 +855,13 @@ void to_mos6502(const Personality &personality, const AVR &from_instruction, std
           personality, instructions, from_instruction.opcode, from_instruction.operand1, from_instruction.operand2);
       } catch (const std::exception &e) {
         instructions.emplace_back(
-          ASMLine::Type::Directive, "; Unhandled opcode: '" + from_instruction.text + "' " + e.what());
+          ASMLine::Type::Directive, fmt::format("; Unhandled opcode: '{}' {}", from_instruction.text, e.what()));
         spdlog::error(
           "[{}]: Unhandled instruction: '{}': {}", from_instruction.line_num, from_instruction.line_text, e.what());
       }
 
       auto text = from_instruction.line_text;
-      if (text[0] == '\t') { text.erase(0, 1); }
+      if (text.starts_with('\t')) { text.remove_prefix(1); }
       for_each(std::next(instructions.begin(), static_cast<std::ptrdiff_t>(head)),
         instructions.end(),
         [text](auto &ins) { ins.comment = text; });
@@ -1026,81 +874,562 @@ void to_mos6502(const Personality &personality, const AVR &from_instruction, std
 }
 
 
-bool fix_long_branches(std::vector<mos6502> &instructions, int &branch_patch_count)
+// instructions that skip the one after them
+[[nodiscard]] bool is_skip(const std::string_view mnemonic)
+{
+  return mnemonic == "cpse" || mnemonic == "sbrc" || mnemonic == "sbrs" || mnemonic == "sbic" || mnemonic == "sbis";
+}
+
+// branches, jumps, calls and returns
+[[nodiscard]] bool changes_flow(const std::string_view mnemonic)
+{
+  return mnemonic.starts_with("br") || mnemonic.ends_with("jmp") || mnemonic.ends_with("call")
+         || mnemonic.starts_with("ret");
+}
+
+// arithmetic, logic and compares, the instructions a branch can test the result of
+[[nodiscard]] bool sets_flags(const std::string_view mnemonic)
+{
+  constexpr static std::string_view setters[] = { "add", "adc", "adiw", "sub", "subi", "sbc", "sbci", "sbiw", "and",
+    "andi", "or", "ori", "eor", "com", "neg", "inc", "dec", "tst", "clr", "cp", "cpc", "cpi", "lsl", "lsr", "rol", "ror",
+    "asr" };
+  return std::find(std::begin(setters), std::end(setters), mnemonic) != std::end(setters);
+}
+
+// avr-gcc may set the flags a branch tests before instructions that leave them alone on the AVR, but not in their
+// translation: an ldi or a st is an lda, a post increment an inc. Those instructions are bracketed with php / plp.
+// The stack instructions are left out, and a label or a skip ends the search for the branch, so a php and its plp
+// always run together.
+struct FlagKeeper
+{
+  [[nodiscard]] static bool leaves_flags_alone(const AVR &line)
+  {
+    return line.type == AVR::Type::Instruction && !sets_flags(line.text) && !changes_flow(line.text)
+           && !is_skip(line.text) && line.text != "push" && line.text != "pop" && line.text != "in"
+           && line.text != "out";
+  }
+
+  [[nodiscard]] static bool keeps_flags(const std::vector<AVR> &lines, const std::size_t index)
+  {
+    if (!leaves_flags_alone(lines[index])) { return false; }
+    for (auto next = index + 1; next < lines.size(); ++next) {
+      const auto &line = lines[next];
+      if (line.type == AVR::Type::Comment || leaves_flags_alone(line)) { continue; }
+      return line.type == AVR::Type::Instruction && line.text.starts_with("br");
+    }
+    return false;
+  }
+
+  void before(const std::vector<AVR> &lines, const std::size_t index, std::vector<mos6502> &instructions)
+  {
+    if (!saved && keeps_flags(lines, index)) {
+      instructions.emplace_back(mos6502::OpCode::php).comment = "keep the flags for the branch";
+      saved = true;
+    }
+  }
+
+  void after(const std::vector<AVR> &lines, const std::size_t index, std::vector<mos6502> &instructions)
+  {
+    if (!saved || lines[index].type != AVR::Type::Instruction) { return; }
+    auto next = index + 1;
+    while (next < lines.size() && lines[next].type == AVR::Type::Comment) { ++next; }
+    if (next == lines.size() || !leaves_flags_alone(lines[next])) {
+      instructions.emplace_back(mos6502::OpCode::plp).comment = "keep the flags for the branch";
+      saved = false;
+    }
+  }
+
+  bool saved = false;
+};
+
+// A memcpy / memset avr-gcc expanded in place, as a loop at the `0:` label:
+//
+//   0: ld r0,Z+          0: st X+,__zero_reg__
+//      st X+,r0             sbiw r24,1
+//      dec r24              brne 0b
+//      brne 0b
+//
+// The counter is decremented with dec, sbiw or subi / sbci. Translated one AVR instruction at a time, every byte costs
+// an `ldy #0` and a 16 bit increment per pointer. The pattern clobbers the pointers, the counter and r0, so nothing
+// after the loop looks at them and the loop can step Y instead.
+struct BlockLoop
+{
+  // AVR lines from the label up to and including the `brne 0b`
+  std::size_t length = 0;
+  // pointer registers, a memset has no source
+  std::optional<int> source;
+  int                destination = 0;
+  // the register a memset stores
+  int  value        = 1;
+  int  counter      = 0;
+  bool word_counter = false;
+  // the count, when the counter is set with ldi before the loop
+  std::optional<unsigned> count;
+};
+
+[[nodiscard]] std::optional<BlockLoop> match_block_loop(const std::vector<AVR> &lines, const std::size_t label)
+{
+  if (lines[label].type != AVR::Type::Label || lines[label].text != "-memcpy_0") { return std::nullopt; }
+
+  auto       next        = label + 1;
+  const auto instruction = [&](const AVR::OpCode opcode) -> const AVR * {
+    if (next < lines.size() && lines[next].type == AVR::Type::Instruction && lines[next].opcode == opcode) {
+      return &lines[next++];
+    }
+    return nullptr;
+  };
+  const auto register_number = [](const AVR::Operand &operand) -> std::optional<int> {
+    if (operand.type == AVR::Operand::Type::reg) { return operand.reg_num; }
+    if (operand.value == "__zero_reg__") { return 1; }
+    if (operand.value == "__tmp_reg__") { return 0; }
+    return std::nullopt;
+  };
+  const auto post_increment = [](const AVR::Operand &operand) -> std::optional<int> {
+    if (operand.value == "X+" || operand.value == "Y+" || operand.value == "Z+") {
+      return AVR::get_register_number(operand.value[0]);
+    }
+    return std::nullopt;
+  };
+
+  BlockLoop loop;
+
+  const auto *load = instruction(AVR::OpCode::ld);
+  if (load == nullptr) { load = instruction(AVR::OpCode::lpm); }
+  if (load != nullptr) {
+    loop.source = post_increment(load->operand2);
+    if (!loop.source || !register_number(load->operand1)) { return std::nullopt; }
+  }
+
+  const auto *store = instruction(AVR::OpCode::st);
+  if (store == nullptr) { return std::nullopt; }
+  const auto destination = post_increment(store->operand1);
+  const auto value       = register_number(store->operand2);
+  if (!destination || !value || destination == loop.source) { return std::nullopt; }
+  if (load != nullptr && register_number(load->operand1) != value) { return std::nullopt; }
+  loop.destination = *destination;
+  loop.value       = *value;
+
+  if (const auto *dec = instruction(AVR::OpCode::dec); dec != nullptr) {
+    loop.counter = dec->operand1.reg_num;
+  } else if (const auto *sbiw = instruction(AVR::OpCode::sbiw); sbiw != nullptr && sbiw->operand2.value == "1") {
+    loop.counter      = sbiw->operand1.reg_num;
+    loop.word_counter = true;
+  } else if (const auto *subi = instruction(AVR::OpCode::subi); subi != nullptr && subi->operand2.value == "1") {
+    const auto *sbci = instruction(AVR::OpCode::sbci);
+    if (sbci == nullptr || sbci->operand1.reg_num != subi->operand1.reg_num + 1 || sbci->operand2.value != "0") {
+      return std::nullopt;
+    }
+    loop.counter      = subi->operand1.reg_num;
+    loop.word_counter = true;
+  } else {
+    return std::nullopt;
+  }
+
+  const auto *brne = instruction(AVR::OpCode::brne);
+  if (brne == nullptr || brne->operand1.value != "0b") { return std::nullopt; }
+  loop.length = next - label;
+
+  // the count is known when the counter is set with ldi since the last label, jump or skip
+  const auto constant = [](const AVR &line) -> std::optional<unsigned> {
+    const auto digits = symbols().name(line.operand2.symbol);
+    if (line.opcode != AVR::OpCode::ldi || line.operand2.negated || digits.empty()
+        || !std::all_of(digits.begin(), digits.end(), [](const char c) { return c >= '0' && c <= '9'; })) {
+      return std::nullopt;
+    }
+    const auto number = static_cast<unsigned>(to_int(digits) + line.operand2.offset);
+    return line.operand2.modifier == Operand::Modifier::hi ? (number >> 8) & 0xFF : number & 0xFF;
+  };
+
+  std::optional<unsigned> low;
+  std::optional<unsigned> high;
+  for (auto index = label; index-- > 0;) {
+    const auto &line = lines[index];
+    if (line.type == AVR::Type::Label) { break; }
+    if (line.type != AVR::Type::Instruction) { continue; }
+
+    if (is_skip(line.text)) {
+      // the ldi after it may not have run
+      low.reset();
+      high.reset();
+      break;
+    }
+    if (changes_flow(line.text)) { break; }
+
+    const auto target = line.operand1.type == AVR::Operand::Type::reg ? line.operand1.reg_num : -1;
+    const auto pair =
+      line.opcode == AVR::OpCode::movw || line.opcode == AVR::OpCode::adiw || line.opcode == AVR::OpCode::sbiw;
+    // only the write closest to the loop counts, it has to be an ldi
+    const auto assign = [&](std::optional<unsigned> &half, const int reg) {
+      if (half || (target != reg && !(pair && target + 1 == reg))) { return true; }
+      half = constant(line);
+      return half.has_value();
+    };
+    if (!assign(low, loop.counter) || (loop.word_counter && !assign(high, loop.counter + 1))) {
+      low.reset();
+      high.reset();
+      break;
+    }
+  }
+  if (low && (high || !loop.word_counter)) { loop.count = *low + 256 * high.value_or(0); }
+
+  return loop;
+}
+
+void emit_block_loop(const Personality &personality, const BlockLoop &loop, std::vector<mos6502> &instructions)
+{
+  const auto first = instructions.size();
+  const auto name  = fmt::format("block_{}_{}", loop.source ? "copy" : "fill", first);
+
+  const auto indirect = [&](const int pointer) {
+    return Operand(
+      Operand::Type::literal, Operand::AddressingMode::indirect_y, personality.get_register(pointer).symbol);
+  };
+  const auto immediate = [](const unsigned value) { return Operand(Operand::Type::literal, fmt::format("#{}", value)); };
+  const auto branch    = [](const std::string &target) { return Operand(Operand::Type::literal, target); };
+
+  // a memset loads what it stores once, before the loop
+  if (!loop.source) {
+    if (loop.value == 1) {
+      instructions.emplace_back(mos6502::OpCode::lda, immediate(0));
+    } else {
+      instructions.emplace_back(mos6502::OpCode::lda, personality.get_register(loop.value));
+    }
+  }
+  const auto copy_byte = [&] {
+    if (loop.source) { instructions.emplace_back(mos6502::OpCode::lda, indirect(*loop.source)); }
+    instructions.emplace_back(mos6502::OpCode::sta, indirect(loop.destination));
+    instructions.emplace_back(mos6502::OpCode::iny);
+  };
+
+  // X counts the bytes that are left, 0 is 256 of them like it is for dec / brne
+  const auto load_x = [&](const std::optional<unsigned> count, const int counter) {
+    if (count) {
+      instructions.emplace_back(mos6502::OpCode::ldx, immediate(*count));
+    } else {
+      instructions.emplace_back(mos6502::OpCode::ldx, personality.get_register(counter));
+    }
+  };
+  const auto bytes = [&] {
+    instructions.emplace_back(ASMLine::Type::Label, name);
+    copy_byte();
+    instructions.emplace_back(mos6502::OpCode::dex);
+    instructions.emplace_back(mos6502::OpCode::bne, branch(name));
+  };
+
+  instructions.emplace_back(mos6502::OpCode::ldy, immediate(0));
+  if (!loop.word_counter) {
+    load_x(loop.count, loop.counter);
+    bytes();
+  } else {
+    std::optional<unsigned> pages;
+    std::optional<unsigned> rest;
+    if (loop.count) {
+      pages = *loop.count / 256;
+      rest  = *loop.count % 256;
+    }
+
+    // whole pages first, Y wraps around and the high bytes of the pointers move on to the next page
+    if (pages != 0u) {
+      load_x(pages, loop.counter + 1);
+      if (!pages) { instructions.emplace_back(mos6502::OpCode::beq, branch(name + "_rest")); }
+      instructions.emplace_back(ASMLine::Type::Label, name + "_page");
+      copy_byte();
+      instructions.emplace_back(mos6502::OpCode::bne, branch(name + "_page"));
+      if (loop.source) { instructions.emplace_back(mos6502::OpCode::inc, personality.get_register(*loop.source + 1)); }
+      instructions.emplace_back(mos6502::OpCode::inc, personality.get_register(loop.destination + 1));
+      instructions.emplace_back(mos6502::OpCode::dex);
+      instructions.emplace_back(mos6502::OpCode::bne, branch(name + "_page"));
+      if (!pages) { instructions.emplace_back(ASMLine::Type::Label, name + "_rest"); }
+    }
+
+    // then what is left of the last page
+    if (rest != 0u) {
+      load_x(rest, loop.counter);
+      if (!rest) { instructions.emplace_back(mos6502::OpCode::beq, branch(name + "_done")); }
+      bytes();
+      if (!rest) { instructions.emplace_back(ASMLine::Type::Label, name + "_done"); }
+    }
+  }
+
+  const auto comment = loop.source ? "memcpy loop" : "memset loop";
+  for (auto index = first; index < instructions.size(); ++index) { instructions[index].comment = comment; }
+}
+
+
+// A loop that walks pointers with post increment, the way avr-gcc writes `std::fill`, `std::copy` or an array loop:
+//
+//   .L2: ld r24,Z+            .L2: st Z+,r24
+//        st X+,r24                 ldi r25,hi8(2024)
+//        dec r18                   cpi r30,lo8(2024)
+//        brne .L2                  cpc r31,r25
+//                                  brne .L2
+//
+// Translated one AVR instruction at a time, every access costs an `ldy #0` and a 16 bit increment of its pointer.
+// When every walked pointer is accessed once per iteration, they all move in step and Y can do the walking: each
+// pointer is rebased so that (pointer),Y is where it points, one iny per iteration moves all of them and the high
+// bytes only move on when Y wraps. When the loop compares one of the pointers against its end, Y starts out as that
+// pointer's low byte and its own low byte is 0, so Y *is* its low byte and its high byte stays exact. The pointers
+// are put back together after the loop.
+struct PointerWalk
+{
+  // AVR lines from the label up to and including the branch back to it
+  std::size_t length = 0;
+  // the walked pointer registers (26, 28 or 30)
+  std::vector<int> pointers;
+  // the one whose position the loop looks at, in a cp / cpi of its low byte or anywhere as its high byte
+  std::optional<int> compared;
+  // the line after which Y moves on
+  std::size_t last_access = 0;
+};
+
+[[nodiscard]] std::optional<PointerWalk> match_pointer_walk(const std::vector<AVR> &lines,
+  const std::size_t label,
+  const std::unordered_map<SymbolId, int> &label_references)
 {
-  std::map<std::string, size_t> labels;
-  for (size_t op = 0; op < instructions.size(); ++op) {
-    if (instructions[op].type == ASMLine::Type::Label) { labels[instructions[op].text] = op; }
-  }
-
-  for (size_t op = 0; op < instructions.size(); ++op) {
-    if (instructions[op].is_branch
-        && std::abs(static_cast<int>(labels[instructions[op].op.value]) - static_cast<int>(op)) * 4 > 255) {
-      ++branch_patch_count;
-      const auto going_to = instructions[op].op.value;
-      const auto new_pos = "patch_" + std::to_string(branch_patch_count);
-      // uh-oh too long of a branch, have to convert this to a jump...
-
-      std::map<mos6502::OpCode, mos6502::OpCode> branch_mapping;
-
-      branch_mapping[mos6502::OpCode::bne] = mos6502::OpCode::beq;
-      branch_mapping[mos6502::OpCode::beq] = mos6502::OpCode::bne;
-      branch_mapping[mos6502::OpCode::bcc] = mos6502::OpCode::bcs;
-      branch_mapping[mos6502::OpCode::bcs] = mos6502::OpCode::bcc;
-
-      const auto mapping = branch_mapping.find(instructions[op].opcode);
-
-      if (mapping != branch_mapping.end()) {
-        const auto comment = instructions[op].comment;
-        instructions[op] = mos6502(mapping->second, Operand(Operand::Type::literal, new_pos));
-        instructions.insert(std::next(std::begin(instructions), static_cast<std::ptrdiff_t>(op + 1)),
-          mos6502(mos6502::OpCode::jmp, Operand(Operand::Type::literal, going_to)));
-        instructions.insert(std::next(std::begin(instructions), static_cast<std::ptrdiff_t>(op + 2)),
-          mos6502(ASMLine::Type::Label, new_pos));
-        instructions[op].comment = instructions[op + 1].comment = instructions[op + 2].comment = comment;
+  const auto &head = lines[label];
+  if (head.type != AVR::Type::Label || head.text.starts_with('-') || head.text.starts_with(';')) {
+    return std::nullopt;
+  }
+  // the loop is only ever entered from the top, so whatever sets it up runs once before the label
+  const auto symbol = symbols().intern(head.text);
+  if (const auto references = label_references.find(symbol);
+      references == label_references.end() || references->second != 1) {
+    return std::nullopt;
+  }
+
+  // the pointer pair an operand like `Z+`, `-X`, `Y+3` or `Z` goes through
+  const auto pointer_of = [](const AVR::Operand &operand) -> std::optional<int> {
+    if (operand.type != AVR::Operand::Type::literal || operand.value.empty()) { return std::nullopt; }
+    const auto &value     = operand.value;
+    const bool  decrement = value.size() > 1 && value[0] == '-';
+    const auto  letter    = decrement ? value[1] : value[0];
+    const bool  pointer   = letter == 'X' || letter == 'Y' || letter == 'Z';
+    if (!pointer || (value.size() > 1 && !decrement && value[1] != '+')) { return std::nullopt; }
+    return AVR::get_register_number(letter);
+  };
+  const auto walked_by = [](const AVR &line) -> std::optional<int> {
+    const auto &operand = line.opcode == AVR::OpCode::st ? line.operand1 : line.operand2;
+    const bool  access  = line.opcode == AVR::OpCode::ld || line.opcode == AVR::OpCode::st
+                       || (line.opcode == AVR::OpCode::lpm && line.operand1.type == AVR::Operand::Type::reg);
+    if (!access || operand.value.size() != 2 || operand.value[1] != '+') { return std::nullopt; }
+    return AVR::get_register_number(operand.value[0]);
+  };
+  // the registers a line reads or writes, pointers it goes through included
+  const auto uses = [&](const AVR &line, const int reg) {
+    const bool pair = line.opcode == AVR::OpCode::movw || line.opcode == AVR::OpCode::adiw
+                      || line.opcode == AVR::OpCode::sbiw;
+    for (const auto *operand : { &line.operand1, &line.operand2 }) {
+      if (operand->type == AVR::Operand::Type::reg
+          && (operand->reg_num == reg || (pair && operand->reg_num + 1 == reg))) {
+        return true;
+      }
+      if (const auto pointer = pointer_of(*operand); pointer && (*pointer == reg || *pointer + 1 == reg)) {
         return true;
       }
+    }
+    // lpm without operands reads through Z
+    return line.opcode == AVR::OpCode::lpm && line.operand1.type == AVR::Operand::Type::empty
+           && (reg == 30 || reg == 31);
+  };
 
-      throw std::runtime_error("Don't know how to reorg this branch: " + instructions[op].to_string());
+  PointerWalk walk;
+  std::size_t end = label + 1;
+  for (; end < lines.size(); ++end) {
+    const auto &line = lines[end];
+    if (line.type == AVR::Type::Comment) { continue; }
+    if (line.type != AVR::Type::Instruction || is_skip(line.text)) { return std::nullopt; }
+    if (changes_flow(line.text)) { break; }
+
+    // Y is the index now, nothing else in the loop may go through a pointer
+    if (const auto pointer = walked_by(line); pointer) {
+      if (std::find(walk.pointers.begin(), walk.pointers.end(), *pointer) != walk.pointers.end()) {
+        return std::nullopt;
+      }
+      walk.pointers.push_back(*pointer);
+      walk.last_access = end;
+    } else if (line.opcode == AVR::OpCode::ld || line.opcode == AVR::OpCode::ldd || line.opcode == AVR::OpCode::st
+               || line.opcode == AVR::OpCode::std || line.opcode == AVR::OpCode::lpm) {
+      return std::nullopt;
     }
   }
-  return false;
-}
 
+  // it ends in a conditional branch back to the label
+  if (end == lines.size() || walk.pointers.empty() || !lines[end].text.starts_with("br")
+      || lines[end].operand1.symbol != symbol) {
+    return std::nullopt;
+  }
+  walk.length = end - label + 1;
+
+  const auto is = [](const AVR::Operand &operand, const int number) {
+    return operand.type == AVR::Operand::Type::reg && operand.reg_num == number;
+  };
+
+  // apart from the walk, the only pointer registers the loop may look at are the ones of the compared pointer, after
+  // every pointer moved on: its low byte in a cp / cpi, its high byte anywhere it is only read
+  for (auto index = label + 1; index < end; ++index) {
+    const auto &line = lines[index];
+    if (line.type != AVR::Type::Instruction) { continue; }
+
+    if (walked_by(line)) {
+      // the value a walk loads or stores can't be a pointer byte, that one is rebased or stands in for Y
+      const auto &value = line.opcode == AVR::OpCode::st ? line.operand2 : line.operand1;
+      for (const auto pointer : walk.pointers) {
+        if (is(value, pointer) || is(value, pointer + 1)) { return std::nullopt; }
+      }
+      continue;
+    }
+
+    for (const auto pointer : walk.pointers) {
+      if (!uses(line, pointer) && !uses(line, pointer + 1)) { continue; }
+
+      // compares only read, and the translation of cp / cpi starts with an lda of their first operand
+      const bool compare =
+        line.opcode == AVR::OpCode::cp || line.opcode == AVR::OpCode::cpc || line.opcode == AVR::OpCode::cpi;
+      const bool low_byte_as_y = !is(line.operand2, pointer)
+                                 && (!is(line.operand1, pointer) || line.opcode != AVR::OpCode::cpc);
+      if (index < walk.last_access || !compare || !low_byte_as_y || (walk.compared && walk.compared != pointer)) {
+        return std::nullopt;
+      }
+      walk.compared = pointer;
+    }
+  }
+
+  // ld / st leave the flags alone, so avr-gcc may set the ones the branch tests before the last access, where the iny
+  // that moves Y on would overwrite them
+  if (std::none_of(std::next(lines.begin(), static_cast<std::ptrdiff_t>(walk.last_access + 1)),
+        std::next(lines.begin(), static_cast<std::ptrdiff_t>(end)),
+        [](const AVR &line) { return line.type == AVR::Type::Instruction && sets_flags(line.text); })) {
+    return std::nullopt;
+  }
 
-std::vector<mos6502> run(const Personality &personality, std::istream &input, const bool do_optimize)
+  // the flags after the loop are the ones of its last compare, the pointers are put back together with an adc
+  if (walk.pointers.size() > 1 || !walk.compared) {
+    for (auto index = end + 1; index < lines.size(); ++index) {
+      if (lines[index].type == AVR::Type::Comment) { continue; }
+      if (lines[index].type == AVR::Type::Instruction && lines[index].text.starts_with("br")) { return std::nullopt; }
+      break;
+    }
+  }
+
+  return walk;
+}
+
+void emit_pointer_walk(const Personality &personality,
+  const std::vector<AVR> &lines,
+  const std::size_t label,
+  const PointerWalk &walk,
+  std::vector<mos6502> &instructions)
 {
-  std::regex Comment(R"(\s*(\#|;)(.*))");
-  std::regex Label(R"(^\s*(\S+):.*)");
-  std::regex Directive(R"(^\s*(\..+))");
-  std::regex UnaryInstruction(R"(^\s+(\S+)\s+(\S+).*)");
-  std::regex BinaryInstruction(R"(^\s+(\S+)\s+(\S+),\s*(\S+).*)");
-  std::regex Instruction(R"(^\s+(\S+).*)");
+  const auto reg      = [&](const int number) { return personality.get_register(number); };
+  const auto indirect = [&](const int pointer) {
+    return Operand(Operand::Type::literal, Operand::AddressingMode::indirect_y, reg(pointer).symbol);
+  };
+  const auto literal = [](const std::string &text) { return Operand(Operand::Type::literal, text); };
+  const auto comment = [&](const std::size_t first, const std::string_view text) {
+    for (auto index = first; index < instructions.size(); ++index) { instructions[index].comment = text; }
+  };
+
+  // every pointer becomes pointer - Y, Y starts at the compared pointer's low byte or at 0
+  const auto setup = instructions.size();
+  if (walk.compared) {
+    for (const auto pointer : walk.pointers) {
+      if (pointer == *walk.compared) { continue; }
+      instructions.emplace_back(mos6502::OpCode::lda, reg(pointer));
+      instructions.emplace_back(mos6502::OpCode::sec);
+      instructions.emplace_back(mos6502::OpCode::sbc, reg(*walk.compared));
+      instructions.emplace_back(mos6502::OpCode::sta, reg(pointer));
+      instructions.emplace_back(mos6502::OpCode::lda, reg(pointer + 1));
+      instructions.emplace_back(mos6502::OpCode::sbc, literal("#0"));
+      instructions.emplace_back(mos6502::OpCode::sta, reg(pointer + 1));
+    }
+    instructions.emplace_back(mos6502::OpCode::ldy, reg(*walk.compared));
+    instructions.emplace_back(mos6502::OpCode::lda, literal("#0"));
+    instructions.emplace_back(mos6502::OpCode::sta, reg(*walk.compared));
+  } else {
+    instructions.emplace_back(mos6502::OpCode::ldy, literal("#0"));
+  }
+  comment(setup, "pointer walk: index the pointers with Y");
+
+  const auto end = label + walk.length - 1;
+  FlagKeeper flags;
+  to_mos6502(personality, lines[label], instructions);
+  for (auto index = label + 1; index <= end; ++index) {
+    const auto &line  = lines[index];
+    const auto  first = instructions.size();
+    auto        text  = line.line_text;
+    if (text.starts_with('\t')) { text.remove_prefix(1); }
+
+    if (line.type == AVR::Type::Instruction && line.opcode == AVR::OpCode::st
+        && line.operand1.value.ends_with('+')) {
+      const auto value = line.operand2.value == "__zero_reg__" ? 1 : line.operand2.reg_num;
+      instructions.emplace_back(mos6502::OpCode::lda, reg(value));
+      instructions.emplace_back(mos6502::OpCode::sta, indirect(AVR::get_register_number(line.operand1.value[0])));
+      comment(first, text);
+    } else if (line.type == AVR::Type::Instruction
+               && (line.opcode == AVR::OpCode::ld || line.opcode == AVR::OpCode::lpm)) {
+      instructions.emplace_back(mos6502::OpCode::lda, indirect(AVR::get_register_number(line.operand2.value[0])));
+      instructions.emplace_back(mos6502::OpCode::sta, reg(line.operand1.reg_num));
+      comment(first, text);
+    } else {
+      flags.before(lines, index, instructions);
+      to_mos6502(personality, line, instructions);
+      flags.after(lines, index, instructions);
+      // Y is the compared pointer's low byte
+      if (walk.compared && line.type == AVR::Type::Instruction && line.operand1.reg_num == *walk.compared
+          && (line.opcode == AVR::OpCode::cp || line.opcode == AVR::OpCode::cpi)) {
+        instructions[first] = mos6502(mos6502::OpCode::tya);
+        instructions[first].comment = text;
+      }
+    }
+
+    // after the last access every pointer moves on at once
+    if (index == walk.last_access) {
+      const auto step = instructions.size();
+      const auto next = fmt::format("pointer_walk_{}", step);
+      instructions.emplace_back(mos6502::OpCode::iny);
+      instructions.emplace_back(mos6502::OpCode::bne, literal(next));
+      for (const auto pointer : walk.pointers) { instructions.emplace_back(mos6502::OpCode::inc, reg(pointer + 1)); }
+      instructions.emplace_back(ASMLine::Type::Label, next);
+      comment(step, "pointer walk: next element");
+    }
+  }
 
+  // and back to pointers that point where the AVR ones do, without touching the flags when that is possible
+  const auto restore = instructions.size();
+  for (const auto pointer : walk.pointers) {
+    if (pointer == walk.compared) {
+      instructions.emplace_back(mos6502::OpCode::sty, reg(pointer));
+      continue;
+    }
+    const auto done = fmt::format("pointer_walk_{}", instructions.size());
+    instructions.emplace_back(mos6502::OpCode::tya);
+    instructions.emplace_back(mos6502::OpCode::clc);
+    instructions.emplace_back(mos6502::OpCode::adc, reg(pointer));
+    instructions.emplace_back(mos6502::OpCode::sta, reg(pointer));
+    instructions.emplace_back(mos6502::OpCode::bcc, literal(done));
+    instructions.emplace_back(mos6502::OpCode::inc, reg(pointer + 1));
+    instructions.emplace_back(ASMLine::Type::Label, done);
+  }
+  comment(restore, "pointer walk: the pointers as the AVR code left them");
+}
+
+
+std::vector<mos6502> run(const Personality &personality,
+  const std::string_view source,
+  const bool do_optimize,
+  Annotations &annotations,
+  const Linkage &linkage = {})
+{
   std::size_t lineno = 0;
 
 
   std::vector<AVR> instructions;
+  instructions.reserve(static_cast<std::size_t>(std::count(source.begin(), source.end(), '\n')) + 1);
 
-  const auto parse_line = [&](const auto &line) {
+  const auto parse_line = [&](const std::string_view line) {
     try {
-      std::smatch match;
-      if (std::regex_match(line, match, Label)) {
-        instructions.emplace_back(lineno, line, ASMLine::Type::Label, match[1].str());
-      } else if (std::regex_match(line, match, Comment)) {
-        // save comments!
-        instructions.emplace_back(lineno, line, ASMLine::Type::Directive, "; " + match[2].str());
-      } else if (std::regex_match(line, match, Directive)) {
-        instructions.emplace_back(lineno, line, ASMLine::Type::Directive, match[1].str());
-      } else if (std::regex_match(line, match, BinaryInstruction)) {
-        instructions.emplace_back(
-          lineno, line, ASMLine::Type::Instruction, match[1].str(), match[2].str(), match[3].str());
-      } else if (std::regex_match(line, match, UnaryInstruction)) {
-        instructions.emplace_back(lineno, line, ASMLine::Type::Instruction, match[1].str(), match[2].str());
-      } else if (std::regex_match(line, match, Instruction)) {
-        instructions.emplace_back(lineno, line, ASMLine::Type::Instruction, match[1].str());
-      } else if (line.empty()) {
-        // skip empty lines
+      if (const auto lexed = lex_line(line); lexed) {
+        instructions.emplace_back(lineno, line, lexed->type, lexed->text, lexed->operand1, lexed->operand2);
       }
     } catch (const std::exception &e) {
       spdlog::error("[{}]: parse exception with '{}': {}", lineno, line, e.what());
@@ -1109,70 +1438,60 @@ std::vector<mos6502> run(const Personality &personality, std::istream &input, co
     ++lineno;
   };
 
-  const auto parse_stream = [&](auto &stream) {
-    while (stream.good()) {
-      std::string line;
-      getline(stream, line);
-      parse_line(line);
+  // the AVR records are views into the source, nothing is copied out of it
+  const auto parse_source = [&](std::string_view remaining) {
+    while (true) {
+      const auto end_of_line = remaining.find('\n');
+      parse_line(remaining.substr(0, end_of_line));
+      if (end_of_line == std::string_view::npos) { break; }
+      remaining.remove_prefix(end_of_line + 1);
     }
   };
 
-  const auto parse_string = [&](const auto &string) {
-    std::stringstream ss{ std::string(string) };
-    parse_stream(ss);
-  };
-
-  parse_stream(input);
-
-  const bool needs_mulhi3 = std::any_of(begin(instructions), end(instructions), [](const AVR &instruction) {
-    return instruction.line_text.find("__mulhi3") != std::string::npos;
-  });
-  const bool needs_mulqi3 = std::any_of(begin(instructions), end(instructions), [](const AVR &instruction) {
-    return instruction.line_text.find("__mulqi3") != std::string::npos;
-  });
+  parse_source(source);
 
-  if (needs_mulhi3) { parse_string(__mulhi3); }
-  if (needs_mulqi3) { parse_string(__mulqi3); }
-
-  std::set<std::string> labels;
+  std::unordered_set<SymbolId> labels;
 
   for (const auto &i : instructions) {
-    if (i.type == ASMLine::Type::Label) { labels.insert(i.text); }
+    if (i.type == AVR::Type::Label) { labels.insert(symbols().intern(i.text)); }
   }
 
-  std::set<std::string> used_labels{ "main" };
+  std::unordered_set<SymbolId> used_labels{ symbols().intern("main") };
+
+  // local labels start with a '.', the other ones may be called by another translation unit
+  if (linkage.keeps_global_labels) {
+    for (const auto &label : labels) {
+      if (!symbols().name(label).starts_with('.')) { used_labels.insert(label); }
+    }
+  }
 
   for (const auto &i : instructions) {
-    const auto check_label = [&](const std::string &value) {
-      if (labels.count(value) != 0) { used_labels.insert(value); }
+    const auto check_label = [&](const SymbolId symbol) {
+      if (labels.count(symbol) != 0) { used_labels.insert(symbol); }
     };
 
-    if (i.type == ASMLine::Type::Instruction) {
-
-      check_label(i.operand1.value);
-      check_label(i.operand2.value);
-      check_label(std::string{ strip_gs(strip_offset(strip_negate(strip_lo_hi(i.operand1.value)))) });
-      check_label(std::string{ strip_gs(strip_offset(strip_negate(strip_lo_hi(i.operand2.value)))) });
-
-
-    } else if (i.type == ASMLine::Type::Directive) {
+    if (i.type == AVR::Type::Instruction) {
+      check_label(i.operand1.symbol);
+      check_label(i.operand2.symbol);
+    } else if (i.type == AVR::Type::Directive) {
       const auto matcher = ctre::match<R"(\s*.word\s*(.*))">;
 
       if (const auto results = matcher(i.text); results) {
-        const auto matched_gs = results.get<1>().to_string();
+        const std::string_view matched_gs = results.get<1>();
         spdlog::trace("matched .word: '{}' from '{}'", matched_gs, i.text);
-        check_label(std::string{ strip_gs(matched_gs) });
+        check_label(symbols().intern(strip_call(matched_gs, "gs")));
       }
     }
   }
 
   const auto new_labels = [&used_labels]() {
-    std::map<std::string, std::string> result;
+    std::unordered_map<SymbolId, SymbolId> result;
     for (const auto &l : used_labels) {
 
-      const auto new_label = [](auto label) -> std::string {
-        if (label[0] == '.') { label.erase(0, 1); }
+      const auto new_label = [](std::string_view view) -> std::string {
+        if (view.starts_with('.')) { view.remove_prefix(1); }
 
+        std::string label{ view };
         for (auto &c : label) {
           if (c == '.') { c = '_'; }
         }
@@ -1180,94 +1499,112 @@ std::vector<mos6502> run(const Personality &personality, std::istream &input, co
         return label;
       };
 
-      result.emplace(std::make_pair(l, new_label(l)));
+      result.emplace(l, symbols().intern(new_label(symbols().name(l))));
     }
     return result;
   }();
 
-  for (const auto &label : new_labels) { spdlog::trace("used label: '{}':'{}'", label.first, label.second); }
+  for (const auto &label : new_labels) {
+    spdlog::trace("used label: '{}':'{}'", symbols().name(label.first), symbols().name(label.second));
+  }
+
+  // only text that had a label renamed inside of it needs storage of its own, everything else stays a view
+  std::deque<std::string> renamed_text;
+  const auto rename = [&](std::string text) -> std::string_view { return renamed_text.emplace_back(std::move(text)); };
+
+  const auto rename_operand = [&](AVR::Operand &operand) {
+    if (const auto new_label = new_labels.find(operand.symbol); new_label != new_labels.end()) {
+      operand.symbol = new_label->second;
+    }
+  };
 
   for (auto &i : instructions) {
-    if (i.type == ASMLine::Type::Label) {
+    if (i.type == AVR::Type::Label) {
       if (i.text == "0") {
         i.text = "-memcpy_0";
       } else if (i.text == "1") {
         i.text = "-mul2_1";
+      } else if (const auto new_label = new_labels.find(symbols().intern(i.text)); new_label != new_labels.end()) {
+        i.text = symbols().name(new_label->second);
       } else {
-        try {
-          i.text = new_labels.at(i.text);
-        } catch (...) {
-          spdlog::warn("Unused label: '{}', consider making function static until we remove unused functions", i.text);
-          i.text = "; Label is unused: " + i.text;
-        }
+        spdlog::warn("Unused label: '{}', consider making function static until we remove unused functions", i.text);
+        i.text = rename(fmt::format("; Label is unused: {}", i.text));
       }
     }
 
-    if (i.type == ASMLine::Type::Directive) {
+    if (i.type == AVR::Type::Directive) {
       const auto matcher = ctre::match<R"(\s*.word\s*(.*))">;
 
       if (const auto results = matcher(i.text); results) {
-        const auto matched_gs = results.get<1>().to_string();
-        const auto possible_label = std::string{ strip_gs(matched_gs) };
+        const std::string_view matched_gs = results.get<1>();
+        const auto possible_label = symbols().intern(strip_call(matched_gs, "gs"));
         const auto matched_label = new_labels.find(possible_label);
-        if (matched_label != new_labels.end()) { i.text = ".word " + matched_label->second; }
-      }
-    }
-
-    if (i.operand2.value.starts_with("lo8(") || i.operand2.value.starts_with("hi8(")) {
-      const auto lo_hi_operand = strip_lo_hi(i.operand2.value);
-      const auto label_matcher = ctre::match<R"(-?\(?([A-Za-z0-9.]+).*)">;
-
-      if (const auto results = label_matcher(lo_hi_operand); results) {
-        std::string_view potential_label = results.get<1>();
-        const auto start = std::distance(std::string_view{ i.operand2.value }.begin(), potential_label.begin());
-        spdlog::trace("Label matched: '{}'", potential_label);
-        const auto itr1 = new_labels.find(std::string{ potential_label });
-        if (itr1 != new_labels.end()) {
-          i.operand2.value.replace(static_cast<std::size_t>(start), potential_label.size(), itr1->second);
+        if (matched_label != new_labels.end()) {
+          i.text = rename(fmt::format(".word {}", symbols().name(matched_label->second)));
         }
-        spdlog::trace("New statement: '{}'", i.operand2.value);
       }
     }
 
-    if (const auto plus = i.operand1.value.find('+'); plus != std::string::npos) {
-      const auto str = i.operand1.value.substr(0, plus);
-      const auto itr1 = new_labels.find(str);
-      if (itr1 != new_labels.end()) { i.operand1.value.replace(0, plus, itr1->second); }
-    }
-
-    if (const auto plus = i.operand2.value.find('+'); plus != std::string::npos) {
-      const auto str = i.operand2.value.substr(0, plus);
-      const auto itr1 = new_labels.find(str);
-      if (itr1 != new_labels.end()) { i.operand2.value.replace(0, plus, itr1->second); }
-    }
+    rename_operand(i.operand1);
+    rename_operand(i.operand2);
+  }
 
-    const auto itr1 = new_labels.find(i.operand1.value);
-    if (itr1 != new_labels.end()) { i.operand1.value = itr1->second; }
 
-    const auto itr2 = new_labels.find(i.operand2.value);
-    if (itr2 != new_labels.end()) { i.operand2.value = itr2->second; }
+  // how often every label is branched to, called or stored in a .word
+  std::unordered_map<SymbolId, int> label_references;
+  for (const auto &i : instructions) {
+    if (i.type == AVR::Type::Instruction) {
+      ++label_references[i.operand1.symbol];
+      ++label_references[i.operand2.symbol];
+    } else if (i.type == AVR::Type::Directive) {
+      // a jump table entry is a way into the code at the label too
+      const auto matcher = ctre::match<R"(\s*.word\s*(.*))">;
+      if (const auto results = matcher(i.text); results) {
+        ++label_references[symbols().intern(strip_call(results.get<1>(), "gs"))];
+      }
+    }
   }
 
-
   std::vector<mos6502> new_instructions;
 
-  personality.insert_autostart_sequence(new_instructions);
-  // set __zero_reg__ (reg 1 on AVR) to 0
-  new_instructions.emplace_back(mos6502::OpCode::lda, Operand(Operand::Type::literal, "#$00"));
-  new_instructions.emplace_back(mos6502::OpCode::sta, personality.get_register(1));
-  new_instructions.emplace_back(mos6502::OpCode::jmp, Operand(Operand::Type::literal, "main"));
+  if (linkage.starts_program) {
+    personality.insert_autostart_sequence(new_instructions);
+    // set __zero_reg__ (reg 1 on AVR) to 0
+    new_instructions.emplace_back(mos6502::OpCode::lda, Operand(Operand::Type::literal, "#$00"));
+    new_instructions.emplace_back(mos6502::OpCode::sta, personality.get_register(1));
+    new_instructions.emplace_back(mos6502::OpCode::jmp, Operand(Operand::Type::literal, "main"));
+  }
 
 
   int instructions_to_skip = -1;
   std::string next_label_name;
-  for (const auto &i : instructions) {
+  FlagKeeper flags;
+  for (std::size_t index = 0; index < instructions.size(); ++index) {
+    const auto &i = instructions[index];
+
+    // a memcpy / memset loop or a pointer walk is translated as a whole, unless a skip is still counting the lines
+    // after it
+    if (instructions_to_skip < 0) {
+      if (const auto loop = match_block_loop(instructions, index); loop) {
+        emit_block_loop(personality, *loop, new_instructions);
+        index += loop->length - 1;
+        continue;
+      }
+      if (const auto walk = match_pointer_walk(instructions, index, label_references); walk) {
+        emit_pointer_walk(personality, instructions, index, *walk, new_instructions);
+        index += walk->length - 1;
+        continue;
+      }
+    }
+
+    if (instructions_to_skip < 0) { flags.before(instructions, index, new_instructions); }
     to_mos6502(personality, i, new_instructions);
+    flags.after(instructions, index, new_instructions);
 
     // intentionally copy so we don't invalidate the reference
     const auto last_instruction = new_instructions.back();
 
-    if (i.type == ASMLine::Type::Instruction) { --instructions_to_skip; }
+    if (i.type == AVR::Type::Instruction) { --instructions_to_skip; }
     if (instructions_to_skip == 0) {
       new_instructions.emplace_back(ASMLine::Type::Label, next_label_name);
       // todo: I kind of hate this -1 as a marker
@@ -1292,26 +1629,38 @@ std::vector<mos6502> run(const Personality &personality, std::istream &input, co
   if (do_optimize) {
     spdlog::info("Running optimization passes");
 
-    int count = 0;
+    const auto start = std::chrono::steady_clock::now();
+    const auto statistics = optimize(new_instructions, personality, annotations);
+    const auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
 
-    while (optimize(new_instructions, personality)) {
-      // do it however many times it takes
-      ++count;
-    }
-
-    spdlog::info("Optimization passes run: {}", count);
+    spdlog::info("Optimization rewrites: {} in {} block sweeps and {} liveness passes, {:.3f}ms",
+      statistics.rewrites,
+      statistics.block_sweeps,
+      statistics.liveness_passes,
+      elapsed.count());
   } else {
     spdlog::info("Optimization passes disabled");
   }
 
-  int branch_patch_count = 0;
-  while (fix_long_branches(new_instructions, branch_patch_count)) {
-    // do it however many times it takes
+  // the runtime is written for the 6502 already, the optimizer has nothing to do in it
+  if (linkage.pulls_in_runtime) {
+    append_runtime(personality, runtime_needs(source), linkage.multiply, new_instructions);
   }
 
+  const auto branches_widened = fix_long_branches(new_instructions);
+  spdlog::info("Long branches widened: {}", branches_widened);
+
   return new_instructions;
 }
 
+// written by the build from `git describe` and a hash of the sources, cached translations from any other build of the
+// translator are not reused. A build that doesn't write it has no version and doesn't use the cache.
+#if __has_include("translator_version.hpp")
+#include "translator_version.hpp"
+#else
+#define TRANSLATOR_VERSION ""
+#endif
+
 enum struct Target { C64, X16 };
 
 int main(const int argc, const char **argv)
@@ -1320,11 +1669,11 @@ int main(const int argc, const char **argv)
   const std::map<std::string, Target> targets{ { "C64", Target::C64 }, { "X16", Target::X16 }  };
   CLI::App app{ "C++ Compiler for 6502 processors" };
 
-  std::filesystem::path filename{};
+  std::vector<std::filesystem::path> filenames{};
   Target target{ Target::C64 };
   bool optimize{ true };
 
-  app.add_option("filename", filename, "C++ file to compile")->required(true);
+  app.add_option("filenames", filenames, "C++ files to compile and link into one program")->required(true);
   app.add_option("-t,--target", target, "6502 - based system to target")
     ->required(true)
     ->transform(CLI::CheckedTransformer(targets, CLI::ignore_case));
@@ -1337,6 +1686,40 @@ int main(const int argc, const char **argv)
 
   app.add_flag("--optimize", optimize, "Enable optimization of 6502 generated assembly")->default_val(true);
 
+  Annotations annotations;
+  app.add_flag("--annotate", annotations.enabled, "Note what the optimizer removed in the 6502 generated assembly")
+    ->default_val(false);
+
+  bool cost_report_requested{ false };
+  app.add_flag("--cost-report", cost_report_requested, "Print the static cycles and bytes per function, block and line")
+    ->default_val(false);
+
+  bool listing_requested{ false };
+  app.add_flag("--listing", listing_requested, "Write a listing of the addresses and bytes of every line")
+    ->default_val(false);
+
+  bool xa_cross_check{ false };
+  app.add_flag("--xa", xa_cross_check, "Also assemble with xa and check that it produces the same program")
+    ->default_val(false);
+
+  MultiplyMode multiply{ MultiplyMode::fast };
+  const std::map<std::string, MultiplyMode> multiply_modes{ { "fast", MultiplyMode::fast },
+    { "compact", MultiplyMode::compact } };
+  app
+    .add_option(
+      "--multiply", multiply, "Quarter square tables (fast) or shift and add (compact) for __mulqi3 / __mulhi3")
+    ->transform(CLI::CheckedTransformer(multiply_modes, CLI::ignore_case));
+
+  std::filesystem::path cache_directory{};
+  app.add_option("--cache-dir", cache_directory, "Reuse translations of the same AVR assembly stored in this directory");
+
+  bool save_temps{ false };
+  app.add_flag("--save-temps", save_temps, "Keep the AVR assembly generated by GCC")->default_val(false);
+
+  std::size_t jobs{ std::max(std::thread::hardware_concurrency(), 1u) };
+  app.add_option("-j,--jobs", jobs, "How many files to compile and translate at the same time")
+    ->check(CLI::PositiveNumber);
+
   std::vector<std::string> include_paths;
   app.add_option("-I", include_paths, "Extra include paths to pass to GCC instance")
     ->required(false)
@@ -1355,9 +1738,12 @@ int main(const int argc, const char **argv)
     return std::filesystem::current_path() / input_filename.filename();
   };
 
-  const auto avr_output_file = make_output_file_name(filename, "avr.asm");
+  // the program is named after the first file
+  const auto &filename = filenames.front();
   const auto mos6502_output_file = make_output_file_name(filename, "6502.asm");
   const auto program_output_file = make_output_file_name(filename, "prg");
+  const auto listing_output_file = make_output_file_name(filename, "lst");
+  const auto xa_output_file = make_output_file_name(filename, "xa.prg");
 
   std::string disabled_optimizations;
   /*
@@ -1378,59 +1764,166 @@ int main(const int argc, const char **argv)
     disabled_optimizations += " -fno-version-loops-for-strides";
     */
 
-  const std::string gcc_command = fmt::format(
-    "avr-gcc -fverbose-asm -c -o {outfile} -S {warning_flags} -std=c++20 -mtiny-stack -fconstexpr-ops-limit=333554432 "
-    "-mmcu={avr} -O{optimization} {disabled_optimizations} -I {user_include_dirs} {infile}",
-    fmt::arg("outfile", avr_output_file.generic_string()),
-    fmt::arg("warning_flags", warning_flags),
-    fmt::arg("avr", avr),
-    fmt::arg("optimization", optimization_level),
-    fmt::arg("user_include_dirs", fmt::join(include_paths, " -I ")),
-    fmt::arg("disabled_optimizations", disabled_optimizations),
-    fmt::arg("infile", filename.generic_string()));
+  const auto gcc_command = [&](const std::filesystem::path &infile) {
+    return fmt::format(
+      "avr-gcc -fverbose-asm -c -o - -S {warning_flags} -std=c++20 -mtiny-stack -fconstexpr-ops-limit=333554432 "
+      "-mmcu={avr} -O{optimization} {disabled_optimizations} -I {user_include_dirs} {infile}",
+      fmt::arg("warning_flags", warning_flags),
+      fmt::arg("avr", avr),
+      fmt::arg("optimization", optimization_level),
+      fmt::arg("user_include_dirs", fmt::join(include_paths, " -I ")),
+      fmt::arg("disabled_optimizations", disabled_optimizations),
+      fmt::arg("infile", infile.generic_string()));
+  };
 
-  spdlog::info("Executing gcc: `{}`", gcc_command);
+  // the assembly comes back through a pipe, it only touches the disk with --save-temps
+  std::vector<CommandOutput> gcc_outputs(filenames.size());
+  parallel_for(filenames.size(), jobs, [&](const std::size_t file) {
+    const auto command = gcc_command(filenames[file]);
+    spdlog::info("Executing gcc: `{}`", command);
+    gcc_outputs[file] = read_command_output(command);
+
+    if (save_temps) {
+      std::ofstream avr_output(
+        make_output_file_name(filenames[file], "avr.asm"), std::ofstream::trunc | std::ofstream::binary);
+      avr_output << gcc_outputs[file].text;
+    }
+  });
 
-  const auto result = std::system(gcc_command.c_str());
+  for (std::size_t file = 0; file < filenames.size(); ++file) {
+    if (gcc_outputs[file].status != EXIT_SUCCESS) {
+      spdlog::critical("compile of {} failed", filenames[file].string());
+      return EXIT_FAILURE;
+    }
+  }
 
-  if (result != EXIT_SUCCESS) {
-    spdlog::critical("compile failed");
-    return result;
+  // the listing and the cost report need the instructions, which aren't kept in the cache
+  std::optional<TranslationCache> cache;
+  if (!cache_directory.empty() && !listing_requested && !cost_report_requested) {
+    if (std::string_view{ TRANSLATOR_VERSION }.empty()) {
+      spdlog::warn("Translation cache disabled, this build of the translator has no version to key it on");
+    } else {
+      cache.emplace(cache_directory);
+    }
   }
 
+  std::vector<std::string_view> cache_inputs{ target == Target::C64 ? "C64" : "X16",
+    optimize ? "optimize" : "",
+    annotations.enabled ? "annotate" : "",
+    multiply == MultiplyMode::fast ? "fast multiply" : "compact multiply",
+    TRANSLATOR_VERSION };
+  for (const auto &gcc_output : gcc_outputs) { cache_inputs.push_back(gcc_output.text); }
+  const auto cache_key = TranslationCache::key(cache_inputs);
 
-  std::ifstream input(avr_output_file);
+  auto translation = cache ? cache->load(cache_key) : std::nullopt;
 
+  if (!translation) {
+    const auto start = std::chrono::steady_clock::now();
 
+    const auto translate = [&](const std::string_view source, Annotations &unit_annotations, const Linkage &linkage) {
+      switch (target) {
+      case Target::C64: return run(C64{}, source, optimize, unit_annotations, linkage);
+      case Target::X16: return run(X16{}, source, optimize, unit_annotations, linkage);
+      default: spdlog::critical("Unhandled target type"); return std::vector<mos6502>{};
+      }
+    };
 
-  const auto new_instructions = [&]() {
-    switch (target) {
-      case Target::C64: 
-        return run(C64{}, input, optimize);
-      case Target::X16:
-        return run(X16{}, input, optimize);
-      default:
-        spdlog::critical("Unhandled target type");
-        return std::vector<mos6502>{};
+    auto new_instructions = [&]() {
+      if (filenames.size() == 1) {
+        return translate(gcc_outputs.front().text, annotations, Linkage{ true, true, false, multiply });
+      }
+
+      // every file is translated on its own, then the runtime they need is added once for all of them
+      std::vector<TranslatedUnit> units(filenames.size() + 1);
+      parallel_for(filenames.size(), jobs, [&](const std::size_t unit) {
+        units[unit].annotations.enabled = annotations.enabled;
+        units[unit].instructions =
+          translate(gcc_outputs[unit].text, units[unit].annotations, Linkage{ unit == 0, false, true, multiply });
+      });
+
+      RuntimeNeeds needs;
+      for (const auto &gcc_output : gcc_outputs) { needs |= runtime_needs(gcc_output.text); }
+      switch (target) {
+      case Target::C64: append_runtime(C64{}, needs, multiply, units.back().instructions); break;
+      case Target::X16: append_runtime(X16{}, needs, multiply, units.back().instructions); break;
+      default: spdlog::critical("Unhandled target type"); break;
+      }
+
+      return link_units(units, annotations);
+    }();
+
+    if (optimize) {
+      const auto reclaimed = remove_unreachable_code(new_instructions);
+      spdlog::info("Unreachable functions and data removed: {} regions, {} bytes", reclaimed.regions, reclaimed.bytes);
     }
-  }();
+
+    if (cost_report_requested) { std::cout << cost_report(new_instructions); }
+
+    auto assembled = [&] {
+      try {
+        return Assembler::assemble(new_instructions, listing_requested);
+      } catch (const std::exception &e) {
+        spdlog::critical("assembly failed: {}", e.what());
+        return AssembledProgram{};
+      }
+    }();
+
+    if (assembled.bytes.empty()) { return EXIT_FAILURE; }
+
+    if (listing_requested) {
+      std::ofstream listing_output(listing_output_file, std::ofstream::trunc);
+      for (const auto &line : assembled.listing) { listing_output << line << '\n'; }
+    }
+
+    translation = TranslationCache::Entry{ {}, std::move(assembled.bytes), 0 };
+    for (const auto &i : new_instructions) {
+      if (i.annotation != 0) { translation->assembly += annotations.notes[i.annotation - 1] + '\n'; }
+      translation->assembly += i.to_string() + '\n';
+    }
+    translation->translate_ms =
+      std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    if (cache) { cache->store(cache_key, *translation); }
+  }
+
+  if (cache) { cache->log_statistics(); }
 
   {
     // make sure file is closed before we try to re-open it with xa
-    std::ofstream mos6502_output(mos6502_output_file, std::ofstream::trunc);
-    for (const auto &i : new_instructions) { mos6502_output << i.to_string() << '\n'; }
+    std::ofstream mos6502_output(mos6502_output_file, std::ofstream::trunc | std::ofstream::binary);
+    mos6502_output << translation->assembly;
+  }
+
+  {
+    std::ofstream program_output(program_output_file, std::ofstream::trunc | std::ofstream::binary);
+    program_output.write(reinterpret_cast<const char *>(translation->program.data()),
+      static_cast<std::streamsize>(translation->program.size()));
   }
 
-  const std::string xa_command = fmt::format("xa -O PETSCREEN -M -o {outfile} {infile}",
-    fmt::arg("infile", mos6502_output_file.generic_string()),
-    fmt::arg("outfile", program_output_file.generic_string()));
+  if (xa_cross_check) {
+    const std::string xa_command = fmt::format("xa -O PETSCREEN -M -o {outfile} {infile}",
+      fmt::arg("infile", mos6502_output_file.generic_string()),
+      fmt::arg("outfile", xa_output_file.generic_string()));
 
-  spdlog::info("Executing xa: `{}`", xa_command);
+    spdlog::info("Executing xa: `{}`", xa_command);
 
-  const auto xa_result = std::system(xa_command.c_str());
+    if (std::system(xa_command.c_str()) != EXIT_SUCCESS) {
+      spdlog::critical("xa assembly failed");
+      return EXIT_FAILURE;
+    }
 
-  if (xa_result != EXIT_SUCCESS) {
-    spdlog::critical("assembly failed");
-    return result;
+    std::ifstream                   xa_stream(xa_output_file, std::ios::binary);
+    const std::vector<std::uint8_t> xa_bytes{ std::istreambuf_iterator<char>(xa_stream),
+      std::istreambuf_iterator<char>() };
+
+    const auto &program = translation->program;
+    if (xa_bytes != program) {
+      const auto mismatch = std::mismatch(xa_bytes.begin(), xa_bytes.end(), program.begin(), program.end());
+      spdlog::critical("xa and the built-in assembler disagree at byte {} ({} vs {} bytes)",
+        std::distance(xa_bytes.begin(), mismatch.first),
+        xa_bytes.size(),
+        program.size());
+      return EXIT_FAILURE;
+    }
   }
 }
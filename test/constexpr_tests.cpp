@@ -1,5 +1,10 @@
 #include <catch2/catch.hpp>
 
+#include "include/assembler.hpp"
+#include "include/avr.hpp"
+#include "include/cost.hpp"
+#include "include/lexer.hpp"
+
 constexpr unsigned int Factorial(unsigned int number)
 {
   return number <= 1 ? number : Factorial(number - 1) * number;
@@ -12,3 +17,113 @@ TEST_CASE("Factorials are computed with constexpr", "[factorial]")
   STATIC_REQUIRE(Factorial(3) == 6);
   STATIC_REQUIRE(Factorial(10) == 3628800);
 }
+
+constexpr bool lexes_as(const std::string_view line,
+  const LexedLine::Type type,
+  const std::string_view text,
+  const std::string_view operand1 = {},
+  const std::string_view operand2 = {})
+{
+  const auto lexed = lex_line(line);
+  return lexed && lexed->type == type && lexed->text == text && lexed->operand1 == operand1
+         && lexed->operand2 == operand2;
+}
+
+TEST_CASE("avr-gcc lines are classified", "[lexer]")
+{
+  STATIC_REQUIRE(lexes_as("main:", LexedLine::Type::Label, "main"));
+  STATIC_REQUIRE(lexes_as(".L2:", LexedLine::Type::Label, ".L2"));
+  STATIC_REQUIRE(lexes_as(" ; test.cpp:4: poke(1024, 10);", LexedLine::Type::Comment, " test.cpp:4: poke(1024, 10);"));
+  STATIC_REQUIRE(lexes_as("\t.string\t\"hello\"", LexedLine::Type::Directive, ".string\t\"hello\""));
+  STATIC_REQUIRE(lexes_as("\tret\t", LexedLine::Type::Instruction, "ret"));
+  STATIC_REQUIRE(lexes_as("\tbrne .L2\t\t ; ,", LexedLine::Type::Instruction, "brne", ".L2"));
+  STATIC_REQUIRE(lexes_as("\tldi r24,lo8(10)\t ;  tmp44,", LexedLine::Type::Instruction, "ldi", "r24", "lo8(10)"));
+  STATIC_REQUIRE(lexes_as("\tstd Y+1,r24", LexedLine::Type::Instruction, "std", "Y+1", "r24"));
+  STATIC_REQUIRE(lexes_as("\tmov r24, __temp_reg__", LexedLine::Type::Instruction, "mov", "r24", "__temp_reg__"));
+}
+
+TEST_CASE("unrecognized avr-gcc lines are skipped", "[lexer]")
+{
+  STATIC_REQUIRE(!lex_line(""));
+  STATIC_REQUIRE(!lex_line("\t"));
+  STATIC_REQUIRE(!lex_line("__SP_H__ = 0x3e"));
+  STATIC_REQUIRE(!lex_line("/* prologue: function */"));
+}
+
+constexpr bool every_mnemonic_round_trips()
+{
+  for (const auto &mnemonic : avr_mnemonics) {
+    if (mnemonic.opcode != AVR::OpCode::unknown && decode_avr_mnemonic(mnemonic.name) != mnemonic.opcode) {
+      return false;
+    }
+  }
+  return true;
+}
+
+TEST_CASE("AVR mnemonics are decoded", "[avr]")
+{
+  STATIC_REQUIRE(every_mnemonic_round_trips());
+  STATIC_REQUIRE(AVR::parse_opcode(AVR::Type::Instruction, "ldi") == AVR::OpCode::ldi);
+  STATIC_REQUIRE(AVR::parse_opcode(AVR::Type::Instruction, "or") == AVR::OpCode::OR);
+  STATIC_REQUIRE(AVR::parse_opcode(AVR::Type::Instruction, "movw") == AVR::OpCode::movw);
+  STATIC_REQUIRE(AVR::parse_opcode(AVR::Type::Label, "main") == AVR::OpCode::unknown);
+  STATIC_REQUIRE(decode_avr_mnemonic("") == AVR::OpCode::unknown);
+  STATIC_REQUIRE(decode_avr_mnemonic("ldx") == AVR::OpCode::unknown);
+  STATIC_REQUIRE(decode_avr_mnemonic("subiw") == AVR::OpCode::unknown);
+  STATIC_REQUIRE(to_string(AVR::OpCode::sbci) == "sbci");
+}
+
+constexpr bool parses_as(const std::string_view operand,
+  const Operand::Modifier modifier,
+  const bool negated,
+  const std::string_view symbol,
+  const int offset = 0)
+{
+  const auto expression = parse_avr_expression(operand);
+  return expression.modifier == modifier && expression.negated == negated && expression.symbol == symbol
+         && expression.offset == offset;
+}
+
+TEST_CASE("AVR operand expressions are decoded", "[avr]")
+{
+  STATIC_REQUIRE(parses_as(".L2", Operand::Modifier::none, false, ".L2"));
+  STATIC_REQUIRE(parses_as("-1", Operand::Modifier::none, false, "-1"));
+  STATIC_REQUIRE(parses_as("Y+1", Operand::Modifier::none, false, "Y", 1));
+  STATIC_REQUIRE(parses_as(".LC0-12", Operand::Modifier::none, false, ".LC0", -12));
+  STATIC_REQUIRE(parses_as("lo8(.LC0)", Operand::Modifier::lo, false, ".LC0"));
+  STATIC_REQUIRE(parses_as("hi8(gs(_ZL6handleh))", Operand::Modifier::hi, false, "_ZL6handleh"));
+  STATIC_REQUIRE(parses_as("lo8(-(table+2))", Operand::Modifier::lo, true, "table", 2));
+  STATIC_REQUIRE(parses_as("lo8(-(-1))", Operand::Modifier::lo, true, "-1"));
+}
+
+TEST_CASE("6502 instructions cost what the data sheet says", "[cost]")
+{
+  using Mode = Operand::AddressingMode;
+
+  STATIC_REQUIRE(instruction_cost(mos6502::OpCode::lda, Mode::immediate) == Cost{ 2, 2, 0 });
+  STATIC_REQUIRE(instruction_cost(mos6502::OpCode::lda, Mode::zero_page) == Cost{ 3, 2, 0 });
+  STATIC_REQUIRE(instruction_cost(mos6502::OpCode::lda, Mode::absolute) == Cost{ 4, 3, 0 });
+  STATIC_REQUIRE(instruction_cost(mos6502::OpCode::lda, Mode::indirect_y) == Cost{ 5, 2, 1 });
+  STATIC_REQUIRE(instruction_cost(mos6502::OpCode::sta, Mode::indirect_y) == Cost{ 6, 2, 0 });
+  STATIC_REQUIRE(instruction_cost(mos6502::OpCode::inc, Mode::zero_page) == Cost{ 5, 2, 0 });
+  STATIC_REQUIRE(instruction_cost(mos6502::OpCode::rol, Mode::accumulator) == Cost{ 2, 1, 0 });
+  STATIC_REQUIRE(instruction_cost(mos6502::OpCode::bne, Mode::relative) == Cost{ 2, 2, 2 });
+  STATIC_REQUIRE(instruction_cost(mos6502::OpCode::jmp, Mode::indirect) == Cost{ 5, 3, 0 });
+  STATIC_REQUIRE(instruction_cost(mos6502::OpCode::jsr, Mode::absolute) == Cost{ 6, 3, 0 });
+  STATIC_REQUIRE(instruction_cost(mos6502::OpCode::pla, Mode::implied) == Cost{ 4, 1, 0 });
+}
+
+TEST_CASE("6502 instructions are encoded with their opcode bytes", "[assembler]")
+{
+  using Mode = Operand::AddressingMode;
+
+  STATIC_REQUIRE(opcode_byte(mos6502::OpCode::lda, Mode::immediate) == std::uint8_t{ 0xA9 });
+  STATIC_REQUIRE(opcode_byte(mos6502::OpCode::lda, Mode::indirect_y) == std::uint8_t{ 0xB1 });
+  STATIC_REQUIRE(opcode_byte(mos6502::OpCode::sta, Mode::zero_page) == std::uint8_t{ 0x85 });
+  STATIC_REQUIRE(opcode_byte(mos6502::OpCode::rol, Mode::accumulator) == std::uint8_t{ 0x2A });
+  STATIC_REQUIRE(opcode_byte(mos6502::OpCode::bne, Mode::relative) == std::uint8_t{ 0xD0 });
+  STATIC_REQUIRE(opcode_byte(mos6502::OpCode::jmp, Mode::absolute) == std::uint8_t{ 0x4C });
+  STATIC_REQUIRE(opcode_byte(mos6502::OpCode::jmp, Mode::indirect) == std::uint8_t{ 0x6C });
+  STATIC_REQUIRE(opcode_byte(mos6502::OpCode::jsr, Mode::absolute) == std::uint8_t{ 0x20 });
+  STATIC_REQUIRE(!opcode_byte(mos6502::OpCode::sta, Mode::immediate));
+}
@@ -1,7 +1,20 @@
 #include <catch2/catch.hpp>
 
+#include <filesystem>
 #include <fmt/format.h>
 #include <fstream>
+#include <iterator>
+
+#include "include/assembler.hpp"
+#include "include/linker.hpp"
+#include "include/long_branches.hpp"
+#include "include/personalities/c64.hpp"
+#include "include/runtime.hpp"
+#include "include/simulator.hpp"
+#include "include/translation_cache.hpp"
+
+// far more than any of the test programs need to get back to BASIC
+constexpr std::uint64_t cycle_limit = 100'000'000;
 
 enum struct OptimizationLevel : char { O0 = '0', O1 = '1', O2 = '2', O3 = '3', Os = 's' };
 
@@ -15,8 +28,6 @@ std::vector<std::uint8_t> execute_c64_program(const std::string_view &name,
   std::uint16_t end_address_dump)
 {
 
-  const char *x64_executable = std::getenv("X64");
-  REQUIRE(x64_executable != nullptr);
   const char *mos6502_cpp_executable = std::getenv("CXX_6502");
   REQUIRE(mos6502_cpp_executable != nullptr);
 
@@ -51,9 +62,7 @@ std::vector<std::uint8_t> execute_c64_program(const std::string_view &name,
   }();
 
   const auto source_filename{ fmt::format("{}{}{}.cpp", name, optimization_level, optimize_6502_name) };
-  const auto vice_script_filename{ fmt::format("{}{}{}-vice_script", name, optimization_level, optimize_6502_name) };
   const auto prg_filename{ fmt::format("{}{}{}.prg", name, optimization_level, optimize_6502_name) };
-  const auto ram_dump_filename{ fmt::format("{}{}{}-ram_dump", name, optimization_level, optimize_6502_name) };
 
 
   {
@@ -61,42 +70,701 @@ std::vector<std::uint8_t> execute_c64_program(const std::string_view &name,
     source << script;
   }
 
-  {
-    std::ofstream vice_script(vice_script_filename);
-    vice_script << fmt::format(
-      R"(
-until e5d1
-l "{}" 0
-keybuf run\n
-until e147
-bsave "{}" 0 {:x} {:x}
-quit
-)",
-      prg_filename,
-      ram_dump_filename,
-      start_address_dump,
-      end_address_dump);
-  }
-
-
   REQUIRE(system(fmt::format(
             "{} {} -t C64 {} {}", mos6502_cpp_executable, source_filename, optimization_level, optimize_6502)
                    .c_str())
           == EXIT_SUCCESS);
-  REQUIRE(
-    system(fmt::format(
-      "xvfb-run -d {} +vsync -sounddev dummy +saveres -warp -moncommands {}", x64_executable, vice_script_filename)
-             .c_str())
-    == EXIT_SUCCESS);
 
-  std::ifstream memory_dump(ram_dump_filename, std::ios::binary);
+  std::ifstream prg_file(prg_filename, std::ios::binary);
+  const std::vector<std::uint8_t> prg{ std::istreambuf_iterator<char>(prg_file), std::istreambuf_iterator<char>() };
+
+  Simulator simulator;
+  REQUIRE(run_c64_prg(simulator, prg, cycle_limit));
+
+  const auto ram = simulator.ram(start_address_dump, end_address_dump);
+  return std::vector<std::uint8_t>{ ram.begin(), ram.end() };
+}
+
+TEST_CASE("Simulator runs a C64 program from its BASIC stub")
+{
+  // SYS 2061: lda #10; sta $0400; ldx #0; loop: txa; sta $0500,X; inx; bne loop;
+  //           sed; clc; lda #$19; adc #$28; sta $0401; cld; jsr $ffd2; rts
+  const std::vector<std::uint8_t> prg{ 0x01, 0x08, 0x0B, 0x08, 0x0A, 0x00, 0x9E, 0x32, 0x30, 0x36, 0x31, 0x00, 0x00,
+    0x00, 0xA9, 0x0A, 0x8D, 0x00, 0x04, 0xA2, 0x00, 0x8A, 0x9D, 0x00, 0x05, 0xE8, 0xD0, 0xF9, 0xF8, 0x18, 0xA9, 0x19,
+    0x69, 0x28, 0x8D, 0x01, 0x04, 0xD8, 0x20, 0xD2, 0xFF, 0x60 };
+
+  Simulator simulator;
+  REQUIRE(run_c64_prg(simulator, prg, cycle_limit));
+
+  CHECK(simulator.memory[0x400] == 10);
+  CHECK(simulator.memory[0x401] == 0x47);
+  CHECK(simulator.memory[0x5FF] == 0xFF);
+  CHECK(simulator.cycles == 8 + (12 * 256 - 1) + 14 + 12 + 6);
+}
+
+// the runtime helpers on their own at $1000, to be called the way avr-gcc calls them
+Simulator load_runtime(const RuntimeNeeds &needs, const MultiplyMode multiply)
+{
+  std::vector<mos6502> lines;
+  lines.emplace_back(ASMLine::Type::Directive, "* = $1000");
+  append_runtime(C64{}, needs, multiply, lines);
+  const auto assembled = Assembler::assemble(lines, false);
+
+  Simulator simulator;
+  std::copy(assembled.bytes.begin(), assembled.bytes.end(), std::next(simulator.memory.begin(), 0x1000));
+  return simulator;
+}
 
-  std::vector<char> data;
-  data.resize(static_cast<std::size_t>(end_address_dump - start_address_dump + 1));
-  memory_dump.read(data.data(), std::ssize(data));
+// sets AVR register pairs R25:R24 and R23:R22, calls the helper and returns R25:R24 and R23:R22
+std::pair<unsigned, unsigned> call_runtime(Simulator &simulator, const unsigned r25_r24, const unsigned r23_r22)
+{
+  const auto reg = [](const int number) { return register_address(C64{}, number); };
+  simulator.memory[reg(24)] = static_cast<std::uint8_t>(r25_r24);
+  simulator.memory[reg(25)] = static_cast<std::uint8_t>(r25_r24 >> 8);
+  simulator.memory[reg(22)] = static_cast<std::uint8_t>(r23_r22);
+  simulator.memory[reg(23)] = static_cast<std::uint8_t>(r23_r22 >> 8);
+  REQUIRE(simulator.call(0x1000, simulator.cycles + 10'000));
+  REQUIRE(simulator.memory[reg(1)] == 0);
+  return { simulator.memory[reg(24)] + 256u * simulator.memory[reg(25)],
+    simulator.memory[reg(22)] + 256u * simulator.memory[reg(23)] };
+}
 
-  std::vector<std::uint8_t> return_value{ data.begin(), data.end() };
-  return return_value;
+TEST_CASE("Runtime helpers are pulled in by their whole name")
+{
+  const auto needs = runtime_needs("\tcall __udivmodqi4\n\trcall __udivmodhi4\n\tcall __mulhi3\n");
+  CHECK(needs.udivmodqi4);
+  CHECK(needs.udivmodhi4);
+  CHECK(needs.mulhi3);
+  CHECK(!needs.divmodqi4);
+  CHECK(!needs.divmodhi4);
+  CHECK(!needs.mulqi3);
+
+  CHECK(runtime_needs("\tcall __divmodqi4").divmodqi4);
+  CHECK(!runtime_needs("\tcall __divmodqi4_x").divmodqi4);
+}
+
+TEMPLATE_TEST_CASE_SIG("Runtime multiply helpers compute the AVR product",
+  "",
+  ((MultiplyMode M), M),
+  MultiplyMode::fast,
+  MultiplyMode::compact)
+{
+  SECTION("__mulqi3, every pair")
+  {
+    auto simulator = load_runtime(RuntimeNeeds{ .mulqi3 = true }, M);
+    for (unsigned a = 0; a < 0x100; ++a) {
+      for (unsigned b = 0; b < 0x100; ++b) { CHECK((call_runtime(simulator, a, b).first & 0xFF) == ((a * b) & 0xFF)); }
+    }
+  }
+
+  SECTION("__mulhi3")
+  {
+    auto simulator = load_runtime(RuntimeNeeds{ .mulhi3 = true }, M);
+    for (unsigned a = 0; a < 0x10000; a += 0x0101) {
+      for (unsigned b = 0; b < 0x10000; b += 0x0107) { CHECK(call_runtime(simulator, a, b).first == ((a * b) & 0xFFFF)); }
+    }
+  }
+}
+
+TEST_CASE("Runtime divmod helpers compute the AVR quotient and remainder")
+{
+  // libgcc's answer when dividing by 0
+  const auto udivmod = [](const unsigned a, const unsigned b, const unsigned all_ones) {
+    return b == 0 ? std::pair{ all_ones, a } : std::pair{ a / b, a % b };
+  };
+
+  SECTION("__udivmodqi4, every pair")
+  {
+    auto simulator = load_runtime(RuntimeNeeds{ .udivmodqi4 = true }, MultiplyMode::fast);
+    for (unsigned a = 0; a < 0x100; ++a) {
+      for (unsigned b = 0; b < 0x100; ++b) {
+        const auto [quotient, remainder] = udivmod(a, b, 0xFF);
+        const auto result                = call_runtime(simulator, a, b).first;
+        CHECK(result == quotient + 256 * remainder);
+      }
+    }
+  }
+
+  SECTION("__divmodqi4, every pair")
+  {
+    auto simulator = load_runtime(RuntimeNeeds{ .divmodqi4 = true }, MultiplyMode::fast);
+    for (int a = -128; a < 128; ++a) {
+      for (int b = -128; b < 128; ++b) {
+        if (b == 0) { continue; }
+        const auto result = call_runtime(simulator, static_cast<std::uint8_t>(a), static_cast<std::uint8_t>(b)).first;
+        CHECK(result == static_cast<std::uint8_t>(a / b) + 256u * static_cast<std::uint8_t>(a % b));
+      }
+    }
+  }
+
+  // every dividend high byte against divisors that are small, big and close to $8000 and $FFFF
+  std::vector<unsigned> divisors;
+  for (unsigned b = 0; b < 0x10000; b += 0x0107) { divisors.push_back(b); }
+  for (unsigned b = 1; b < 0x20; ++b) { divisors.insert(divisors.end(), { b, 0x8000 - b, 0x8000 + b, 0x10000 - b }); }
+
+  SECTION("__udivmodhi4")
+  {
+    auto simulator = load_runtime(RuntimeNeeds{ .udivmodhi4 = true }, MultiplyMode::fast);
+    for (unsigned a = 0; a < 0x10000; a += 0x0101) {
+      for (const auto b : divisors) {
+        const auto expected = udivmod(a, b, 0xFFFF);
+        const auto result   = call_runtime(simulator, a, b);
+        CHECK(result.second == expected.first);
+        CHECK(result.first == expected.second);
+      }
+    }
+  }
+
+  SECTION("__divmodhi4")
+  {
+    auto simulator = load_runtime(RuntimeNeeds{ .divmodhi4 = true }, MultiplyMode::fast);
+    for (unsigned a = 0; a < 0x10000; a += 0x0101) {
+      for (const auto b : divisors) {
+        if (b == 0) { continue; }
+        const auto dividend = static_cast<std::int16_t>(a);
+        const auto divisor  = static_cast<std::int16_t>(b);
+        const auto result   = call_runtime(simulator, a, b);
+        CHECK(result.second == static_cast<std::uint16_t>(dividend / divisor));
+        CHECK(result.first == static_cast<std::uint16_t>(dividend % divisor));
+      }
+    }
+  }
+}
+
+TEST_CASE("Translation cache stores, finds and misses entries")
+{
+  // moving bytes from one input to the next makes a different key
+  CHECK(TranslationCache::key({ "ab", "c" }) == TranslationCache::key({ "ab", "c" }));
+  CHECK(TranslationCache::key({ "ab", "c" }) != TranslationCache::key({ "a", "bc" }));
+  CHECK(TranslationCache::key({ "C64", "" }) != TranslationCache::key({ "C64", "optimize" }));
+
+  const auto directory = std::filesystem::temp_directory_path() / "6502-c++-translation-cache-test";
+  std::filesystem::remove_all(directory);
+
+  TranslationCache cache(directory);
+  CHECK(!cache.load(1));
+
+  const TranslationCache::Entry entry{ "\tlda #1\n", { 0x01, 0x08, 0xA9, 0x01 }, 12.5 };
+  cache.store(1, entry);
+  // the .prg, the .6502.asm and the .ms, no temporaries are left behind
+  CHECK(std::distance(std::filesystem::directory_iterator(directory), std::filesystem::directory_iterator()) == 3);
+
+  const auto loaded = cache.load(1);
+  REQUIRE(loaded);
+  CHECK(loaded->assembly == entry.assembly);
+  CHECK(loaded->program == entry.program);
+  CHECK(loaded->translate_ms > 12.4);
+  CHECK(loaded->translate_ms < 12.6);
+  CHECK(!cache.load(2));
+
+  // the time is written last, an entry without it is incomplete
+  std::filesystem::remove(directory / fmt::format("{:016x}.ms", 1));
+  CHECK(!cache.load(1));
+
+  std::filesystem::remove_all(directory);
+}
+
+// a line of a hand written program for the linker tests
+mos6502 line(const mos6502::OpCode opcode, const std::string_view operand = {})
+{
+  if (operand.empty()) { return mos6502(opcode); }
+  return mos6502(opcode, Operand(Operand::Type::literal, std::string{ operand }));
+}
+
+std::vector<std::string> labels_of(const std::vector<mos6502> &program)
+{
+  std::vector<std::string> labels;
+  for (const auto &l : program) {
+    if (l.type == ASMLine::Type::Label) { labels.push_back(l.text); }
+  }
+  return labels;
+}
+
+TEST_CASE("Unreachable functions and data are removed")
+{
+  using enum mos6502::OpCode;
+  using Type = ASMLine::Type;
+
+  std::vector<mos6502> program{ mos6502(Type::Directive, "* = $0801"),
+    line(jmp, "main"),
+    // nobody calls it
+    mos6502(Type::Label, "helper"),
+    line(lda, "#1"),
+    line(rts),
+    mos6502(Type::Label, "main"),
+    line(jsr, "used"),
+    line(jsr, "copy"),
+    line(lda, "#<(jump_table)"),
+    line(rts),
+    mos6502(Type::Label, "used"),
+    line(lda, "$1234"),
+    // only reached by falling into it
+    mos6502(Type::Label, "falls_through"),
+    line(rts),
+    mos6502(Type::Directive, "; Label is unused: old"),
+    line(lda, "#2"),
+    line(rts),
+    mos6502(Type::Label, "copy"),
+    line(jmp, "copy_test"),
+    // only reached by the branch back to it, which doesn't have the `-`
+    mos6502(Type::Label, "-memcpy_0"),
+    line(dey),
+    mos6502(Type::Label, "copy_test"),
+    line(bne, "memcpy_0"),
+    line(rts),
+    mos6502(Type::Label, "jump_table"),
+    mos6502(Type::Directive, ".word case_one"),
+    mos6502(Type::Label, "case_one"),
+    line(rts),
+    // a table only an unreachable table points to
+    mos6502(Type::Label, "pointers"),
+    mos6502(Type::Directive, ".word unused_data"),
+    mos6502(Type::Label, "unused_data"),
+    mos6502(Type::Directive, ".byt 5,6"),
+    mos6502(Type::Label, "__vector_5"),
+    line(jsr, "from_interrupt"),
+    line(jmp, "$ea31"),
+    mos6502(Type::Label, "from_interrupt"),
+    line(rts) };
+
+  const auto reclaimed = remove_unreachable_code(program);
+
+  const std::vector<std::string> kept{ "main",
+    "used",
+    "falls_through",
+    "copy",
+    "-memcpy_0",
+    "copy_test",
+    "jump_table",
+    "case_one",
+    "__vector_5",
+    "from_interrupt" };
+  CHECK(labels_of(program) == kept);
+  CHECK(reclaimed.regions == 4);
+  // lda #1 / rts, lda #2 / rts, .word unused_data, .byt 5,6
+  CHECK(reclaimed.bytes == 3 + 3 + 2 + 2);
+  CHECK(program.front().text == "* = $0801");
+  CHECK(program[1].opcode == jmp);
+}
+
+TEST_CASE("Removing an unused helper keeps the square tables aligned")
+{
+  using enum mos6502::OpCode;
+  using Type = ASMLine::Type;
+
+  // the text search pulls in __udivmodhi4 for a function that is never called, the tables come right after it
+  std::vector<mos6502> program{ mos6502(Type::Directive, "* = $1000"),
+    line(jmp, "main"),
+    mos6502(Type::Label, "main"),
+    line(jsr, "__mulqi3"),
+    line(rts),
+    mos6502(Type::Label, "unused"),
+    line(jsr, "__udivmodhi4"),
+    line(rts) };
+  append_runtime(C64{}, RuntimeNeeds{ .mulqi3 = true, .udivmodhi4 = true }, MultiplyMode::fast, program);
+  remove_unreachable_code(program);
+  const auto assembled = Assembler::assemble(program, false);
+
+  Simulator simulator;
+  std::copy(assembled.bytes.begin(), assembled.bytes.end(), std::next(simulator.memory.begin(), 0x1000));
+  for (unsigned a = 0; a < 0x100; ++a) {
+    for (unsigned b = 0; b < 0x100; ++b) { CHECK((call_runtime(simulator, a, b).first & 0xFF) == ((a * b) & 0xFF)); }
+  }
+}
+
+TEST_CASE("Linked units keep their own local labels")
+{
+  using enum mos6502::OpCode;
+  using Type = ASMLine::Type;
+
+  std::vector<TranslatedUnit> units(2);
+  units[0].instructions = { mos6502(Type::Label, "main"),
+    line(jsr, "helper"),
+    mos6502(Type::Label, "L2"),
+    line(bne, "L2"),
+    line(lda, "#<(L2+1)"),
+    line(rts) };
+  units[0].annotations.notes = { "main note" };
+  units[0].instructions[3].annotation = 1;
+
+  units[1].instructions = { mos6502(Type::Label, "helper"),
+    mos6502(Type::Label, "L2"),
+    line(bne, "L2"),
+    line(rts),
+    mos6502(Type::Label, "table"),
+    mos6502(Type::Directive, ".word L2,table") };
+  units[1].annotations.notes = { "first helper note", "second helper note" };
+  units[1].instructions[2].annotation = 2;
+
+  Annotations annotations;
+  const auto  program = link_units(units, annotations);
+
+  const std::vector<std::string> labels{ "main", "u0_L2", "helper", "u1_L2", "table" };
+  CHECK(labels_of(program) == labels);
+
+  // the call into the other unit goes to the global as it is, each branch to the L2 of its own unit
+  CHECK(program[1].op.name() == "helper");
+  CHECK(program[3].op.name() == "u0_L2");
+  CHECK(program[4].op.value() == "#<(u0_L2+1)");
+  CHECK(program[8].op.name() == "u1_L2");
+  CHECK(program[11].text == ".word u1_L2,table");
+
+  // the notes of the second unit come after the ones of the first
+  const std::vector<std::string> notes{ "main note", "first helper note", "second helper note" };
+  CHECK(annotations.notes == notes);
+  CHECK(program[3].annotation == 1);
+  CHECK(program[8].annotation == 3);
+}
+
+TEST_CASE("Assembler produces the bytes xa would")
+{
+  using enum mos6502::OpCode;
+  using Type = ASMLine::Type;
+
+  SECTION("a C64 program behind its BASIC stub")
+  {
+    std::vector<mos6502> program;
+    C64{}.insert_autostart_sequence(program);
+    program.insert(program.end(),
+      { mos6502(Type::Label, "start"),
+        line(ldx, "#0"),
+        // the loops reuse their label, each branch goes back to the one right above it
+        mos6502(Type::Label, "-loop"),
+        line(inx),
+        line(bne, "loop"),
+        mos6502(Type::Label, "-loop"),
+        line(dey),
+        line(bne, "loop"),
+        line(jmp, "end"),
+        line(lda, "#<table"),
+        line(ldx, "#>table"),
+        mos6502(Type::Label, "end"),
+        line(rts),
+        mos6502(Type::Directive, ".align 4"),
+        mos6502(Type::Label, "table"),
+        mos6502(Type::Directive, ".byt 1,$ff,%101,>end"),
+        mos6502(Type::Directive, ".word table+2, end-start, loop, -1+start") });
+
+    const std::vector<std::uint8_t> expected{ 0x01, 0x08, 0x0B, 0x08, 0x0A, 0x00, 0x9E, 0x32, 0x30, 0x36, 0x31, 0x00,
+      0x00, 0x00,
+      // $080d
+      0xA2, 0x00, 0xE8, 0xD0, 0xFD, 0x88, 0xD0, 0xFD, 0x4C, 0x1C, 0x08, 0xA9, 0x20, 0xA2, 0x08, 0x60,
+      // .align 4
+      0x00, 0x00, 0x00,
+      // $0820
+      0x01, 0xFF, 0x05, 0x08, 0x22, 0x08, 0x0F, 0x00, 0x12, 0x08, 0x0C, 0x08 };
+    CHECK(Assembler::assemble(program, false).bytes == expected);
+  }
+
+  SECTION("branches")
+  {
+    const auto branch_over = [](const std::string_view padding) {
+      const std::vector<mos6502> program{ mos6502(Type::Directive, "* = $1000"),
+        line(bne, "target"),
+        mos6502(Type::Directive, ".align $80"),
+        mos6502(Type::Directive, std::string{ padding }),
+        mos6502(Type::Label, "target"),
+        line(rts) };
+      return Assembler::assemble(program, false).bytes;
+    };
+
+    CHECK(branch_over(".byt 0")[1] == 0x7F);
+    REQUIRE_THROWS_AS(branch_over(".byt 0,0"), std::runtime_error);
+
+    const std::vector<mos6502> backward{ mos6502(Type::Directive, "* = $1000"),
+      mos6502(Type::Label, "target"),
+      mos6502(Type::Directive, ".byt 0"),
+      mos6502(Type::Directive, ".align $80"),
+      line(bne, "target") };
+    REQUIRE_THROWS_AS(Assembler::assemble(backward, false), std::runtime_error);
+  }
+}
+
+TEST_CASE("Branches that cannot reach their target are widened")
+{
+  using enum mos6502::OpCode;
+  using Type = ASMLine::Type;
+
+  const auto zeros = [](const std::size_t count) {
+    std::string bytes = ".byt 0";
+    for (std::size_t byte = 1; byte < count; ++byte) { bytes += ",0"; }
+    return mos6502(Type::Directive, bytes);
+  };
+
+  const auto opcodes = [](const std::vector<mos6502> &program) {
+    std::vector<mos6502::OpCode> result;
+    for (const auto &instruction : program) {
+      if (instruction.type == Type::Instruction) { result.push_back(instruction.opcode); }
+    }
+    return result;
+  };
+
+  SECTION("until widening one does not push another out of range")
+  {
+    // `bne near` reaches exactly 127 bytes, until `beq far` in between it grows by 3
+    std::vector<mos6502> program{ mos6502(Type::Directive, "* = $1000"),
+      line(bne, "near"),
+      line(beq, "far"),
+      zeros(125),
+      mos6502(Type::Label, "near"),
+      zeros(10),
+      mos6502(Type::Label, "far"),
+      line(rts) };
+
+    CHECK(fix_long_branches(program) == 2);
+    CHECK(opcodes(program) == std::vector{ beq, jmp, bne, jmp, rts });
+    CHECK_NOTHROW(Assembler::assemble(program, false));
+  }
+
+  SECTION("each against its own definition of a reused label")
+  {
+    std::vector<mos6502> program{ mos6502(Type::Directive, "* = $1000"),
+      mos6502(Type::Label, "-memcpy_0"),
+      line(dey),
+      line(bne, "memcpy_0"),
+      zeros(200),
+      // still the first definition, 200 bytes back
+      line(bne, "memcpy_0"),
+      mos6502(Type::Label, "-memcpy_0"),
+      line(dey),
+      line(bne, "memcpy_0"),
+      line(rts) };
+
+    CHECK(fix_long_branches(program) == 1);
+    CHECK(opcodes(program) == std::vector{ dey, bne, beq, jmp, dey, bne, rts });
+    CHECK_NOTHROW(Assembler::assemble(program, false));
+  }
+}
+
+// the indexes of the lines a pass removed
+std::vector<std::size_t> removed_lines(const std::vector<mos6502> &program)
+{
+  std::vector<std::size_t> removed;
+  for (std::size_t index = 0; index < program.size(); ++index) {
+    if (program[index].is_removed()) { removed.push_back(index); }
+  }
+  return removed;
+}
+
+TEST_CASE("Liveness follows branches, calls and returns")
+{
+  using enum mos6502::OpCode;
+  using Type = ASMLine::Type;
+
+  const VirtualRegisters virtual_registers(C64{});
+  const auto             r = [](const int reg_num) { return Registers::virtual_register(reg_num); };
+
+  SECTION("what a line reads and writes")
+  {
+    const auto store = effects_of(line(sta, "$66"), virtual_registers);
+    CHECK(store.uses == Registers::A);
+    CHECK(store.defines == r(24));
+    CHECK(!store.has_side_effects);
+
+    const auto indirect = effects_of(line(sta, "($6c), Y"), virtual_registers);
+    CHECK(indirect.uses == (Registers::A | Registers::Y | r(30) | r(31)));
+    CHECK(indirect.has_side_effects);
+
+    CHECK(effects_of(line(lda, "$1234"), virtual_registers).has_side_effects);
+    CHECK(effects_of(line(adc, "$64"), virtual_registers).uses == (Registers::A | Registers::C | r(22)));
+    CHECK(effects_of(line(bne, "label"), virtual_registers).uses == Registers::Z);
+    CHECK(effects_of(line(jsr, "function"), virtual_registers).uses == Registers::virtual_registers);
+  }
+
+  SECTION("across a branch and out of the program")
+  {
+    const std::vector<mos6502> program{ line(lda, "$66"),
+      line(bne, "skip"),
+      line(lda, "#1"),
+      line(sta, "$64"),
+      mos6502(Type::Label, "skip"),
+      line(rts) };
+    const ControlFlowGraph cfg(program);
+    const Liveness         liveness(program, cfg, virtual_registers);
+
+    // the branch reads Z, neither way reads A
+    CHECK((liveness.live_after(0) & Registers::Z) != 0);
+    CHECK((liveness.live_after(0) & Registers::A) == 0);
+    // whoever called this sees every virtual register, none of A, X, Y and the flags
+    CHECK((liveness.live_after(3) & Registers::virtual_registers) == Registers::virtual_registers);
+    CHECK((liveness.live_after(3) & (Registers::A | Registers::flags)) == 0);
+  }
+
+  SECTION("into a call")
+  {
+    const std::vector<mos6502> program{ line(lda, "#1"), line(sta, "$66"), line(jsr, "function"), line(rts) };
+    const ControlFlowGraph     cfg(program);
+    const Liveness             liveness(program, cfg, virtual_registers);
+
+    CHECK((liveness.live_after(1) & r(24)) != 0);
+    CHECK((liveness.live_after(1) & Registers::A) == 0);
+  }
+}
+
+TEST_CASE("Dead loads and stores are removed, lines with side effects stay")
+{
+  using enum mos6502::OpCode;
+  using Type = ASMLine::Type;
+
+  const VirtualRegisters virtual_registers(C64{});
+  const auto             remove_dead_code = [&](std::vector<mos6502> &program) {
+    const ControlFlowGraph cfg(program);
+    optimize_dead_code(program, Liveness(program, cfg, virtual_registers), virtual_registers);
+    return removed_lines(program);
+  };
+
+  std::vector<mos6502> program{ line(lda, "#1"),
+    // overwritten before anyone reads it
+    line(sta, "$66"),
+    line(lda, "#2"),
+    line(sta, "$66"),
+    // A, N and Z are set again right away
+    line(lda, "$64"),
+    line(lda, "#3"),
+    line(sta, "($6c), Y"),
+    // the branch reads its Z
+    line(lda, "$65"),
+    line(bne, "end"),
+    line(lda, "#4"),
+    // the caller may read it
+    line(sta, "$67"),
+    mos6502(Type::Label, "end"),
+    line(rts) };
+  CHECK(remove_dead_code(program) == std::vector<std::size_t>{ 1, 4 });
+
+  // whatever is called may read the virtual registers
+  std::vector<mos6502> call{ line(lda, "#5"),
+    line(sta, "$68"),
+    line(jsr, "function"),
+    line(lda, "#6"),
+    line(sta, "$68"),
+    line(rts) };
+  CHECK(remove_dead_code(call).empty());
+}
+
+TEST_CASE("Loads of values a register already holds are removed")
+{
+  using enum mos6502::OpCode;
+  using Type = ASMLine::Type;
+
+  const VirtualRegisters virtual_registers(C64{});
+  const auto             remove_known_loads = [&](std::vector<mos6502> &program) {
+    const ControlFlowGraph cfg(program);
+    optimize_known_register_contents(program, cfg, Liveness(program, cfg, virtual_registers), virtual_registers);
+    return removed_lines(program);
+  };
+
+  const auto add_chain = [] {
+    return std::vector<mos6502>{ line(lda, "$66"),
+      line(clc),
+      line(adc, "$64"),
+      line(sta, "$66"),
+      line(lda, "$66"),
+      line(clc),
+      line(adc, "$62"),
+      line(sta, "$66"),
+      line(rts) };
+  };
+
+  SECTION("when nothing reads the flags the load sets")
+  {
+    auto program = add_chain();
+    CHECK(remove_known_loads(program) == std::vector<std::size_t>{ 4 });
+  }
+
+  SECTION("not when a branch reads them")
+  {
+    std::vector<mos6502> program{ line(sta, "$66"),
+      line(lda, "$66"),
+      line(beq, "end"),
+      line(lda, "#1"),
+      line(sta, "$64"),
+      mos6502(Type::Label, "end"),
+      line(rts) };
+    CHECK(remove_known_loads(program).empty());
+  }
+
+  SECTION("not after a store to the register it was loaded from")
+  {
+    std::vector<mos6502> program{
+      line(ldx, "$66"), line(lda, "#7"), line(sta, "$66"), line(ldx, "$66"), line(stx, "$64"), line(rts)
+    };
+    CHECK(remove_known_loads(program).empty());
+
+    // a store to any other register leaves X alone
+    std::vector<mos6502> other{
+      line(ldx, "$66"), line(lda, "#7"), line(sta, "$68"), line(ldx, "$66"), line(stx, "$64"), line(rts)
+    };
+    CHECK(remove_known_loads(other) == std::vector<std::size_t>{ 3 });
+  }
+
+  SECTION("not after a store through a pointer")
+  {
+    std::vector<mos6502> program{
+      line(lda, "$66"), line(sta, "($6c), Y"), line(lda, "$66"), line(sta, "$64"), line(rts)
+    };
+    CHECK(remove_known_loads(program).empty());
+  }
+
+  SECTION("not after a call")
+  {
+    std::vector<mos6502> program{ line(lda, "$66"), line(jsr, "function"), line(lda, "$66"), line(sta, "$64"), line(rts) };
+    CHECK(remove_known_loads(program).empty());
+  }
+
+  SECTION("the whole optimizer shortens the chain")
+  {
+    auto        program = add_chain();
+    Annotations annotations;
+    optimize(program, C64{}, annotations);
+
+    std::vector<std::string> instructions;
+    for (const auto &instruction : program) {
+      if (instruction.type == Type::Instruction) {
+        const auto operand = instruction.op.value();
+        instructions.push_back(fmt::format("{}{}{}", mos6502::to_string(instruction.opcode), operand.empty() ? "" : " ", operand));
+      }
+    }
+    CHECK(instructions == std::vector<std::string>{ "lda $66", "clc", "adc $64", "clc", "adc $62", "sta $66", "rts" });
+  }
+}
+
+TEST_CASE("16 bit flag fix-ups are only dropped when nothing reads their Z or A")
+{
+  using enum mos6502::OpCode;
+  using Type = ASMLine::Type;
+
+  // a 16 bit subtract followed by the fix-up the translator emits for it, then `tail`
+  const auto fixup_removed = [](std::vector<mos6502> tail) {
+    std::vector<mos6502> program{
+      line(lda, "$66"), line(sec), line(sbc, "$64"), line(tax), line(lda, "$67"), line(sbc, "$65")
+    };
+    const auto first = program.size();
+    program.emplace_back(Type::Directive, "; BEGIN 16 bit N / Z flag fix-up");
+    program.push_back(line(bmi, "fixup_16_bit_op_flags7"));
+    program.push_back(line(bne, "fixup_16_bit_op_flags7"));
+    program.push_back(line(txa));
+    program.push_back(line(bpl, "fixup_16_bit_op_flags7"));
+    program.push_back(line(lda, "#1"));
+    program.emplace_back(Type::Label, "fixup_16_bit_op_flags7");
+    program.emplace_back(Type::Directive, "; END 16 bit N / Z flag fix-up");
+    const auto end = program.size();
+    for (auto index = first; index < end; ++index) { program[index].flag_fixup = static_cast<std::uint32_t>(first + 1); }
+    program.insert(program.end(), tail.begin(), tail.end());
+
+    CHECK(optimize_unused_flag_fixups(program, VirtualRegisters(C64{})) == (program[first].is_removed() ? 1 : 0));
+    for (auto index = first; index < end; ++index) { CHECK(program[index].is_removed() == program[first].is_removed()); }
+    return program[first].is_removed();
+  };
+
+  // A and Z are set again before anyone looks at them
+  CHECK(fixup_removed({ line(lda, "#0"), line(sta, "$68"), line(rts) }));
+
+  CHECK(!fixup_removed({ line(beq, "equal"), line(rts), mos6502(Type::Label, "equal"), line(rts) }));
+  CHECK(!fixup_removed({ line(bne, "different"), line(rts), mos6502(Type::Label, "different"), line(rts) }));
+  CHECK(!fixup_removed({ line(php), line(lda, "#0"), line(plp), line(rts) }));
+  // the fix-up changes A, too
+  CHECK(!fixup_removed({ line(sta, "$68"), line(rts) }));
 }
 
 TEMPLATE_TEST_CASE_SIG("Can write to memory",
@@ -236,3 +904,104 @@ int main()
     for (std::size_t y = 0; y < 25; ++y) { CHECK(result[y * 40 + x] == y); }
   }
 }
+
+TEMPLATE_TEST_CASE_SIG("Copy and clear blocks of memory",
+  "",
+  ((OptimizationLevel O, Optimize6502 O6502), O, O6502),
+  (OptimizationLevel::Os, Optimize6502::Enabled),
+  (OptimizationLevel::O1, Optimize6502::Disabled),
+  (OptimizationLevel::O1, Optimize6502::Enabled),
+  (OptimizationLevel::O3, Optimize6502::Enabled))
+{
+  // a struct copy, a memset and a memcpy of known size are expanded into avr-gcc's ld Z+ / st X+ loops
+  constexpr static std::string_view program =
+    R"(
+struct Row
+{
+  unsigned char cells[40];
+};
+
+int main()
+{
+  Row row;
+  for (unsigned char x = 0; x < 40; ++x) { row.cells[x] = x; }
+  *reinterpret_cast<Row *>(0x400) = row;
+
+  __builtin_memset(reinterpret_cast<unsigned char *>(0x428), 0, 400);
+  __builtin_memcpy(reinterpret_cast<unsigned char *>(0x5B8), reinterpret_cast<const unsigned char *>(0x400), 300);
+}
+)";
+
+  const auto result = execute_c64_program("copy_and_clear_blocks", program, O, O6502, 0x400, 0x6E3);
+
+  REQUIRE(result.size() == 740);
+
+  for (std::size_t index = 0; index < 440; ++index) { CHECK(result[index] == (index < 40 ? index : 0)); }
+  for (std::size_t index = 0; index < 300; ++index) { CHECK(result[440 + index] == result[index]); }
+}
+
+TEMPLATE_TEST_CASE_SIG("Walk pointers through memory",
+  "",
+  ((OptimizationLevel O, Optimize6502 O6502), O, O6502),
+  (OptimizationLevel::Os, Optimize6502::Enabled),
+  (OptimizationLevel::O1, Optimize6502::Disabled),
+  (OptimizationLevel::O1, Optimize6502::Enabled),
+  (OptimizationLevel::O3, Optimize6502::Enabled))
+{
+  // loops that post-increment their pointers, across page boundaries and with the pointers used afterwards
+  constexpr static std::string_view program =
+    R"(
+int main()
+{
+  auto *screen = reinterpret_cast<volatile unsigned char *>(0x400);
+  for (auto *cell = screen; cell != screen + 300; ++cell) { *cell = 1; }
+
+  auto *from = screen;
+  auto *to   = screen + 300;
+  while (from != screen + 300) { *to++ = static_cast<unsigned char>(*from++ + 1); }
+  *to = 3;
+}
+)";
+
+  const auto result = execute_c64_program("walk_pointers", program, O, O6502, 0x400, 0x658);
+
+  REQUIRE(result.size() == 601);
+
+  for (std::size_t index = 0; index < 600; ++index) { CHECK(result[index] == (index < 300 ? 1 : 2)); }
+  CHECK(result[600] == 3);
+}
+
+TEMPLATE_TEST_CASE_SIG("Keep the flags a loop branches on",
+  "",
+  ((OptimizationLevel O, Optimize6502 O6502), O, O6502),
+  (OptimizationLevel::O1, Optimize6502::Disabled),
+  (OptimizationLevel::O1, Optimize6502::Enabled))
+{
+  // ld / st leave the AVR flags alone, so the counter can be decremented before the store that goes with it
+  constexpr static std::string_view program =
+    R"(
+int main()
+{
+  asm volatile("ldi r26,lo8(0x400)\n\t"
+               "ldi r27,hi8(0x400)\n\t"
+               "ldi r18,200\n\t"
+               "ldi r24,5\n"
+               ".Lfill:\n\t"
+               "dec r18\n\t"
+               "st X+,r24\n\t"
+               "brne .Lfill\n\t"
+               "ldi r24,7\n\t"
+               "st X,r24"
+               :
+               :
+               : "r18", "r24", "r26", "r27", "memory");
+}
+)";
+
+  const auto result = execute_c64_program("keep_loop_flags", program, O, O6502, 0x400, 0x4C8);
+
+  REQUIRE(result.size() == 201);
+
+  for (std::size_t index = 0; index < 200; ++index) { CHECK(result[index] == 5); }
+  CHECK(result[200] == 7);
+}